@@ -3,44 +3,325 @@
  * and count the numbers of hits, misses, evictions, dirty bytes in cache and 
  * evicted.
  *
+ * A trace is read from a file, a FIFO or stdin ("-t -"), so it can come
+ * straight from a tracing tool or a decompressor. Unless the trace is a
+ * regular binary file, which is mapped, a reader thread parses it into a
+ * few fixed-size batches while the simulation consumes the previous ones.
+ *
+ * With -o, it attributes accesses, misses and evictions to address regions
+ * and writes them to a CSV file, per interval of accesses with -n.
+ *
+ * With -H, it simulates a hierarchy of caches (split L1I/L1D, then shared
+ * lower levels) where misses and dirty write-backs of one level become
+ * requests to the next, and reports the memory traffic of the last level.
+ *
+ * With -w, it sweeps a grid of LRU configurations in a single pass over the
+ * trace, using one LRU stack-distance simulation per (s, b) pair. Link with
+ * -pthread.
+ *
+ * Tag lookup and LRU victim search use AVX2 or NEON when the compiler
+ * targets them (e.g. -mavx2 or -march=native), and plain loops otherwise.
+ *
  * Author: Jinyi Li
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include "cachelab.h"
 
 #define MAX_UNSIGNED 0xFFFFFFFFFFFFFFFF
+/* magic bytes at the beginning of a binary trace file */
+#define TRACE_MAGIC "CSIMTRC1"
+#define TRACE_MAGIC_LEN 8
+/* requests per batch handed from the trace reader thread to consumers, and
+ * batches in flight, so a streamed trace uses bounded memory */
+#define BATCH_RECORDS (1 << 16)
+#define NUM_BATCHES 2
+/* regions tracked by the stride prefetcher, and the region size */
+#define STRIDE_ENTRIES 256
+#define REGION_BITS 12
+/* streams tracked by the stream prefetcher, and how far in blocks a miss
+ * may be from a stream to continue it */
+#define STREAM_ENTRIES 16
+#define STREAM_WINDOW 16
+/* blocks remembered after a prefetch evicted them */
+#define POLLUTION_FILTER_SIZE 4096
+/* blocks prefetched per trigger unless -p gives a degree */
+#define DEFAULT_PREFETCH_DEGREE 2
+/* most levels in a cache hierarchy */
+#define MAX_LEVELS 8
+/* most values in one sweep list */
+#define MAX_SWEEP_VALUES 64
+/* largest re-reference prediction value of 2-bit SRRIP */
+#define RRPV_MAX 3
+/* regions counted by the profiler, plus one entry for the regions that
+ * find no free slot within PROFILE_PROBES probes */
+#define PROFILE_ENTRY_BITS 16
+#define PROFILE_ENTRIES (1 << PROFILE_ENTRY_BITS)
+#define PROFILE_PROBES 16
+/* region size of the profiler unless -g gives one: 4KB pages */
+#define DEFAULT_PROFILE_BITS 12
+/* regions listed after the summary in profile mode */
+#define PROFILE_TOP 10
+
+/* replacement policies selectable with -r */
+typedef enum{
+    POLICY_LRU,
+    POLICY_PLRU,
+    POLICY_SRRIP,
+    POLICY_RANDOM,
+    POLICY_FIFO
+}ReplacementPolicy;
+
+/* inclusion policies between the levels of a hierarchy, selected with -i */
+typedef enum{
+    INCLUSION_NINE,
+    INCLUSION_INCLUSIVE,
+    INCLUSION_EXCLUSIVE
+}InclusionPolicy;
+
+/* hardware prefetchers selectable with -p */
+typedef enum{
+    PREFETCH_NEXT_LINE,
+    PREFETCH_STRIDE,
+    PREFETCH_STREAM
+}PrefetchKind;
 
-/* represent one line in cache. */
+/* represent the outcome of one access: whether it hit, and which line it
+ * evicted, so a hierarchy can forward the victim to the next level. */
 typedef struct{
-    int validBit;
-    int dirtyBit;
-    int tag;
-    long lruTimestamp;
-}CacheLine;
+    int hit;
+    int evicted;
+    unsigned long victimAddress;
+    int victimDirty;
+}CacheAccess;
 
-/* represent one cache structure. */
+/* represent the counters of a simulation; each worker thread of a parallel
+ * simulation keeps its own and they are summed at the end. */
+typedef struct CacheStats{
+    long hits;
+    long misses;
+    long evictions;
+    long dirtyBlocksInCache;
+    long dirtyBlocksEvicted;
+}CacheStats;
+
+/* represent the stride seen in one region by the stride prefetcher. The
+ * traces carry no PC, so strides are learned per region instead. */
+typedef struct{
+    int valid;
+    unsigned long region;
+    unsigned long lastAddress;
+    long stride;
+    int confidence;
+}StrideEntry;
+
+/* represent one sequential stream followed by the stream prefetcher. */
+typedef struct{
+    int valid;
+    unsigned long lastBlock;
+    /* +1 or -1 once confirmed, 0 while training */
+    int direction;
+    long lastUse;
+}StreamEntry;
+
+/* represent a prefetcher attached to a cache, with its training tables and
+ * the counters of how well it did. */
+typedef struct Prefetcher{
+    PrefetchKind kind;
+    int degree;
+    StrideEntry strides[STRIDE_ENTRIES];
+    StreamEntry streams[STREAM_ENTRIES];
+    long streamClock;
+    /* block + 1 of demand lines evicted by prefetches, 0 if empty */
+    unsigned long pollutionFilter[POLLUTION_FILTER_SIZE];
+    /* counters of prefetch fills, kept apart from the demand counters */
+    CacheStats fillStats;
+    /* prefetches that filled a line, and those already cached */
+    long issued;
+    long redundant;
+    /* prefetched lines later hit by a demand access */
+    long useful;
+    /* prefetched lines evicted before any demand access */
+    long uselessEvicted;
+    /* demand lines evicted by prefetches, and misses on them afterwards */
+    long pollutingEvictions;
+    long pollutionMisses;
+}Prefetcher;
+
+/* represent the counters of one address region in the profiler. */
 typedef struct{
+    /* region number + 1, 0 if the entry is empty */
+    unsigned long region;
+    long accesses;
+    long misses;
+    /* lines of this region evicted, whoever caused it */
+    long evictions;
+    /* the same counters since the last interval row */
+    long intervalAccesses;
+    long intervalMisses;
+    long intervalEvictions;
+    /* whether the entry is listed in the profiler's touched entries */
+    int touched;
+}RegionCounters;
+
+/* represent a profiler attached to a cache, attributing misses and
+ * evictions to address regions. All tables are allocated up front. */
+typedef struct Profiler{
+    int regionBits;
+    /* accesses per interval row, 0 for one row per region at the end */
+    long interval;
+    FILE *output;
+    /* PROFILE_ENTRIES + 1 entries, the last one for overflowing regions */
+    RegionCounters *regions;
+    /* entries with nonzero interval counters */
+    long *touched;
+    long numTouched;
+    long accesses;
+    long intervalStart;
+}Profiler;
+
+/* represent one cache structure. Line metadata is stored as flat arrays
+ * indexed by (setIndex * e + line); valid and dirty bits and the tree-PLRU
+ * bits are packed into maskWords 64-bit masks per set. */
+typedef struct Cache{
     /* s for 2^s sets */
     int s;
     /* e for E lines */
     int e;
     /* b for 2^b bytes per block */
     int b;
-    CacheLine **sets;
+    /* number of mask words per set */
+    int maskWords;
+    ReplacementPolicy policy;
+    unsigned long *tags;
+    /* last access time for LRU, insertion time for FIFO */
+    long *lruTimestamps;
+    uint64_t *validBits;
+    uint64_t *dirtyBits;
+    /* tree bits of tree-PLRU */
+    uint64_t *plruBits;
+    /* xorshift state per set, so random victims don't depend on other sets */
+    uint64_t *randomStates;
+    /* lines filled by the prefetcher and not demanded yet */
+    uint64_t *prefetchBits;
+    /* re-reference prediction values of SRRIP */
+    uint8_t *rrpvs;
+    /* prefetcher trained by demand accesses, or NULL */
+    Prefetcher *prefetcher;
+    /* profiler counting demand accesses per region, or NULL */
+    Profiler *profiler;
+    /* logical clock per set; sets are independent, so it orders accesses
+     * within a set the same way a global counter would */
+    long *setClocks;
+    /* update function specialized for the policy, chosen in initCache */
+    int (*update)(struct Cache *myCache, CacheStats *stats,
+        char accessType, long setIndex, unsigned long tag,
+        CacheAccess *access);
 }Cache;
 
-/* global counters */
-long hits = 0;
-long misses = 0;
-long evictions = 0;
-long dirtyBlocksInCache = 0;
-long dirtyBlocksEvicted = 0;
-long operationCounter = 0;
+/* represent the header of a binary trace file. */
+typedef struct{
+    char magic[TRACE_MAGIC_LEN];
+    uint64_t numRecords;
+}TraceHeader;
+
+/* represent one request in a binary trace file; fixed width and aligned so
+ * records can be read straight from the mapped file. */
+typedef struct{
+    uint64_t address;
+    uint32_t size;
+    char accessType;
+    char padding[3];
+}TraceRecord;
+
+/* represent a binary trace file mapped into memory. */
+typedef struct{
+    void *base;
+    size_t length;
+    const TraceRecord *records;
+    uint64_t numRecords;
+}TraceMapping;
+
+/* represent one batch of requests filled by the trace reader thread. */
+typedef struct{
+    TraceRecord *records;
+    uint64_t count;
+    /* index of the batch stored here, or -1 before the first one */
+    long sequence;
+    /* consumers that have not released the batch yet */
+    int pending;
+}TraceBatch;
+
+/* represent a trace being consumed: either a mapped binary trace file, or a
+ * stream (text or binary, from a file, a FIFO or stdin) parsed by a reader
+ * thread into NUM_BATCHES batches that every consumer sees in order. */
+typedef struct{
+    int mapped;
+    TraceMapping mapping;
+    FILE *stream;
+    int binary;
+    /* binary records left to read from the stream */
+    uint64_t recordsLeft;
+    TraceBatch batches[NUM_BATCHES];
+    int numConsumers;
+    int started;
+    /* set by the reader thread once the last batch is published */
+    int done;
+    int error;
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t drained;
+}TraceSource;
+
+/* represent one level of a cache hierarchy. */
+typedef struct{
+    char name[8];
+    Cache *cache;
+    /* demand requests from the trace or from the level above */
+    CacheStats stats;
+    /* write-backs, or victims when exclusive, from the level above */
+    CacheStats writebackStats;
+}CacheLevel;
+
+/* represent a cache hierarchy: levels[0] is L1I (when hasL1i), levels[1]
+ * is L1D, and the levels after them are shared by both. */
+typedef struct{
+    CacheLevel levels[MAX_LEVELS];
+    int numLevels;
+    int hasL1i;
+    InclusionPolicy inclusion;
+    /* blocks read from and written to memory by the last level */
+    long memoryReads;
+    long memoryWrites;
+    /* upper-level lines removed to keep an inclusive hierarchy inclusive */
+    long backInvalidations;
+}Hierarchy;
+
+/* represent one worker of a simulation, owning sets [firstSet, endSet) of
+ * a shared cache. */
+typedef struct{
+    Cache *cache;
+    CacheStats *stats;
+    TraceSource *source;
+    long firstSet;
+    long endSet;
+}SetWorker;
 
 
 /************ Helper methods ***********/
@@ -56,8 +337,34 @@ int parseInt(int isE, char *str){
     return -1;
 }
 
+/* Parse the name of an inclusion policy, or return -1 if unknown. */
+int parseInclusion(char *str){
+    const char *names[] = {"nine", "inclusive", "exclusive"};
+    for(int i = 0; i < (int) (sizeof(names) / sizeof(names[0])); i++){
+        if(strcmp(str, names[i]) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Parse the name of a replacement policy, or return -1 if unknown. */
+int parsePolicy(char *str){
+    const char *names[] = {"lru", "plru", "srrip", "random", "fifo"};
+    for(int i = 0; i < (int) (sizeof(names) / sizeof(names[0])); i++){
+        if(strcmp(str, names[i]) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
 /* Parse address to get set index of the request. */
 long getSetIndex(unsigned long address, int s, int b){
+    // a single set when fully associative; shifting by 64 is undefined
+    if(s == 0){
+        return 0;
+    }
     // mask of s bits    
     unsigned long mask = (MAX_UNSIGNED) >> (64 - s);
     // take the [b+1, b+s] bits counting from the right
@@ -72,13 +379,50 @@ long getTag(unsigned long address, int s, int b){
     return (address >> (s + b)) & mask;
 }
 
+/* Return whether bit i is set in a set's masks. */
+static inline int testBit(const uint64_t *mask, long i){
+    return (mask[i >> 6] >> (i & 63)) & 1;
+}
+
+/* Set bit i in a set's masks. */
+static inline void setBit(uint64_t *mask, long i){
+    mask[i >> 6] |= (uint64_t) 1 << (i & 63);
+}
+
+/* Clear bit i in a set's masks. */
+static inline void clearBit(uint64_t *mask, long i){
+    mask[i >> 6] &= ~((uint64_t) 1 << (i & 63));
+}
+
 /****************************************/
 
 
 /******* Cache simulation methods *******/
 
+static int updateLru(Cache *myCache, CacheStats *stats, char accessType,
+    long setIndex, unsigned long tag, CacheAccess *access);
+static int updatePlru(Cache *myCache, CacheStats *stats, char accessType,
+    long setIndex, unsigned long tag, CacheAccess *access);
+static int updateSrrip(Cache *myCache, CacheStats *stats, char accessType,
+    long setIndex, unsigned long tag, CacheAccess *access);
+static int updateRandom(Cache *myCache, CacheStats *stats, char accessType,
+    long setIndex, unsigned long tag, CacheAccess *access);
+static int updateFifo(Cache *myCache, CacheStats *stats, char accessType,
+    long setIndex, unsigned long tag, CacheAccess *access);
+int updateCachePrefetched(Cache *myCache, CacheStats *stats, char accessType,
+    unsigned long address, CacheAccess *access);
+void printPrefetchSummary(const Prefetcher *prefetcher, long demandMisses);
+void profileAccess(Profiler *profiler, unsigned long address,
+    const CacheAccess *access);
+void printProfileSummary(Profiler *profiler);
+
 /* Initialize cache with S sets and E lines in each set. */
-Cache *initCache(int s, int e, int b){
+Cache *initCache(int s, int e, int b, ReplacementPolicy policy){
+    // tree-PLRU needs a complete binary tree over the lines
+    if(policy == POLICY_PLRU && (e & (e - 1)) != 0){
+        fprintf(stderr, "Tree-PLRU requires E to be a power of two.\n");
+        return NULL;
+    }
     Cache *myCache = malloc(sizeof(Cache));
     if(!myCache){
         return NULL;
@@ -86,25 +430,52 @@ Cache *initCache(int s, int e, int b){
     myCache->s = s;    
     myCache->e = e;
     myCache->b = b;
+    myCache->maskWords = (e + 63) / 64;
+    myCache->policy = policy;
+    myCache->prefetcher = NULL;
+    myCache->profiler = NULL;
     // number of sets S = 2^s
-    long numSets = (1 << s);  
-    myCache->sets = malloc(sizeof(CacheLine*) * numSets);
-    if(!myCache->sets){
+    long numSets = (1L << s);  
+    long numLines = numSets * e;
+    long numMasks = numSets * myCache->maskWords;
+    // carve all arrays out of one zeroed allocation; initially every
+    // valid bit in each line is unset
+    char *storage = calloc(1, numLines * (sizeof(unsigned long) + sizeof(long))
+        + 4 * numMasks * sizeof(uint64_t)
+        + numSets * (sizeof(uint64_t) + sizeof(long))
+        + numLines * sizeof(uint8_t));
+    if(!storage){
+        free(myCache);
         return NULL;
     }
+    myCache->tags = (unsigned long *) storage;
+    myCache->lruTimestamps = (long *) (myCache->tags + numLines);
+    myCache->validBits = (uint64_t *) (myCache->lruTimestamps + numLines);
+    myCache->dirtyBits = myCache->validBits + numMasks;
+    myCache->plruBits = myCache->dirtyBits + numMasks;
+    myCache->prefetchBits = myCache->plruBits + numMasks;
+    myCache->randomStates = myCache->prefetchBits + numMasks;
+    myCache->setClocks = (long *) (myCache->randomStates + numSets);
+    myCache->rrpvs = (uint8_t *) (myCache->setClocks + numSets);
     for(long i = 0; i < numSets; i++){
-        // allocate mem of E lines to each set
-        myCache->sets[i] = malloc(sizeof(CacheLine) * e);
-        if(!myCache->sets[i]) {
-            return NULL;
-        }
-        for(int j = 0; j < e; j++){
-            // initially valid bit in each line is unset
-            myCache->sets[i][j].validBit = 0;
-            myCache->sets[i][j].dirtyBit = 0;
-            myCache->sets[i][j].tag = -1;
-            myCache->sets[i][j].lruTimestamp = 0;
-        }
+        // xorshift state must never be zero
+        myCache->randomStates[i] = (uint64_t) (i + 1) * 0x9E3779B97F4A7C15ULL;
+    }
+    switch(policy){
+        case POLICY_PLRU:
+            myCache->update = updatePlru;
+            break;
+        case POLICY_SRRIP:
+            myCache->update = updateSrrip;
+            break;
+        case POLICY_RANDOM:
+            myCache->update = updateRandom;
+            break;
+        case POLICY_FIFO:
+            myCache->update = updateFifo;
+            break;
+        default:
+            myCache->update = updateLru;
     }
     return myCache;
 }
@@ -114,91 +485,363 @@ int freeCache(Cache *myCache){
     if(!myCache){
         return 1;
     }
-    int numSets = (1 << myCache->s);
-    for(long i = 0; i < numSets; i++){
-        if(myCache->sets[i]){
-            free(myCache->sets[i]);
-        }        
-    }
-    free(myCache->sets);
+    // tags is the start of the single metadata allocation
+    free(myCache->tags);
     free(myCache);
     return 0;
 }
 
-/* Update cache content based on request. */
-int updateCache(Cache *myCache, char accessType, long setIndex, long tag){
-    char store = 'S';
-    char load = 'L';
-    operationCounter++;
-    CacheLine *lines = myCache->sets[setIndex];
-    long leastVisitedLine = operationCounter - 1;
-    int lruLine = -1;
-    // iterate each line to find target data
-    for(long i = 0; i < myCache->e; i++){
-        // cache hit
-        if(lines[i].validBit == 1 && lines[i].tag == tag){
-            hits++;
-            lines[i].lruTimestamp = operationCounter;
-            if(accessType == store && lines[i].dirtyBit == 0){
-                lines[i].dirtyBit = 1;
-                dirtyBlocksInCache++;
-            }
-            return 0;
+/* Return a bit mask of the first n (<= 64) lines whose tag equals tag. */
+static inline uint64_t matchTags(const unsigned long *tags, long n,
+    unsigned long tag){
+    uint64_t match = 0;
+    long i = 0;
+#if defined(__AVX2__)
+    // compare four tags per instruction
+    __m256i target = _mm256_set1_epi64x((long long) tag);
+    for(; i + 4 <= n; i += 4){
+        __m256i line = _mm256_loadu_si256((const __m256i *) &tags[i]);
+        __m256i eq = _mm256_cmpeq_epi64(line, target);
+        match |= (uint64_t) _mm256_movemask_pd(_mm256_castsi256_pd(eq)) << i;
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    // compare two tags per instruction
+    uint64x2_t target = vdupq_n_u64(tag);
+    for(; i + 2 <= n; i += 2){
+        uint64x2_t eq = vceqq_u64(vld1q_u64((const uint64_t *) &tags[i]), target);
+        match |= ((vgetq_lane_u64(eq, 0) & 1) | (vgetq_lane_u64(eq, 1) & 2)) << i;
+    }
+#endif
+    for(; i < n; i++){
+        match |= (uint64_t) (tags[i] == tag) << i;
+    }
+    return match;
+}
+
+/* Return the line holding tag in a set, or -1 if there is none. */
+static inline long findLine(const unsigned long *tags, const uint64_t *valid,
+    int e, unsigned long tag){
+    // compare a whole mask word of tags in one pass
+    for(long base = 0; base < e; base += 64){
+        long end = (e - base < 64) ? e - base : 64;
+        uint64_t match = matchTags(&tags[base], end, tag) & valid[base >> 6];
+        if(match){
+            return base + __builtin_ctzll(match);
+        }
+    }
+    return -1;
+}
+
+/* Return the first invalid line in a set, or -1 if the set is full. */
+static inline long findInvalidLine(const uint64_t *valid, int e){
+    for(long base = 0; base < e; base += 64){
+        uint64_t invalid = ~valid[base >> 6];
+        if(invalid){
+            long i = base + __builtin_ctzll(invalid);
+            return i < e ? i : -1;
+        }
+    }
+    return -1;
+}
+
+/* Return the least recently used line in a full set. */
+static inline long findLruLine(const long *stamps, int e){
+    long lruLine = 0;
+    long i = 1;
+#if defined(__AVX2__)
+    // keep the running minimum and its line index in each of four lanes
+    if(e >= 8){
+        __m256i minStamp = _mm256_loadu_si256((const __m256i *) stamps);
+        __m256i minLine = _mm256_setr_epi64x(0, 1, 2, 3);
+        __m256i curLine = minLine;
+        __m256i step = _mm256_set1_epi64x(4);
+        for(i = 4; i + 4 <= e; i += 4){
+            curLine = _mm256_add_epi64(curLine, step);
+            __m256i stamp = _mm256_loadu_si256((const __m256i *) &stamps[i]);
+            __m256i older = _mm256_cmpgt_epi64(minStamp, stamp);
+            minStamp = _mm256_blendv_epi8(minStamp, stamp, older);
+            minLine = _mm256_blendv_epi8(minLine, curLine, older);
         }
-        // cache miss; copy data from lower mem to this usable line
-        if(lines[i].tag == -1){
-            misses++;
-            lines[i].validBit = 1;
-            lines[i].tag = tag;
-            lines[i].lruTimestamp = operationCounter;
-            // dirty cuz it writes new data to the block which contains old data loaded from memory
-            if(accessType == store){
-                lines[i].dirtyBit = 1;
-                dirtyBlocksInCache++;
+        long laneStamp[4], laneLine[4];
+        _mm256_storeu_si256((__m256i *) laneStamp, minStamp);
+        _mm256_storeu_si256((__m256i *) laneLine, minLine);
+        lruLine = laneLine[0];
+        for(int lane = 1; lane < 4; lane++){
+            if(laneStamp[lane] < stamps[lruLine] || (laneStamp[lane]
+                == stamps[lruLine] && laneLine[lane] < lruLine)){
+                lruLine = laneLine[lane];
             }
-            return 0;
         }
     }
-    // cache miss and eviction
-    misses++;
-    // locate the least recent used line
-    for(long i = 0; i < myCache->e; i++){
-        if(lines[i].lruTimestamp < leastVisitedLine){
-            leastVisitedLine = lines[i].lruTimestamp;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    // keep the running minimum and its line index in each of two lanes
+    if(e >= 4){
+        int64x2_t minStamp = vld1q_s64((const int64_t *) stamps);
+        int64x2_t minLine = vcombine_s64(vcreate_s64(0), vcreate_s64(1));
+        int64x2_t curLine = minLine;
+        int64x2_t step = vdupq_n_s64(2);
+        for(i = 2; i + 2 <= e; i += 2){
+            curLine = vaddq_s64(curLine, step);
+            int64x2_t stamp = vld1q_s64((const int64_t *) &stamps[i]);
+            uint64x2_t older = vcltq_s64(stamp, minStamp);
+            minStamp = vbslq_s64(older, stamp, minStamp);
+            minLine = vbslq_s64(older, curLine, minLine);
+        }
+        lruLine = vgetq_lane_s64(minLine, 0);
+        long otherLine = vgetq_lane_s64(minLine, 1);
+        if(stamps[otherLine] < stamps[lruLine]){
+            lruLine = otherLine;
+        }
+    }
+#endif
+    for(; i < e; i++){
+        if(stamps[i] < stamps[lruLine]){
             lruLine = i;
         }
     }
-    // if no LRU line, choose first one
-    if(leastVisitedLine == operationCounter - 1){
-        lruLine = 0;
-    }
-    evictions++;
-    // evict the LRU line
-    lines[lruLine].validBit = 1;
-    lines[lruLine].tag = tag;
-    lines[lruLine].lruTimestamp = operationCounter;
-    if(accessType == load && lines[lruLine].dirtyBit == 1){
-        dirtyBlocksEvicted++;
-        lines[lruLine].dirtyBit = 0;
-        dirtyBlocksInCache--;
-    }else if(accessType == store && lines[lruLine].dirtyBit == 0){
-        lines[lruLine].dirtyBit = 1;
-        dirtyBlocksInCache++;
-    }else if(accessType == store && lines[lruLine].dirtyBit == 1){
-        dirtyBlocksEvicted++;
+    return lruLine;
+}
+
+/* Point the tree-PLRU bits on the path to line away from it. */
+static inline void touchPlru(uint64_t *bits, int e, long line){
+    long node = 1;
+    for(int level = __builtin_ctz(e) - 1; level >= 0; level--){
+        long right = (line >> level) & 1;
+        // node n is stored at bit n - 1
+        if(right){
+            clearBit(bits, node - 1);
+        }else{
+            setBit(bits, node - 1);
+        }
+        node = 2 * node + right;
+    }
+}
+
+/* Follow the tree-PLRU bits to the pseudo least recently used line. */
+static inline long findPlruLine(const uint64_t *bits, int e){
+    long node = 1;
+    while(node < e){
+        node = 2 * node + testBit(bits, node - 1);
+    }
+    return node - e;
+}
+
+/* Age the set until a line is predicted to be re-referenced furthest in
+ * the future, and return that line. */
+static inline long findSrripLine(uint8_t *rrpvs, int e){
+    uint8_t oldest = 0;
+    for(long i = 0; i < e; i++){
+        oldest = rrpvs[i] > oldest ? rrpvs[i] : oldest;
+    }
+    // aging every line by the same amount leaves the oldest at RRPV_MAX
+    uint8_t age = RRPV_MAX - oldest;
+    long victim = -1;
+    for(long i = 0; i < e; i++){
+        rrpvs[i] += age;
+        if(victim < 0 && rrpvs[i] == RRPV_MAX){
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+/* Draw a random line from the set's xorshift generator. */
+static inline long findRandomLine(uint64_t *state, int e){
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return (long) (x % (uint64_t) e);
+}
+
+/* Update cache content based on request. The policy argument is a constant
+ * in each caller, so every policy gets its own copy without policy branches. */
+static inline __attribute__((always_inline)) int updateCacheWith(
+    Cache *myCache, CacheStats *stats, char accessType, long setIndex,
+    unsigned long tag, CacheAccess *access, const ReplacementPolicy policy){
+    char store = 'S';
+    char load = 'L';
+    long now = ++myCache->setClocks[setIndex];
+    int e = myCache->e;
+    unsigned long *tags = &myCache->tags[setIndex * e];
+    long *stamps = &myCache->lruTimestamps[setIndex * e];
+    uint8_t *rrpvs = &myCache->rrpvs[setIndex * e];
+    uint64_t *valid = &myCache->validBits[setIndex * myCache->maskWords];
+    uint64_t *dirty = &myCache->dirtyBits[setIndex * myCache->maskWords];
+    uint64_t *plru = &myCache->plruBits[setIndex * myCache->maskWords];
+    // cache hit
+    long line = findLine(tags, valid, e, tag);
+    if(line >= 0){
+        stats->hits++;
+        if(policy == POLICY_LRU){
+            stamps[line] = now;
+        }else if(policy == POLICY_PLRU){
+            touchPlru(plru, e, line);
+        }else if(policy == POLICY_SRRIP){
+            rrpvs[line] = 0;
+        }
+        if(accessType == store && !testBit(dirty, line)){
+            setBit(dirty, line);
+            stats->dirtyBlocksInCache++;
+        }
+        if(access){
+            access->hit = 1;
+            access->evicted = 0;
+        }
+        return 0;
+    }
+    stats->misses++;
+    // cache miss; copy data from lower mem to a usable line
+    line = findInvalidLine(valid, e);
+    int evict = line < 0;
+    if(evict){
+        // cache miss and eviction of the line chosen by the policy
+        stats->evictions++;
+        if(policy == POLICY_LRU || policy == POLICY_FIFO){
+            line = findLruLine(stamps, e);
+        }else if(policy == POLICY_PLRU){
+            line = findPlruLine(plru, e);
+        }else if(policy == POLICY_SRRIP){
+            line = findSrripLine(rrpvs, e);
+        }else{
+            line = findRandomLine(&myCache->randomStates[setIndex], e);
+        }
+    }
+    if(access){
+        access->hit = 0;
+        access->evicted = evict;
+        if(evict){
+            access->victimAddress = (tags[line] << (myCache->s + myCache->b))
+                | ((unsigned long) setIndex << myCache->b);
+            access->victimDirty = testBit(dirty, line);
+        }
+    }
+    setBit(valid, line);
+    tags[line] = tag;
+    if(policy == POLICY_LRU || policy == POLICY_FIFO){
+        stamps[line] = now;
+    }else if(policy == POLICY_PLRU){
+        touchPlru(plru, e, line);
+    }else if(policy == POLICY_SRRIP){
+        // insert with a long re-reference prediction
+        rrpvs[line] = RRPV_MAX - 1;
+    }
+    if(!evict){
+        // dirty cuz it writes new data to the block which contains old data loaded from memory
+        if(accessType == store){
+            setBit(dirty, line);
+            stats->dirtyBlocksInCache++;
+        }
+    }else if(accessType == load && testBit(dirty, line)){
+        stats->dirtyBlocksEvicted++;
+        clearBit(dirty, line);
+        stats->dirtyBlocksInCache--;
+    }else if(accessType == store && !testBit(dirty, line)){
+        setBit(dirty, line);
+        stats->dirtyBlocksInCache++;
+    }else if(accessType == store && testBit(dirty, line)){
+        stats->dirtyBlocksEvicted++;
     }
     return 0;
 }
 
+static int updateLru(Cache *myCache, CacheStats *stats, char accessType,
+    long setIndex, unsigned long tag, CacheAccess *access){
+    return updateCacheWith(myCache, stats, accessType, setIndex, tag,
+        access, POLICY_LRU);
+}
+
+static int updatePlru(Cache *myCache, CacheStats *stats, char accessType,
+    long setIndex, unsigned long tag, CacheAccess *access){
+    return updateCacheWith(myCache, stats, accessType, setIndex, tag,
+        access, POLICY_PLRU);
+}
+
+static int updateSrrip(Cache *myCache, CacheStats *stats, char accessType,
+    long setIndex, unsigned long tag, CacheAccess *access){
+    return updateCacheWith(myCache, stats, accessType, setIndex, tag,
+        access, POLICY_SRRIP);
+}
+
+static int updateRandom(Cache *myCache, CacheStats *stats, char accessType,
+    long setIndex, unsigned long tag, CacheAccess *access){
+    return updateCacheWith(myCache, stats, accessType, setIndex, tag,
+        access, POLICY_RANDOM);
+}
+
+static int updateFifo(Cache *myCache, CacheStats *stats, char accessType,
+    long setIndex, unsigned long tag, CacheAccess *access){
+    return updateCacheWith(myCache, stats, accessType, setIndex, tag,
+        access, POLICY_FIFO);
+}
+
+/* Update cache content based on request, using the cache's policy. */
+int updateCache(Cache *myCache, CacheStats *stats, char accessType,
+    long setIndex, unsigned long tag, CacheAccess *access){
+    return myCache->update(myCache, stats, accessType, setIndex, tag, access);
+}
+
+/* Return the line holding address in its set, or -1 if it is not cached. */
+long probeLine(Cache *myCache, unsigned long address){
+    long setIndex = getSetIndex(address, myCache->s, myCache->b);
+    unsigned long tag = getTag(address, myCache->s, myCache->b);
+    return findLine(&myCache->tags[setIndex * myCache->e],
+        &myCache->validBits[setIndex * myCache->maskWords], myCache->e, tag);
+}
+
+/* Remove address from the cache.
+ * Return -1 if it was not cached, otherwise whether the line was dirty. */
+int invalidateLine(Cache *myCache, CacheStats *stats, unsigned long address){
+    long line = probeLine(myCache, address);
+    if(line < 0){
+        return -1;
+    }
+    long setIndex = getSetIndex(address, myCache->s, myCache->b);
+    uint64_t *valid = &myCache->validBits[setIndex * myCache->maskWords];
+    uint64_t *dirty = &myCache->dirtyBits[setIndex * myCache->maskWords];
+    int wasDirty = testBit(dirty, line);
+    // the freed line is refilled before any replacement decision
+    clearBit(valid, line);
+    clearBit(dirty, line);
+    clearBit(&myCache->prefetchBits[setIndex * myCache->maskWords], line);
+    if(wasDirty){
+        stats->dirtyBlocksInCache--;
+    }
+    return wasDirty;
+}
+
+/* Mark a cached address dirty. */
+void markDirty(Cache *myCache, CacheStats *stats, unsigned long address){
+    long line = probeLine(myCache, address);
+    long setIndex = getSetIndex(address, myCache->s, myCache->b);
+    uint64_t *dirty = &myCache->dirtyBits[setIndex * myCache->maskWords];
+    if(line >= 0 && !testBit(dirty, line)){
+        setBit(dirty, line);
+        stats->dirtyBlocksInCache++;
+    }
+}
+
 /* Handle each request in trace file by simulating cache activities. */
-int handleRequests(Cache *myCache, char accessType, unsigned long address, int size){
+int handleRequests(Cache *myCache, CacheStats *stats, char accessType,
+    unsigned long address, int size){
     long setIndex = getSetIndex(address, myCache->s, myCache->b);
-    long tag = getTag(address, myCache->s, myCache->b);
+    unsigned long tag = getTag(address, myCache->s, myCache->b);
+    CacheAccess access;
     switch(accessType){
         case 'L':
         case 'S':
-            // load and store are same cuz we only compute hits/misses/evictions.
-            updateCache(myCache, accessType, setIndex, tag);            
+            if(myCache->prefetcher){
+                updateCachePrefetched(myCache, stats, accessType, address,
+                    &access);
+            }else{
+                // load and store are same cuz we only compute hits/misses/evictions.
+                updateCache(myCache, stats, accessType, setIndex, tag,
+                    myCache->profiler ? &access : NULL);
+            }
+            if(myCache->profiler){
+                profileAccess(myCache->profiler, address, &access);
+            }
             break;
         default:
             fprintf(stderr, "Not supported request type. %c\n", accessType);
@@ -207,53 +850,1286 @@ int handleRequests(Cache *myCache, char accessType, unsigned long address, int s
     return 0;
 }
 
-/* Parse lines in trace file to single requests and handle them. */
-int handleMemoryTrace(Cache *myCache, char *filename){
-    FILE *stream = fopen(filename, "r");
-    // null pointer if fopen fails
-    if(!stream){
+/* Map a binary trace file into memory.
+ * Return 0 if mapped, 1 if the file is not a binary trace, -1 on error. */
+int mapBinaryTrace(char *filename, TraceMapping *mapping){
+    struct stat st;
+    if(stat(filename, &st) != 0){
         return -1;
-    }    
-    char accessType;
+    }
+    // pipes and FIFOs are streamed instead, so they must not be opened here;
+    // too short for a header, so it can only be a text trace
+    if(!S_ISREG(st.st_mode) || (size_t) st.st_size < sizeof(TraceHeader)){
+        return 1;
+    }
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0){
+        return -1;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+    if(base == MAP_FAILED){
+        return -1;
+    }
+    const TraceHeader *header = base;
+    if(memcmp(header->magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0){
+        munmap(base, st.st_size);
+        return 1;
+    }
+    // reject truncated files instead of reading past the mapping
+    uint64_t maxRecords = (st.st_size - sizeof(TraceHeader)) / sizeof(TraceRecord);
+    if(header->numRecords > maxRecords){
+        fprintf(stderr, "Truncated binary trace %s.\n", filename);
+        munmap(base, st.st_size);
+        return -1;
+    }
+    // records are consumed once from front to back
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+    mapping->base = base;
+    mapping->length = st.st_size;
+    mapping->records = (const TraceRecord *) (header + 1);
+    mapping->numRecords = header->numRecords;
+    return 0;
+}
+
+/* Release a trace mapped by mapBinaryTrace. */
+int unmapTrace(TraceMapping *mapping){
+    return munmap(mapping->base, mapping->length);
+}
+
+/* Convert a text trace file to the binary trace format. */
+int convertTrace(char *inputName, char *outputName){
+    FILE *input = fopen(inputName, "r");
+    if(!input){
+        return -1;
+    }
+    FILE *output = fopen(outputName, "wb");
+    if(!output){
+        fclose(input);
+        return -1;
+    }
+    // write a placeholder header, then patch the count once it is known
+    TraceHeader header;
+    memcpy(header.magic, TRACE_MAGIC, TRACE_MAGIC_LEN);
+    header.numRecords = 0;
+    int res = fwrite(&header, sizeof(header), 1, output) == 1 ? 0 : -1;
+    TraceRecord record;
+    memset(&record, 0, sizeof(record));
+    unsigned long address;
+    int size;
+    while(res == 0 && fscanf(input, " %c %lx, %d", &record.accessType,
+        &address, &size) > 0){
+        record.address = address;
+        record.size = size;
+        if(fwrite(&record, sizeof(record), 1, output) != 1){
+            res = -1;
+        }
+        header.numRecords++;
+    }
+    if(res == 0 && (fseek(output, 0, SEEK_SET) != 0
+        || fwrite(&header, sizeof(header), 1, output) != 1)){
+        res = -1;
+    }
+    fclose(input);
+    if(fclose(output) != 0){
+        res = -1;
+    }
+    return res;
+}
+
+/* Open a trace for consumers: map it if it is a regular binary file,
+ * otherwise prepare to stream it, where "-" reads from stdin.
+ * Return 0 if succeeds, -1 on error. */
+int openTraceSource(char *filename, TraceSource *source){
+    memset(source, 0, sizeof(TraceSource));
+    pthread_mutex_init(&source->lock, NULL);
+    pthread_cond_init(&source->filled, NULL);
+    pthread_cond_init(&source->drained, NULL);
+    if(strcmp(filename, "-") == 0){
+        source->stream = stdin;
+    }else{
+        int mapped = mapBinaryTrace(filename, &source->mapping);
+        if(mapped < 0){
+            return -1;
+        }
+        if(mapped == 0){
+            source->mapped = 1;
+            return 0;
+        }
+        source->stream = fopen(filename, "r");
+        if(!source->stream){
+            return -1;
+        }
+    }
+    // a text request never starts with 'C', so one byte tells the formats apart
+    int first = getc(source->stream);
+    if(first == TRACE_MAGIC[0]){
+        TraceHeader header;
+        header.magic[0] = first;
+        if(fread(header.magic + 1, TRACE_MAGIC_LEN - 1, 1, source->stream) != 1
+            || fread(&header.numRecords, sizeof(uint64_t), 1,
+                source->stream) != 1
+            || memcmp(header.magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0){
+            fprintf(stderr, "Invalid binary trace %s.\n", filename);
+            return -1;
+        }
+        source->binary = 1;
+        source->recordsLeft = header.numRecords;
+    }else if(first != EOF){
+        ungetc(first, source->stream);
+    }
+    for(int i = 0; i < NUM_BATCHES; i++){
+        source->batches[i].sequence = -1;
+        source->batches[i].records = malloc(BATCH_RECORDS * sizeof(TraceRecord));
+        if(!source->batches[i].records){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Parse up to BATCH_RECORDS requests from the stream into batch.
+ * Return 0 if succeeds, -1 on error. */
+int readTraceBatch(TraceSource *source, TraceBatch *batch){
+    batch->count = 0;
+    if(source->binary){
+        size_t want = source->recordsLeft < BATCH_RECORDS
+            ? source->recordsLeft : BATCH_RECORDS;
+        batch->count = fread(batch->records, sizeof(TraceRecord), want,
+            source->stream);
+        source->recordsLeft -= batch->count;
+        if(batch->count < want){
+            fprintf(stderr, "Truncated binary trace.\n");
+            return -1;
+        }
+        return 0;
+    }
+    TraceRecord record;
+    memset(&record, 0, sizeof(record));
     unsigned long address;
     int size;
-    while(fscanf(stream, " %c %lx, %d", &accessType, &address, &size) > 0){
-        // handle memory request by line
-        handleRequests(myCache, accessType, address, size);
+    while(batch->count < BATCH_RECORDS && fscanf(source->stream, " %c %lx, %d",
+        &record.accessType, &address, &size) > 0){
+        record.address = address;
+        record.size = size;
+        batch->records[batch->count++] = record;
+    }
+    return ferror(source->stream) ? -1 : 0;
+}
+
+/* Reader thread: fill batches in turn, each once every consumer has
+ * released its previous contents, until the stream ends. */
+void *traceReaderThread(void *arg){
+    TraceSource *source = arg;
+    for(long sequence = 0; ; sequence++){
+        TraceBatch *batch = &source->batches[sequence % NUM_BATCHES];
+        pthread_mutex_lock(&source->lock);
+        while(batch->pending > 0){
+            pthread_cond_wait(&source->drained, &source->lock);
+        }
+        pthread_mutex_unlock(&source->lock);
+        // parse outside the lock so consumers keep simulating the other batch
+        int res = readTraceBatch(source, batch);
+        pthread_mutex_lock(&source->lock);
+        if(res != 0 || batch->count == 0){
+            source->error = res != 0;
+            source->done = 1;
+            pthread_cond_broadcast(&source->filled);
+            pthread_mutex_unlock(&source->lock);
+            return NULL;
+        }
+        batch->sequence = sequence;
+        batch->pending = source->numConsumers;
+        pthread_cond_broadcast(&source->filled);
+        pthread_mutex_unlock(&source->lock);
+    }
+}
+
+/* Start delivering the trace to numConsumers consumers, each of which must
+ * read every batch. Return 0 if succeeds, -1 on error. */
+int startTraceSource(TraceSource *source, int numConsumers){
+    if(source->mapped){
+        return 0;
+    }
+    source->numConsumers = numConsumers;
+    if(pthread_create(&source->reader, NULL, traceReaderThread, source) != 0){
+        // wake consumers that are already waiting so they can fail
+        pthread_mutex_lock(&source->lock);
+        source->error = 1;
+        source->done = 1;
+        pthread_cond_broadcast(&source->filled);
+        pthread_mutex_unlock(&source->lock);
+        return -1;
+    }
+    source->started = 1;
+    return 0;
+}
+
+/* Wait for batch number index and point records at it.
+ * Return its number of requests, 0 at the end of the trace, -1 on error. */
+long nextTraceBatch(TraceSource *source, long index,
+    const TraceRecord **records){
+    if(source->mapped){
+        *records = source->mapping.records;
+        return index == 0 ? (long) source->mapping.numRecords : 0;
+    }
+    TraceBatch *batch = &source->batches[index % NUM_BATCHES];
+    pthread_mutex_lock(&source->lock);
+    while(batch->sequence != index && !source->done){
+        pthread_cond_wait(&source->filled, &source->lock);
+    }
+    long count = batch->sequence == index ? (long) batch->count
+        : (source->error ? -1 : 0);
+    pthread_mutex_unlock(&source->lock);
+    *records = batch->records;
+    return count;
+}
+
+/* Release batch number index so the reader thread may refill it. */
+void releaseTraceBatch(TraceSource *source, long index){
+    if(source->mapped){
+        return;
+    }
+    TraceBatch *batch = &source->batches[index % NUM_BATCHES];
+    pthread_mutex_lock(&source->lock);
+    if(--batch->pending == 0){
+        pthread_cond_signal(&source->drained);
+    }
+    pthread_mutex_unlock(&source->lock);
+}
+
+/* Release a trace opened by openTraceSource once its consumers are done. */
+int closeTraceSource(TraceSource *source){
+    int res = 0;
+    if(source->mapped){
+        res = unmapTrace(&source->mapping);
+    }
+    if(source->started){
+        pthread_join(source->reader, NULL);
+    }
+    if(source->stream && source->stream != stdin && fclose(source->stream) != 0){
+        res = -1;
+    }
+    for(int i = 0; i < NUM_BATCHES; i++){
+        free(source->batches[i].records);
+    }
+    pthread_mutex_destroy(&source->lock);
+    pthread_cond_destroy(&source->filled);
+    pthread_cond_destroy(&source->drained);
+    return res;
+}
+
+/* Pass every batch of the trace to consume, in order, as one consumer.
+ * Return 0 at the end of the trace, -1 on error. */
+int consumeTrace(TraceSource *source,
+    void (*consume)(void *arg, const TraceRecord *records, long n), void *arg){
+    const TraceRecord *records;
+    long count;
+    for(long i = 0; (count = nextTraceBatch(source, i, &records)) > 0; i++){
+        consume(arg, records, count);
+        releaseTraceBatch(source, i);
+    }
+    return count < 0 ? -1 : 0;
+}
+
+/* Feed a whole trace file, or stdin for "-", to a single consumer while
+ * the reader thread parses ahead. Return 0 if succeeds, -1 on error. */
+int forEachTraceBatch(char *filename,
+    void (*consume)(void *arg, const TraceRecord *records, long n), void *arg){
+    TraceSource source;
+    int res = openTraceSource(filename, &source);
+    if(res == 0){
+        res = startTraceSource(&source, 1);
+    }
+    if(res == 0){
+        res = consumeTrace(&source, consume, arg);
+    }
+    if(closeTraceSource(&source) != 0){
+        res = -1;
     }
-    int res = fclose(stream);
     return res;
 }
 
+/* Handle the requests of a batch that map to the worker's sets. */
+void handleSetBatch(void *arg, const TraceRecord *records, long n){
+    SetWorker *worker = arg;
+    Cache *myCache = worker->cache;
+    for(long i = 0; i < n; i++){
+        long setIndex = getSetIndex(records[i].address, myCache->s, myCache->b);
+        if(setIndex >= worker->firstSet && setIndex < worker->endSet){
+            handleRequests(myCache, worker->stats, records[i].accessType,
+                records[i].address, records[i].size);
+        }
+    }
+}
+
+/* Parse requests in trace file, or stdin for "-", and handle them. */
+int handleMemoryTrace(Cache *myCache, CacheStats *stats, char *filename){
+    SetWorker worker = {myCache, stats, NULL, 0, 1L << myCache->s};
+    return forEachTraceBatch(filename, handleSetBatch, &worker);
+}
+
 /* Simulate cache behavior with given memory trace file. */
-int simulateCacheOps(int s, int e, int b, char *tvalue){
+int simulateCacheOps(int s, int e, int b, ReplacementPolicy policy,
+    Prefetcher *prefetcher, Profiler *profiler, char *tvalue){
     int res = 0;
     Cache *myCache = NULL;
+    CacheStats stats = {0};
     // initialize cache with sets and lines
-    myCache = initCache(s, e, b);
+    myCache = initCache(s, e, b, policy);
     if(!myCache){
         fprintf(stderr, "Failed to initialize cache.\n");
+        return 1;
     }
-    res = handleMemoryTrace(myCache, tvalue);
+    myCache->prefetcher = prefetcher;
+    myCache->profiler = profiler;
+    res = handleMemoryTrace(myCache, &stats, tvalue);
     if(res != 0){
         return res;
     }
+    // prefetch fills move dirty lines too
+    if(prefetcher){
+        stats.dirtyBlocksInCache += prefetcher->fillStats.dirtyBlocksInCache;
+        stats.dirtyBlocksEvicted += prefetcher->fillStats.dirtyBlocksEvicted;
+    }
     // number of bytes per line B = 2^b
     int numBytesPerLine = 1 << b;
-    printSummary(hits, misses, evictions, dirtyBlocksInCache * numBytesPerLine, 
-        dirtyBlocksEvicted * numBytesPerLine);
+    printSummary(stats.hits, stats.misses, stats.evictions,
+        stats.dirtyBlocksInCache * numBytesPerLine, 
+        stats.dirtyBlocksEvicted * numBytesPerLine);
+    if(prefetcher){
+        printPrefetchSummary(prefetcher, stats.misses);
+    }
+    if(profiler){
+        printProfileSummary(profiler);
+    }
     res = freeCache(myCache);
     return res;
 }
 
+/* Worker thread: simulate the requests that map to the worker's sets. */
+void *setWorkerThread(void *arg){
+    SetWorker *worker = arg;
+    consumeTrace(worker->source, handleSetBatch, worker);
+    return NULL;
+}
+
+/* Simulate cache behavior with numThreads workers, each owning a contiguous
+ * range of sets and reading the same trace batches. Sets never interact, so
+ * the summary equals a serial run. */
+int simulateCacheOpsParallel(int s, int e, int b, ReplacementPolicy policy,
+    char *tvalue, int numThreads){
+    long numSets = 1L << s;
+    if(numThreads > numSets){
+        numThreads = numSets;
+    }
+    Cache *myCache = initCache(s, e, b, policy);
+    if(!myCache){
+        fprintf(stderr, "Failed to initialize cache.\n");
+        return 1;
+    }
+    TraceSource source;
+    if(openTraceSource(tvalue, &source) != 0){
+        closeTraceSource(&source);
+        freeCache(myCache);
+        return -1;
+    }
+    SetWorker *workers = calloc(numThreads, sizeof(SetWorker));
+    CacheStats *workerStats = calloc(numThreads, sizeof(CacheStats));
+    pthread_t *threads = malloc(numThreads * sizeof(pthread_t));
+    if(!workers || !workerStats || !threads){
+        free(workers);
+        free(workerStats);
+        free(threads);
+        closeTraceSource(&source);
+        freeCache(myCache);
+        return -1;
+    }
+    for(int i = 0; i < numThreads; i++){
+        workers[i].cache = myCache;
+        workers[i].stats = &workerStats[i];
+        workers[i].source = &source;
+        workers[i].firstSet = numSets * i / numThreads;
+        workers[i].endSet = numSets * (i + 1) / numThreads;
+    }
+    // this thread runs the last worker, and takes over the sets of any
+    // worker whose thread fails to start
+    int started = 0;
+    while(started < numThreads - 1 && pthread_create(&threads[started], NULL,
+        setWorkerThread, &workers[started]) == 0){
+        started++;
+    }
+    SetWorker *own = &workers[started];
+    own->endSet = numSets;
+    int res = startTraceSource(&source, started + 1);
+    if(consumeTrace(&source, handleSetBatch, own) != 0){
+        res = -1;
+    }
+    CacheStats stats = {0};
+    for(int i = 0; i <= started; i++){
+        if(i < started){
+            pthread_join(threads[i], NULL);
+        }
+        stats.hits += workerStats[i].hits;
+        stats.misses += workerStats[i].misses;
+        stats.evictions += workerStats[i].evictions;
+        stats.dirtyBlocksInCache += workerStats[i].dirtyBlocksInCache;
+        stats.dirtyBlocksEvicted += workerStats[i].dirtyBlocksEvicted;
+    }
+    if(closeTraceSource(&source) != 0){
+        res = -1;
+    }
+    if(res == 0){
+        // number of bytes per line B = 2^b
+        int numBytesPerLine = 1 << b;
+        printSummary(stats.hits, stats.misses, stats.evictions,
+            stats.dirtyBlocksInCache * numBytesPerLine,
+            stats.dirtyBlocksEvicted * numBytesPerLine);
+    }
+    free(workers);
+    free(workerStats);
+    free(threads);
+    freeCache(myCache);
+    return res;
+}
+
 /****************************************/
 
-int main(int argc, char * const argv[])
-{    
-    char *svalue, *evalue, *bvalue, *tvalue;
-    int s, e, b;
-    svalue = evalue = bvalue = tvalue = NULL;
-    char *pattern = "s:E:b:t:";
+
+/********** Prefetcher methods **********/
+
+/* Parse a prefetcher "next", "stride" or "stream", optionally followed by
+ * ":degree". Return 0 if succeeds, or -1 if fails. */
+int parsePrefetcher(char *str, Prefetcher *prefetcher){
+    const char *names[] = {"next", "stride", "stream"};
+    memset(prefetcher, 0, sizeof(Prefetcher));
+    prefetcher->degree = DEFAULT_PREFETCH_DEGREE;
+    char *colon = strchr(str, ':');
+    size_t nameLen = colon ? (size_t) (colon - str) : strlen(str);
+    if(colon && (prefetcher->degree = parseInt(1, colon + 1)) < 0){
+        return -1;
+    }
+    for(int i = 0; i < (int) (sizeof(names) / sizeof(names[0])); i++){
+        if(strlen(names[i]) == nameLen && strncmp(str, names[i], nameLen) == 0){
+            prefetcher->kind = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Fill one block into the cache on behalf of its prefetcher. */
+void issuePrefetch(Cache *myCache, unsigned long block){
+    Prefetcher *prefetcher = myCache->prefetcher;
+    unsigned long address = block << myCache->b;
+    long setIndex = getSetIndex(address, myCache->s, myCache->b);
+    unsigned long tag = getTag(address, myCache->s, myCache->b);
+    if(probeLine(myCache, address) >= 0){
+        prefetcher->redundant++;
+        return;
+    }
+    CacheAccess access;
+    updateCache(myCache, &prefetcher->fillStats, 'L', setIndex, tag, &access);
+    prefetcher->issued++;
+    uint64_t *bits = &myCache->prefetchBits[setIndex * myCache->maskWords];
+    long line = probeLine(myCache, address);
+    // the bit still describes the victim that used to live in this line
+    if(access.evicted){
+        if(testBit(bits, line)){
+            prefetcher->uselessEvicted++;
+        }else{
+            unsigned long victim = access.victimAddress >> myCache->b;
+            prefetcher->pollutingEvictions++;
+            prefetcher->pollutionFilter[victim % POLLUTION_FILTER_SIZE] = victim + 1;
+        }
+    }
+    setBit(bits, line);
+}
+
+/* Train the stride prefetcher on a demand access and prefetch ahead once
+ * the region's stride repeats. */
+void trainStride(Cache *myCache, unsigned long address){
+    Prefetcher *prefetcher = myCache->prefetcher;
+    unsigned long region = address >> REGION_BITS;
+    StrideEntry *entry = &prefetcher->strides[region % STRIDE_ENTRIES];
+    if(!entry->valid || entry->region != region){
+        entry->valid = 1;
+        entry->region = region;
+        entry->lastAddress = address;
+        entry->stride = 0;
+        entry->confidence = 0;
+        return;
+    }
+    long delta = (long) (address - entry->lastAddress);
+    if(delta == 0){
+        return;
+    }
+    entry->lastAddress = address;
+    if(delta == entry->stride){
+        entry->confidence += entry->confidence < 3;
+    }else if(entry->confidence > 0){
+        entry->confidence--;
+    }else{
+        entry->stride = delta;
+    }
+    if(entry->confidence < 2){
+        return;
+    }
+    // skip targets that fall into the block just covered
+    unsigned long lastBlock = address >> myCache->b;
+    for(int k = 1; k <= prefetcher->degree; k++){
+        unsigned long block = (address + k * entry->stride) >> myCache->b;
+        if(block != lastBlock){
+            issuePrefetch(myCache, block);
+            lastBlock = block;
+        }
+    }
+}
+
+/* Train the stream prefetcher on a demand miss (or the first use of a
+ * prefetched line) and run ahead of a confirmed stream. */
+void trainStream(Cache *myCache, unsigned long address){
+    Prefetcher *prefetcher = myCache->prefetcher;
+    unsigned long block = address >> myCache->b;
+    StreamEntry *stream = NULL;
+    StreamEntry *oldest = &prefetcher->streams[0];
+    prefetcher->streamClock++;
+    for(int i = 0; i < STREAM_ENTRIES; i++){
+        StreamEntry *entry = &prefetcher->streams[i];
+        long distance = (long) (block - entry->lastBlock);
+        int ahead = entry->direction == 0 ? distance != 0
+            : distance * entry->direction > 0;
+        if(entry->valid && ahead && labs(distance) <= STREAM_WINDOW){
+            stream = entry;
+            break;
+        }
+        if(!entry->valid || entry->lastUse < oldest->lastUse){
+            oldest = entry;
+        }
+    }
+    // start training a new stream in place of the least recent one
+    if(!stream){
+        oldest->valid = 1;
+        oldest->lastBlock = block;
+        oldest->direction = 0;
+        oldest->lastUse = prefetcher->streamClock;
+        return;
+    }
+    if(stream->direction == 0){
+        stream->direction = block > stream->lastBlock ? 1 : -1;
+    }
+    stream->lastBlock = block;
+    stream->lastUse = prefetcher->streamClock;
+    for(int k = 1; k <= prefetcher->degree; k++){
+        issuePrefetch(myCache, block + k * stream->direction);
+    }
+}
+
+/* Simulate a demand request on a cache with a prefetcher: credit the
+ * prefetches it uses and let it train on the access. */
+int updateCachePrefetched(Cache *myCache, CacheStats *stats, char accessType,
+    unsigned long address, CacheAccess *demand){
+    Prefetcher *prefetcher = myCache->prefetcher;
+    long setIndex = getSetIndex(address, myCache->s, myCache->b);
+    unsigned long tag = getTag(address, myCache->s, myCache->b);
+    uint64_t *bits = &myCache->prefetchBits[setIndex * myCache->maskWords];
+    unsigned long block = address >> myCache->b;
+    int prefetchHit = 0;
+    long line = probeLine(myCache, address);
+    if(line >= 0 && testBit(bits, line)){
+        prefetcher->useful++;
+        clearBit(bits, line);
+        prefetchHit = 1;
+    }
+    CacheAccess access;
+    updateCache(myCache, stats, accessType, setIndex, tag, &access);
+    if(!access.hit){
+        line = probeLine(myCache, address);
+        if(access.evicted && testBit(bits, line)){
+            prefetcher->uselessEvicted++;
+        }
+        clearBit(bits, line);
+        // a miss on a block a prefetch pushed out
+        unsigned long *slot = &prefetcher->pollutionFilter[block % POLLUTION_FILTER_SIZE];
+        if(*slot == block + 1){
+            prefetcher->pollutionMisses++;
+            *slot = 0;
+        }
+    }
+    switch(prefetcher->kind){
+        case PREFETCH_NEXT_LINE:
+            // tagged next-line: on a miss or the first use of a prefetch
+            if(!access.hit || prefetchHit){
+                for(int k = 1; k <= prefetcher->degree; k++){
+                    issuePrefetch(myCache, block + k);
+                }
+            }
+            break;
+        case PREFETCH_STRIDE:
+            trainStride(myCache, address);
+            break;
+        case PREFETCH_STREAM:
+            if(!access.hit || prefetchHit){
+                trainStream(myCache, address);
+            }
+            break;
+    }
+    *demand = access;
+    return 0;
+}
+
+/* Report how accurate and how useful a prefetcher was. */
+void printPrefetchSummary(const Prefetcher *prefetcher, long demandMisses){
+    double accuracy = prefetcher->issued
+        ? (double) prefetcher->useful / prefetcher->issued : 0;
+    // share of would-be misses that prefetching turned into hits
+    double coverage = prefetcher->useful + demandMisses
+        ? (double) prefetcher->useful / (prefetcher->useful + demandMisses) : 0;
+    printf("prefetch issued:%ld redundant:%ld useful:%ld useless_evicted:%ld "
+        "polluting_evictions:%ld pollution_misses:%ld accuracy:%.4f "
+        "coverage:%.4f\n", prefetcher->issued, prefetcher->redundant,
+        prefetcher->useful, prefetcher->uselessEvicted,
+        prefetcher->pollutingEvictions, prefetcher->pollutionMisses,
+        accuracy, coverage);
+}
+
+/****************************************/
+
+
+/********** Profiling methods **********/
+
+/* Initialize a profiler with 2^regionBits-byte regions, writing a CSV row
+ * per touched region every interval accesses to the file outputName.
+ * Return 0 if succeeds, or -1 if fails. */
+int initProfiler(Profiler *profiler, int regionBits, long interval,
+    char *outputName){
+    memset(profiler, 0, sizeof(Profiler));
+    profiler->regionBits = regionBits;
+    profiler->interval = interval;
+    profiler->regions = calloc(PROFILE_ENTRIES + 1, sizeof(RegionCounters));
+    profiler->touched = malloc((PROFILE_ENTRIES + 1) * sizeof(long));
+    profiler->output = fopen(outputName, "w");
+    if(!profiler->regions || !profiler->touched || !profiler->output){
+        return -1;
+    }
+    fprintf(profiler->output, "start_access,end_access,region,accesses,"
+        "misses,evictions\n");
+    return 0;
+}
+
+/* Release what initProfiler allocated. Return 0 if succeeds, -1 on error. */
+int freeProfiler(Profiler *profiler){
+    int res = 0;
+    if(profiler->output && fclose(profiler->output) != 0){
+        res = -1;
+    }
+    free(profiler->regions);
+    free(profiler->touched);
+    return res;
+}
+
+/* Find the counters of a region, claiming an empty entry on first use; a
+ * region that finds none within PROFILE_PROBES shares the last entry. */
+static inline long findRegion(Profiler *profiler, unsigned long region){
+    // Fibonacci hashing spreads consecutive regions over the table
+    long index = (region * 0x9E3779B97F4A7C15ULL) >> (64 - PROFILE_ENTRY_BITS);
+    for(int probe = 0; probe < PROFILE_PROBES; probe++){
+        RegionCounters *counters = &profiler->regions[index];
+        if(counters->region == region + 1){
+            return index;
+        }
+        if(counters->region == 0){
+            counters->region = region + 1;
+            return index;
+        }
+        index = (index + 1) & (PROFILE_ENTRIES - 1);
+    }
+    return PROFILE_ENTRIES;
+}
+
+/* Count an event in the region's counters, listing the region for the
+ * current interval row. */
+static inline RegionCounters *touchRegion(Profiler *profiler,
+    unsigned long address){
+    long index = findRegion(profiler, address >> profiler->regionBits);
+    RegionCounters *counters = &profiler->regions[index];
+    if(!counters->touched){
+        counters->touched = 1;
+        profiler->touched[profiler->numTouched++] = index;
+    }
+    return counters;
+}
+
+/* Write one CSV row per region touched since the last row, and reset
+ * their interval counters. */
+void flushInterval(Profiler *profiler){
+    for(long i = 0; i < profiler->numTouched; i++){
+        RegionCounters *counters = &profiler->regions[profiler->touched[i]];
+        if(profiler->touched[i] == PROFILE_ENTRIES){
+            fprintf(profiler->output, "%ld,%ld,other,", profiler->intervalStart,
+                profiler->accesses);
+        }else{
+            fprintf(profiler->output, "%ld,%ld,0x%lx,", profiler->intervalStart,
+                profiler->accesses,
+                (counters->region - 1) << profiler->regionBits);
+        }
+        fprintf(profiler->output, "%ld,%ld,%ld\n", counters->intervalAccesses,
+            counters->intervalMisses, counters->intervalEvictions);
+        counters->intervalAccesses = 0;
+        counters->intervalMisses = 0;
+        counters->intervalEvictions = 0;
+        counters->touched = 0;
+    }
+    profiler->numTouched = 0;
+    profiler->intervalStart = profiler->accesses;
+}
+
+/* Attribute a demand access to its region, and the line it evicted to the
+ * victim's region. */
+void profileAccess(Profiler *profiler, unsigned long address,
+    const CacheAccess *access){
+    RegionCounters *counters = touchRegion(profiler, address);
+    counters->accesses++;
+    counters->intervalAccesses++;
+    if(!access->hit){
+        counters->misses++;
+        counters->intervalMisses++;
+    }
+    if(access->evicted){
+        RegionCounters *victim = touchRegion(profiler, access->victimAddress);
+        victim->evictions++;
+        victim->intervalEvictions++;
+    }
+    profiler->accesses++;
+    if(profiler->interval && profiler->accesses % profiler->interval == 0){
+        flushInterval(profiler);
+    }
+}
+
+/* Write the last interval row, and report the regions with most misses. */
+void printProfileSummary(Profiler *profiler){
+    flushInterval(profiler);
+    long top[PROFILE_TOP];
+    int numTop = 0;
+    // keep the PROFILE_TOP entries with most misses, by insertion
+    for(long i = 0; i <= PROFILE_ENTRIES; i++){
+        long misses = profiler->regions[i].misses;
+        if(misses == 0 || (numTop == PROFILE_TOP
+            && misses <= profiler->regions[top[numTop - 1]].misses)){
+            continue;
+        }
+        int k = numTop < PROFILE_TOP ? numTop++ : PROFILE_TOP - 1;
+        while(k > 0 && profiler->regions[top[k - 1]].misses < misses){
+            top[k] = top[k - 1];
+            k--;
+        }
+        top[k] = i;
+    }
+    for(int k = 0; k < numTop; k++){
+        const RegionCounters *counters = &profiler->regions[top[k]];
+        if(top[k] == PROFILE_ENTRIES){
+            printf("region other");
+        }else{
+            printf("region 0x%lx", (counters->region - 1) << profiler->regionBits);
+        }
+        printf(" accesses:%ld misses:%ld evictions:%ld\n", counters->accesses,
+            counters->misses, counters->evictions);
+    }
+}
+
+/****************************************/
+
+
+/******* Cache hierarchy methods *******/
+
+/* Return the level below levels[index]; numLevels stands for memory. */
+int nextLevel(Hierarchy *h, int index){
+    return index < 2 ? 2 : index + 1;
+}
+
+/* Remove address from every level above levels[index].
+ * Return whether any removed copy was dirty. */
+int backInvalidate(Hierarchy *h, int index, unsigned long address){
+    int dirty = 0;
+    for(int i = h->hasL1i ? 0 : 1; i < index; i++){
+        CacheLevel *level = &h->levels[i];
+        int res = invalidateLine(level->cache, &level->stats, address);
+        if(res >= 0){
+            h->backInvalidations++;
+            dirty |= res;
+        }
+    }
+    return dirty;
+}
+
+/* Send a request to levels[index] of a non-inclusive or inclusive
+ * hierarchy, forwarding its misses and dirty victims to the level below. */
+void accessLevel(Hierarchy *h, int index, char accessType,
+    unsigned long address, int isWriteback){
+    if(index >= h->numLevels){
+        if(isWriteback){
+            h->memoryWrites++;
+        }else{
+            h->memoryReads++;
+        }
+        return;
+    }
+    CacheLevel *level = &h->levels[index];
+    Cache *myCache = level->cache;
+    CacheAccess access;
+    updateCache(myCache, isWriteback ? &level->writebackStats : &level->stats,
+        accessType, getSetIndex(address, myCache->s, myCache->b),
+        getTag(address, myCache->s, myCache->b), &access);
+    if(access.evicted){
+        int dirty = access.victimDirty;
+        // an inclusive level may not drop a block the levels above still hold
+        if(h->inclusion == INCLUSION_INCLUSIVE && index >= 2){
+            dirty |= backInvalidate(h, index, access.victimAddress);
+        }
+        if(dirty){
+            accessLevel(h, nextLevel(h, index), 'S', access.victimAddress, 1);
+        }
+    }
+    // a write-back carries the whole block, so only demand misses read below
+    if(!access.hit && !isWriteback){
+        accessLevel(h, nextLevel(h, index), 'L', address, 0);
+    }
+}
+
+/* Insert a victim into levels[index] of an exclusive hierarchy, pushing
+ * the victims it displaces further down. */
+void insertVictim(Hierarchy *h, int index, unsigned long address, int dirty){
+    while(index < h->numLevels){
+        CacheLevel *level = &h->levels[index];
+        Cache *myCache = level->cache;
+        CacheAccess access;
+        updateCache(myCache, &level->writebackStats, dirty ? 'S' : 'L',
+            getSetIndex(address, myCache->s, myCache->b),
+            getTag(address, myCache->s, myCache->b), &access);
+        if(!access.evicted){
+            return;
+        }
+        address = access.victimAddress;
+        dirty = access.victimDirty;
+        index = nextLevel(h, index);
+    }
+    if(dirty){
+        h->memoryWrites++;
+    }
+}
+
+/* Send a request to the L1 cache levels[first] of an exclusive hierarchy,
+ * where a block lives in at most one level and moves up on a hit. */
+void accessExclusive(Hierarchy *h, int first, char accessType,
+    unsigned long address){
+    CacheLevel *level = &h->levels[first];
+    Cache *myCache = level->cache;
+    CacheAccess access;
+    updateCache(myCache, &level->stats, accessType,
+        getSetIndex(address, myCache->s, myCache->b),
+        getTag(address, myCache->s, myCache->b), &access);
+    if(!access.hit){
+        // take the block out of the level below that holds it
+        int index = nextLevel(h, first);
+        int dirty = 0;
+        for(; index < h->numLevels; index = nextLevel(h, index)){
+            CacheLevel *lower = &h->levels[index];
+            int res = invalidateLine(lower->cache, &lower->stats, address);
+            if(res >= 0){
+                lower->stats.hits++;
+                dirty = res;
+                break;
+            }
+            lower->stats.misses++;
+        }
+        if(index >= h->numLevels){
+            h->memoryReads++;
+        }
+        if(dirty){
+            markDirty(myCache, &level->stats, address);
+        }
+    }
+    if(access.evicted){
+        insertVictim(h, nextLevel(h, first), access.victimAddress,
+            access.victimDirty);
+    }
+}
+
+/* Handle one trace request in the hierarchy: instruction fetches go to L1I,
+ * loads and stores to L1D. */
+int handleHierarchyRequest(Hierarchy *h, char accessType,
+    unsigned long address){
+    int first;
+    switch(accessType){
+        case 'I':
+            // instruction fetches are not modeled without an L1I
+            if(!h->hasL1i){
+                return 0;
+            }
+            first = 0;
+            accessType = 'L';
+            break;
+        case 'L':
+        case 'S':
+            first = 1;
+            break;
+        default:
+            fprintf(stderr, "Not supported request type. %c\n", accessType);
+            return 1;
+    }
+    if(h->inclusion == INCLUSION_EXCLUSIVE){
+        accessExclusive(h, first, accessType, address);
+    }else{
+        accessLevel(h, first, accessType, address, 0);
+    }
+    return 0;
+}
+
+/* Parse a hierarchy such as "l1i=6:8:6,l1d=6:8:6,l2=9:8:6,llc=11:16:6"
+ * into h, creating its caches. l1d is required, l1i is optional, and the
+ * other levels are shared and ordered from top to bottom.
+ * Return 0 if succeeds, or -1 if fails. */
+int initHierarchy(Hierarchy *h, char *hvalue, ReplacementPolicy policy,
+    InclusionPolicy inclusion){
+    memset(h, 0, sizeof(Hierarchy));
+    h->inclusion = inclusion;
+    h->numLevels = 2;
+    char *copy = strdup(hvalue);
+    if(!copy){
+        return -1;
+    }
+    int res = 0;
+    int blockBits = -1;
+    char *savePtr = NULL;
+    for(char *item = strtok_r(copy, ",", &savePtr); item && res == 0;
+        item = strtok_r(NULL, ",", &savePtr)){
+        char name[8];
+        int s, e, b;
+        if(sscanf(item, "%7[^=]=%d:%d:%d", name, &s, &e, &b) != 4
+            || s < 0 || e <= 0 || b < 0){
+            res = -1;
+            break;
+        }
+        // addresses are passed between levels block by block
+        if(blockBits >= 0 && b != blockBits){
+            fprintf(stderr, "All levels must use the same block size.\n");
+            res = -1;
+            break;
+        }
+        blockBits = b;
+        int index;
+        if(strcmp(name, "l1i") == 0){
+            index = 0;
+            h->hasL1i = 1;
+        }else if(strcmp(name, "l1d") == 0){
+            index = 1;
+        }else if(h->numLevels < MAX_LEVELS){
+            index = h->numLevels++;
+        }else{
+            res = -1;
+            break;
+        }
+        CacheLevel *level = &h->levels[index];
+        if(level->cache){
+            res = -1;
+            break;
+        }
+        strcpy(level->name, name);
+        level->cache = initCache(s, e, b, policy);
+        if(!level->cache){
+            res = -1;
+        }
+    }
+    free(copy);
+    if(!h->levels[1].cache){
+        res = -1;
+    }
+    return res;
+}
+
+/* Free the caches of a hierarchy. */
+void freeHierarchy(Hierarchy *h){
+    for(int i = 0; i < h->numLevels; i++){
+        if(h->levels[i].cache){
+            freeCache(h->levels[i].cache);
+        }
+    }
+}
+
+/* Handle a batch of requests through the hierarchy. */
+void handleHierarchyBatch(void *arg, const TraceRecord *records, long n){
+    for(long i = 0; i < n; i++){
+        handleHierarchyRequest(arg, records[i].accessType, records[i].address);
+    }
+}
+
+/* Simulate a cache hierarchy with the given memory trace file, and report
+ * each level and the memory traffic below the last level. */
+int simulateHierarchyOps(char *hvalue, ReplacementPolicy policy,
+    InclusionPolicy inclusion, char *tvalue){
+    Hierarchy h;
+    if(initHierarchy(&h, hvalue, policy, inclusion) != 0){
+        fprintf(stderr, "Failed to initialize cache hierarchy.\n");
+        freeHierarchy(&h);
+        return 1;
+    }
+    if(forEachTraceBatch(tvalue, handleHierarchyBatch, &h) != 0){
+        freeHierarchy(&h);
+        return -1;
+    }
+    long numBytesPerLine = 1L << h.levels[1].cache->b;
+    for(int i = h.hasL1i ? 0 : 1; i < h.numLevels; i++){
+        CacheLevel *level = &h.levels[i];
+        CacheStats *demand = &level->stats;
+        CacheStats *writeback = &level->writebackStats;
+        printf("%s hits:%ld misses:%ld evictions:%ld writebacks:%ld "
+            "dirty_bytes_in_cache:%ld dirty_bytes_evicted:%ld\n", level->name,
+            demand->hits, demand->misses,
+            demand->evictions + writeback->evictions,
+            writeback->hits + writeback->misses,
+            (demand->dirtyBlocksInCache + writeback->dirtyBlocksInCache)
+                * numBytesPerLine,
+            (demand->dirtyBlocksEvicted + writeback->dirtyBlocksEvicted)
+                * numBytesPerLine);
+    }
+    if(inclusion == INCLUSION_INCLUSIVE){
+        printf("back_invalidations:%ld\n", h.backInvalidations);
+    }
+    printf("memory read_bytes:%ld write_bytes:%ld total_bytes:%ld\n",
+        h.memoryReads * numBytesPerLine, h.memoryWrites * numBytesPerLine,
+        (h.memoryReads + h.memoryWrites) * numBytesPerLine);
+    freeHierarchy(&h);
+    return 0;
+}
+
+/****************************************/
+
+
+/********* Sweep simulation methods *********/
+
+/* represent the LRU stacks of one (s, b) pair in a sweep. Each set keeps its
+ * most recent maxE tags in recency order, which gives the result of every
+ * associativity up to maxE at once. */
+typedef struct{
+    int s;
+    int b;
+    int maxE;
+    /* maxE tags per set, most recently used first */
+    unsigned long *stacks;
+    /* number of distinct tags in each set's stack */
+    int *depths;
+    /* foundAt[d]: accesses found at stack distance d */
+    long *foundAt;
+    /* missedAt[k]: accesses not in the stack while it held k tags */
+    long *missedAt;
+}StackSim;
+
+/* represent one sweep thread, running the StackSims whose index modulo
+ * numSlots falls in [firstSlot, endSlot) over every trace batch. */
+typedef struct{
+    StackSim *sims;
+    int numSims;
+    TraceSource *source;
+    int numSlots;
+    int firstSlot;
+    int endSlot;
+}SweepWorker;
+
+/* Parse a sweep list "4", "2,4,8" or "4-8" into values.
+ * Return the number of values, or -1 if invalid. */
+int parseList(int isE, char *str, int *values){
+    int count = 0;
+    char *copy = strdup(str);
+    if(!copy){
+        return -1;
+    }
+    char *savePtr = NULL;
+    for(char *item = strtok_r(copy, ",", &savePtr); item;
+        item = strtok_r(NULL, ",", &savePtr)){
+        char *dash = strchr(item, '-');
+        if(dash){
+            *dash = '\0';
+        }
+        int low = parseInt(isE, item);
+        int high = dash ? parseInt(isE, dash + 1) : low;
+        if(low < 0 || high < low || count + (high - low + 1) > MAX_SWEEP_VALUES){
+            free(copy);
+            return -1;
+        }
+        for(int v = low; v <= high; v++){
+            values[count++] = v;
+        }
+    }
+    free(copy);
+    return count > 0 ? count : -1;
+}
+
+/* Run one (s, b) pair's LRU stacks over the given records. */
+void runStackSim(StackSim *sim, const TraceRecord *records, uint64_t n){
+    int maxE = sim->maxE;
+    for(uint64_t i = 0; i < n; i++){
+        char accessType = records[i].accessType;
+        if(accessType != 'L' && accessType != 'S'){
+            continue;
+        }
+        long setIndex = getSetIndex(records[i].address, sim->s, sim->b);
+        unsigned long tag = getTag(records[i].address, sim->s, sim->b);
+        unsigned long *stack = &sim->stacks[setIndex * maxE];
+        int depth = sim->depths[setIndex];
+        int d = 0;
+        while(d < depth && stack[d] != tag){
+            d++;
+        }
+        if(d < depth){
+            sim->foundAt[d]++;
+        }else{
+            sim->missedAt[depth]++;
+            // the least recent tag falls off a full stack
+            if(depth < maxE){
+                sim->depths[setIndex]++;
+            }else{
+                d = maxE - 1;
+            }
+        }
+        // move the tag to the top of the stack
+        memmove(&stack[1], &stack[0], d * sizeof(unsigned long));
+        stack[0] = tag;
+    }
+}
+
+/* Run the worker's (s, b) pairs over a batch of requests. */
+void runSweepBatch(void *arg, const TraceRecord *records, long n){
+    SweepWorker *worker = arg;
+    for(int i = 0; i < worker->numSims; i++){
+        int slot = i % worker->numSlots;
+        if(slot >= worker->firstSlot && slot < worker->endSlot){
+            runStackSim(&worker->sims[i], records, n);
+        }
+    }
+}
+
+/* Sweep thread: run the worker's (s, b) pairs over the whole trace. */
+void *sweepThread(void *arg){
+    SweepWorker *worker = arg;
+    consumeTrace(worker->source, runSweepBatch, worker);
+    return NULL;
+}
+
+/* Report hits, misses and evictions of an E-way cache from sim's stacks. */
+void printSweepResult(const StackSim *sim, int e){
+    long hitCount = 0, missCount = 0, evictionCount = 0;
+    for(int d = 0; d < sim->maxE; d++){
+        // hit when found within the top e tags, otherwise an eviction
+        if(d < e){
+            hitCount += sim->foundAt[d];
+        }else{
+            missCount += sim->foundAt[d];
+            evictionCount += sim->foundAt[d];
+        }
+    }
+    for(int k = 0; k <= sim->maxE; k++){
+        // a miss only evicts if the set already holds e lines
+        missCount += sim->missedAt[k];
+        if(k >= e){
+            evictionCount += sim->missedAt[k];
+        }
+    }
+    printf("s:%d E:%d b:%d hits:%ld misses:%ld evictions:%ld\n", sim->s, e,
+        sim->b, hitCount, missCount, evictionCount);
+}
+
+/* Simulate every combination of the given s, E and b values over one pass
+ * of the trace, running (s, b) pairs in parallel. */
+int sweepCacheOps(int *sValues, int numS, int *eValues, int numE,
+    int *bValues, int numB, char *tvalue){
+    int maxE = 0;
+    for(int i = 0; i < numE; i++){
+        maxE = eValues[i] > maxE ? eValues[i] : maxE;
+    }
+    TraceSource source;
+    if(openTraceSource(tvalue, &source) != 0){
+        closeTraceSource(&source);
+        return -1;
+    }
+    int res = 0;
+    int numSims = numS * numB;
+    StackSim *sims = calloc(numSims, sizeof(StackSim));
+    for(int i = 0; sims && i < numSims; i++){
+        StackSim *sim = &sims[i];
+        sim->b = bValues[i / numS];
+        sim->s = sValues[i % numS];
+        sim->maxE = maxE;
+        long numSets = 1L << sim->s;
+        sim->stacks = malloc(numSets * maxE * sizeof(unsigned long));
+        sim->depths = calloc(numSets, sizeof(int));
+        sim->foundAt = calloc(maxE + 1, sizeof(long));
+        sim->missedAt = calloc(maxE + 1, sizeof(long));
+        if(!sim->stacks || !sim->depths || !sim->foundAt || !sim->missedAt){
+            res = -1;
+        }
+    }
+    long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    numThreads = numThreads < 1 ? 1 : numThreads;
+    numThreads = numThreads > numSims ? numSims : numThreads;
+    SweepWorker *workers = calloc(numThreads, sizeof(SweepWorker));
+    pthread_t *threads = malloc(numThreads * sizeof(pthread_t));
+    if(!sims || res != 0 || !workers || !threads){
+        fprintf(stderr, "Failed to initialize sweep.\n");
+        res = -1;
+    }else{
+        for(long i = 0; i < numThreads; i++){
+            SweepWorker worker = {sims, numSims, &source, numThreads, i, i + 1};
+            workers[i] = worker;
+        }
+        // this thread runs the last worker, and takes over the pairs of any
+        // worker whose thread fails to start
+        long started = 0;
+        while(started < numThreads - 1 && pthread_create(&threads[started],
+            NULL, sweepThread, &workers[started]) == 0){
+            started++;
+        }
+        SweepWorker *own = &workers[started];
+        own->endSlot = numThreads;
+        res = startTraceSource(&source, started + 1);
+        if(consumeTrace(&source, runSweepBatch, own) != 0){
+            res = -1;
+        }
+        for(long i = 0; i < started; i++){
+            pthread_join(threads[i], NULL);
+        }
+        for(int i = 0; res == 0 && i < numSims; i++){
+            for(int j = 0; j < numE; j++){
+                printSweepResult(&sims[i], eValues[j]);
+            }
+        }
+    }
+    free(workers);
+    free(threads);
+    for(int i = 0; sims && i < numSims; i++){
+        free(sims[i].stacks);
+        free(sims[i].depths);
+        free(sims[i].foundAt);
+        free(sims[i].missedAt);
+    }
+    free(sims);
+    if(closeTraceSource(&source) != 0){
+        res = -1;
+    }
+    return res;
+}
+
+/****************************************/
+
+int main(int argc, char * const argv[])
+{    
+    char *svalue, *evalue, *bvalue, *tvalue, *cvalue, *rvalue, *jvalue,
+        *hvalue, *ivalue, *pvalue, *ovalue, *nvalue, *gvalue;
+    int s, e, b, policy, numThreads;
+    svalue = evalue = bvalue = tvalue = cvalue = rvalue = jvalue = NULL;
+    hvalue = ivalue = pvalue = ovalue = nvalue = gvalue = NULL;
+    int sweep = 0;
+    char *pattern = "s:E:b:t:c:r:wj:H:i:p:o:n:g:";
     int c;
     while( (c = getopt(argc, argv, pattern)) != -1 ){
         switch(c){
@@ -269,6 +2145,36 @@ int main(int argc, char * const argv[])
             case 't':
                 tvalue = optarg;
                 break;
+            case 'c':
+                cvalue = optarg;
+                break;
+            case 'r':
+                rvalue = optarg;
+                break;
+            case 'w':
+                sweep = 1;
+                break;
+            case 'j':
+                jvalue = optarg;
+                break;
+            case 'H':
+                hvalue = optarg;
+                break;
+            case 'i':
+                ivalue = optarg;
+                break;
+            case 'p':
+                pvalue = optarg;
+                break;
+            case 'o':
+                ovalue = optarg;
+                break;
+            case 'n':
+                nvalue = optarg;
+                break;
+            case 'g':
+                gvalue = optarg;
+                break;
             // invalid option input
             case '?':
                 fprintf(stderr, "Invalid option -%c.\n", optopt);
@@ -278,20 +2184,101 @@ int main(int argc, char * const argv[])
                 abort();
         }
     }    
+    // convert the text trace to a binary trace instead of simulating
+    if(cvalue){
+        if(!tvalue){
+            fprintf(stderr, "Missing required options or arguments.\n");
+            return 1;
+        }
+        if(convertTrace(tvalue, cvalue) != 0){
+            fprintf(stderr, "Conversion failed.\n");
+            return 1;
+        }
+        return 0;
+    }
+    // prefetches cross sets, so they are only modeled in a serial run
+    Prefetcher prefetcher;
+    if(pvalue && (parsePrefetcher(pvalue, &prefetcher) != 0 || jvalue
+        || sweep || hvalue)){
+        fprintf(stderr, "Invalid argument. \n");
+        return 1;
+    }
+    // profile per region into the -o file; it also needs a serial run
+    if((nvalue || gvalue) && !ovalue){
+        fprintf(stderr, "Missing required options or arguments.\n");
+        return 1;
+    }
+    int regionBits = gvalue ? parseInt(0, gvalue) : DEFAULT_PROFILE_BITS;
+    long interval = nvalue ? parseInt(1, nvalue) : 0;
+    if(ovalue && (regionBits < 0 || regionBits > 63 || interval < 0 || jvalue
+        || sweep || hvalue)){
+        fprintf(stderr, "Invalid argument. \n");
+        return 1;
+    }
+    // the hierarchy option replaces -s, -E and -b
+    if(hvalue){
+        policy = rvalue ? parsePolicy(rvalue) : POLICY_LRU;
+        // non-inclusive non-exclusive by default
+        int inclusion = ivalue ? parseInclusion(ivalue) : INCLUSION_NINE;
+        if(!tvalue || policy < 0 || inclusion < 0){
+            fprintf(stderr, "Invalid argument. \n");
+            return 1;
+        }
+        if(simulateHierarchyOps(hvalue, policy, inclusion, tvalue) != 0){
+            fprintf(stderr, "Simulation failed.\n");
+            return 1;
+        }
+        return 0;
+    }
     // check completeness of input: exclude null arg
     if(!(svalue && evalue && bvalue && tvalue)){
         fprintf(stderr, "Missing required options or arguments.\n");
         return 1;
     }
+    // -s, -E and -b take lists of values in sweep mode
+    if(sweep){
+        int sValues[MAX_SWEEP_VALUES], eValues[MAX_SWEEP_VALUES],
+            bValues[MAX_SWEEP_VALUES];
+        int numS = parseList(0, svalue, sValues);
+        int numE = parseList(1, evalue, eValues);
+        int numB = parseList(0, bvalue, bValues);
+        if(numS < 0 || numE < 0 || numB < 0
+            || (rvalue && parsePolicy(rvalue) != POLICY_LRU)){
+            fprintf(stderr, "Invalid argument. Sweep mode models LRU only.\n");
+            return 1;
+        }
+        if(sweepCacheOps(sValues, numS, eValues, numE, bValues, numB,
+            tvalue) != 0){
+            fprintf(stderr, "Simulation failed.\n");
+            return 1;
+        }
+        return 0;
+    }
     // clear number of last error for converting string to int
     s = parseInt(0, svalue);
     e = parseInt(1, evalue);
     b = parseInt(0, bvalue);
-    if(s < 0 || e < 0 || b < 0){
+    // default to true LRU
+    policy = rvalue ? parsePolicy(rvalue) : POLICY_LRU;
+    // serial simulation unless -j asks for worker threads
+    numThreads = jvalue ? parseInt(1, jvalue) : 1;
+    if(s < 0 || e < 0 || b < 0 || policy < 0 || numThreads < 0){
         fprintf(stderr, "Invalid argument. \n");
         return 1;
     }    
-    int res = simulateCacheOps(s, e, b, tvalue);
+    Profiler profiler;
+    if(ovalue && initProfiler(&profiler, regionBits, interval, ovalue) != 0){
+        fprintf(stderr, "Failed to initialize profiler.\n");
+        freeProfiler(&profiler);
+        return 1;
+    }
+    int res = numThreads > 1
+        ? simulateCacheOpsParallel(s, e, b, policy, tvalue, numThreads)
+        : simulateCacheOps(s, e, b, policy, pvalue ? &prefetcher : NULL,
+            ovalue ? &profiler : NULL, tvalue);
+    if(ovalue && freeProfiler(&profiler) != 0){
+        res = -1;
+    }
     if(res != 0){
         fprintf(stderr, "Simulation failed.\n");
         return 1;
@@ -0,0 +1,631 @@
+/*
+ * The program replays allocation traces against the allocator of
+ * malloc_simulator.c, or against the C library's allocator for comparison,
+ * and reports
+ * 1. throughput in operations per second, over untimed replays,
+ * 2. a histogram of CPU cycles per malloc, free, realloc and calloc, from
+ *    one replay that times every request, and
+ * 3. the peak utilization over time: the most payload bytes ever live
+ *    divided by the heap size, sampled every few requests, and
+ * 4. for the simulated allocator, its statistics at the end of the trace:
+ *    free bytes per size class, fragmentation and find_fit search lengths.
+ *
+ * A trace has one request per line: "a id size" (malloc), "f id" (free),
+ * "r id size" (realloc) and "c id size" (calloc). Lines starting with a
+ * digit, like the header of the course traces, are skipped.
+ *
+ * Build it with the allocator compiled for the driver, e.g.
+ *     gcc -O2 -pthread -DDRIVER -c malloc_simulator.c
+ *     gcc -O2 -pthread malloc_bench.c malloc_simulator.o memlib.o
+ *
+ * Author: Jinyi Li
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#include <malloc.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "memlib.h"
+#include "malloc_stats.h"
+
+/* Allocator under test, from malloc_simulator.c built with -DDRIVER */
+bool mm_init(void);
+void *mm_malloc(size_t size);
+void mm_free(void *ptr);
+void *mm_realloc(void *ptr, size_t size);
+void *mm_calloc(size_t elements, size_t size);
+bool mm_checkheap(int lineno);
+
+/* Request types, in the order the report lists them */
+#define NUM_OPS 4
+/* Cycle histogram buckets: bucket k counts requests of [2^k, 2^(k+1)) */
+#define NUM_BUCKETS 64
+/* Utilization samples per replay, unless -i sets the interval */
+#define NUM_SAMPLES 20
+
+static const char op_chars[NUM_OPS] = {'a', 'f', 'r', 'c'};
+static const char *op_names[NUM_OPS] = {"malloc", "free", "realloc", "calloc"};
+
+/* One request of a trace */
+typedef struct
+{
+    int op;                     // index into op_chars
+    int id;                     // block the request works on
+    size_t size;                // requested bytes, unused by free
+} request_t;
+
+/* A trace, with the number of block ids it uses */
+typedef struct
+{
+    request_t *requests;
+    size_t num_requests;
+    int num_ids;
+} trace_t;
+
+/* Allocator entry points replayed against */
+typedef struct
+{
+    const char *name;
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    void *(*calloc)(size_t elements, size_t size);
+    bool (*reset)(void);        // start over with an empty heap
+    size_t (*heap_size)(void);  // bytes the allocator holds from the system
+} allocator_t;
+
+/* Per-request cycle counts of one replay */
+typedef struct
+{
+    uint64_t buckets[NUM_OPS][NUM_BUCKETS];
+    uint64_t count[NUM_OPS];
+    uint64_t total[NUM_OPS];
+    uint64_t max[NUM_OPS];
+} profile_t;
+
+/* State of one replay: the blocks of every id with their sizes */
+typedef struct
+{
+    char **blocks;
+    size_t *sizes;
+    size_t live;                // payload bytes allocated now
+    size_t peak;                // most payload bytes ever allocated
+} replay_t;
+
+static bool check_heap = false;       // run mm_checkheap after every request
+
+
+/****************** ALLOCATORS ***********************************************/
+/*
+ * Start the simulated allocator over on an empty heap.
+ */
+static bool mm_reset(void)
+{
+    mem_reset_brk();
+    return mm_init();
+}
+
+/*
+ * Return the size of the simulated heap.
+ */
+static size_t mm_heap_size(void)
+{
+    return mem_heapsize();
+}
+
+/*
+ * The C library's heap needs no reset: every replay frees its blocks.
+ */
+static bool libc_reset(void)
+{
+    return true;
+}
+
+/*
+ * Return the bytes the C library's allocator holds from the system, in its
+ * heaps and in mappings of large blocks.
+ */
+static size_t libc_heap_size(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+#else
+    struct mallinfo info = mallinfo();
+    return (size_t)(unsigned int)info.arena + (unsigned int)info.hblkhd;
+#endif
+}
+
+static void print_stats(void);
+
+static const allocator_t mm_allocator = {
+    "mm", mm_malloc, mm_free, mm_realloc, mm_calloc, mm_reset, mm_heap_size
+};
+static const allocator_t libc_allocator = {
+    "libc", malloc, free, realloc, calloc, libc_reset, libc_heap_size
+};
+
+
+/****************** TRACES ***************************************************/
+/*
+ * Read the trace at path. Ids may come in any order; the blocks of a
+ * replay are indexed by them.
+ *
+ * Return 0 if succeeds, or 1 if fails.
+ */
+static int read_trace(const char *path, trace_t *trace)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+
+    size_t capacity = 1024;
+    trace->requests = malloc(capacity * sizeof(request_t));
+    trace->num_requests = 0;
+    trace->num_ids = 0;
+    char line[256];
+    int lineno = 0;
+    while (trace->requests != NULL && fgets(line, sizeof(line), file))
+    {
+        lineno++;
+        char type;
+        int id;
+        size_t size = 0;
+        if (sscanf(line, " %c", &type) != 1 || (type >= '0' && type <= '9'))
+        {
+            continue;
+        }
+        const char *found = memchr(op_chars, type, NUM_OPS);
+        int fields = sscanf(line, " %c %d %zu", &type, &id, &size);
+        if (found == NULL || id < 0 || fields != (type == 'f' ? 2 : 3))
+        {
+            fprintf(stderr, "%s:%d: bad request: %s", path, lineno, line);
+            fclose(file);
+            free(trace->requests);
+            return 1;
+        }
+
+        if (trace->num_requests == capacity)
+        {
+            capacity *= 2;
+            request_t *grown = realloc(trace->requests,
+                                       capacity * sizeof(request_t));
+            if (grown == NULL)
+            {
+                free(trace->requests);
+                trace->requests = NULL;
+                break;
+            }
+            trace->requests = grown;
+        }
+        request_t *request = &trace->requests[trace->num_requests++];
+        request->op = (int)(found - op_chars);
+        request->id = id;
+        request->size = size;
+        if (id >= trace->num_ids)
+        {
+            trace->num_ids = id + 1;
+        }
+    }
+    fclose(file);
+    if (trace->requests == NULL)
+    {
+        fprintf(stderr, "%s: out of memory\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+
+/****************** REPLAY ***************************************************/
+/*
+ * Return a timestamp in CPU cycles, or in nanoseconds where the cycle
+ * counter cannot be read.
+ */
+static inline uint64_t read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+/*
+ * Return the current time in seconds.
+ */
+static double now_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Serve a request with the allocator, touching the first and last byte a
+ * block gets so the memory of every block is really used.
+ *
+ * Return 0 if succeeds, or 1 if the allocator failed.
+ */
+static int serve_request(const allocator_t *alloc, replay_t *replay,
+                         const request_t *request)
+{
+    char **block = &replay->blocks[request->id];
+    size_t *size = &replay->sizes[request->id];
+    size_t new_size = request->size;
+
+    switch (request->op)
+    {
+    case 0:                                     // malloc
+        alloc->free(*block);
+        replay->live -= *size;
+        *block = alloc->malloc(new_size);
+        break;
+    case 1:                                     // free
+        alloc->free(*block);
+        *block = NULL;
+        new_size = 0;
+        break;
+    case 2:                                     // realloc
+        if (new_size > 0)
+        {
+            char *moved = alloc->realloc(*block, new_size);
+            if (moved == NULL)
+            {
+                return 1;
+            }
+            *block = moved;
+        }
+        else
+        {
+            alloc->free(*block);
+            *block = NULL;
+        }
+        break;
+    default:                                    // calloc
+        alloc->free(*block);
+        replay->live -= *size;
+        *block = alloc->calloc(1, new_size);
+        break;
+    }
+    if (new_size > 0)
+    {
+        if (*block == NULL)
+        {
+            return 1;
+        }
+        (*block)[0] = 1;
+        (*block)[new_size - 1] = 1;
+    }
+    if (request->op != 0 && request->op != 3)
+    {
+        replay->live -= *size;
+    }
+    replay->live += new_size;
+    *size = new_size;
+    if (replay->live > replay->peak)
+    {
+        replay->peak = replay->live;
+    }
+    return 0;
+}
+
+/*
+ * Replay the trace once on a reset allocator and free its remaining blocks.
+ * With a profile, every request is timed, and with a sample interval the
+ * peak utilization is printed every interval requests.
+ *
+ * Return 0 if succeeds, or 1 if fails.
+ */
+static int replay_trace(const allocator_t *alloc, const trace_t *trace,
+                        profile_t *profile, size_t interval)
+{
+    if (!alloc->reset())
+    {
+        fprintf(stderr, "%s: cannot reset the heap\n", alloc->name);
+        return 1;
+    }
+    replay_t replay = {calloc(trace->num_ids, sizeof(char *)),
+                       calloc(trace->num_ids, sizeof(size_t)), 0, 0};
+    if (replay.blocks == NULL || replay.sizes == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        free(replay.blocks);
+        free(replay.sizes);
+        return 1;
+    }
+
+    int res = 0;
+    for (size_t i = 0; i < trace->num_requests && res == 0; i++)
+    {
+        const request_t *request = &trace->requests[i];
+        if (profile == NULL)
+        {
+            res = serve_request(alloc, &replay, request);
+        }
+        else
+        {
+            uint64_t start = read_cycles();
+            res = serve_request(alloc, &replay, request);
+            uint64_t cycles = read_cycles() - start;
+            int op = request->op;
+            int bucket = cycles == 0 ? 0 : 63 - __builtin_clzll(cycles);
+            profile->buckets[op][bucket]++;
+            profile->count[op]++;
+            profile->total[op] += cycles;
+            if (cycles > profile->max[op])
+            {
+                profile->max[op] = cycles;
+            }
+        }
+        if (res != 0)
+        {
+            fprintf(stderr, "%s: request %zu (%s of %zu bytes) failed\n",
+                    alloc->name, i, op_names[request->op], request->size);
+        }
+        else if (check_heap && alloc == &mm_allocator
+                 && !mm_checkheap(__LINE__))
+        {
+            fprintf(stderr, "mm: heap check failed after request %zu\n", i);
+            res = 1;
+        }
+        if (res == 0 && interval > 0
+            && ((i + 1) % interval == 0 || i + 1 == trace->num_requests))
+        {
+            size_t heap = alloc->heap_size();
+            printf("%12zu %14zu %14zu %14zu %8.3f\n", i + 1, replay.live,
+                   replay.peak, heap, heap ? (double)replay.peak / heap : 0.0);
+        }
+    }
+
+    if (res == 0 && profile != NULL && alloc == &mm_allocator)
+    {
+        print_stats();
+    }
+    for (int id = 0; id < trace->num_ids; id++)
+    {
+        alloc->free(replay.blocks[id]);
+    }
+    free(replay.blocks);
+    free(replay.sizes);
+    return res;
+}
+
+
+/****************** REPORT ***************************************************/
+/*
+ * Return the upper bound of the bucket holding the given fraction of the
+ * requests of type op.
+ */
+static uint64_t percentile(const profile_t *profile, int op, double fraction)
+{
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < NUM_BUCKETS; bucket++)
+    {
+        seen += profile->buckets[op][bucket];
+        if (seen > 0 && seen >= fraction * profile->count[op])
+        {
+            return (uint64_t)2 << bucket;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Print the cycle summary of every request type, then the histogram rows
+ * from the fastest to the slowest non-empty bucket.
+ */
+static void print_profile(const profile_t *profile)
+{
+    printf("%-8s %10s %10s %10s %10s %12s\n", "op", "count", "mean",
+           "p50<=", "p99<=", "max");
+    for (int op = 0; op < NUM_OPS; op++)
+    {
+        if (profile->count[op] == 0)
+        {
+            continue;
+        }
+        printf("%-8s %10lu %10.1f %10lu %10lu %12lu\n", op_names[op],
+               profile->count[op],
+               (double)profile->total[op] / profile->count[op],
+               percentile(profile, op, 0.5), percentile(profile, op, 0.99),
+               profile->max[op]);
+    }
+
+    int first = NUM_BUCKETS, last = -1;
+    for (int bucket = 0; bucket < NUM_BUCKETS; bucket++)
+    {
+        for (int op = 0; op < NUM_OPS; op++)
+        {
+            if (profile->buckets[op][bucket] > 0)
+            {
+                first = bucket < first ? bucket : first;
+                last = bucket;
+            }
+        }
+    }
+    printf("%-12s", "cycles");
+    for (int op = 0; op < NUM_OPS; op++)
+    {
+        printf(" %10s", op_names[op]);
+    }
+    printf("\n");
+    for (int bucket = first; bucket <= last; bucket++)
+    {
+        printf("< %-10lu", (uint64_t)2 << bucket);
+        for (int op = 0; op < NUM_OPS; op++)
+        {
+            printf(" %10lu", profile->buckets[op][bucket]);
+        }
+        printf("\n");
+    }
+}
+
+/*
+ * Print the statistics of the simulated allocator: the heap, the free
+ * bytes of every non-empty size class and the find_fit search lengths.
+ */
+static void print_stats(void)
+{
+    mm_stats_t stats;
+    mm_get_stats(&stats);
+    printf("heap: %zu bytes in %zu sbrk calls, %zu in %zu mapped blocks"
+           " (%zu mmap calls)\n", stats.heap_bytes, stats.sbrk_calls,
+           stats.mapped_bytes, stats.mapped_blocks, stats.mmap_calls);
+    printf("in use: %zu bytes, %zu of them free in slabs; deferred: %zu bytes"
+           " in %zu blocks\n", stats.in_use_bytes, stats.slab_free_bytes,
+           stats.deferred_bytes, stats.deferred_blocks);
+    printf("free: %zu bytes in %zu blocks, largest %zu, fragmentation %.3f\n",
+           stats.free_bytes, stats.free_blocks, stats.largest_free,
+           stats.fragmentation);
+    printf("%-12s %10s %14s\n", "class>=", "blocks", "bytes");
+    for (int class = 0; class < MM_STATS_CLASSES; class++)
+    {
+        if (stats.class_free_blocks[class] > 0)
+        {
+            printf("%-12zu %10zu %14zu\n", stats.class_sizes[class],
+                   stats.class_free_blocks[class],
+                   stats.class_free_bytes[class]);
+        }
+    }
+    printf("find_fit: %zu searches, %zu misses\n", stats.fit_searches,
+           stats.fit_misses);
+    printf("%-12s %10s\n", "examined<", "searches");
+    for (int k = 0; k < MM_STATS_SEARCH_BUCKETS; k++)
+    {
+        if (stats.search_lengths[k] > 0)
+        {
+            printf("%-12zu %10zu\n", (size_t)1 << k, stats.search_lengths[k]);
+        }
+    }
+}
+
+/*
+ * Benchmark the allocator on the trace: throughput over the given number
+ * of replays, then one profiled replay with the utilization samples.
+ *
+ * Return 0 if succeeds, or 1 if fails.
+ */
+static int bench_trace(const allocator_t *alloc, const char *path,
+                       const trace_t *trace, int repeats, size_t interval)
+{
+    printf("== %s on %s: %zu requests, %d ids\n", alloc->name, path,
+           trace->num_requests, trace->num_ids);
+
+    double start = now_seconds();
+    for (int i = 0; i < repeats; i++)
+    {
+        if (replay_trace(alloc, trace, NULL, 0))
+        {
+            return 1;
+        }
+    }
+    double seconds = now_seconds() - start;
+    printf("throughput: %.0f ops/sec (%d replays in %.3f s)\n",
+           repeats * trace->num_requests / seconds, repeats, seconds);
+
+    profile_t *profile = calloc(1, sizeof(profile_t));
+    if (profile == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    if (interval == 0)
+    {
+        interval = (trace->num_requests + NUM_SAMPLES - 1) / NUM_SAMPLES;
+    }
+    printf("%12s %14s %14s %14s %8s\n", "requests", "live_bytes",
+           "peak_bytes", "heap_bytes", "util");
+    int res = replay_trace(alloc, trace, profile, interval);
+    if (res == 0)
+    {
+        print_profile(profile);
+    }
+    free(profile);
+    return res;
+}
+
+/*
+ * Print the usage of the benchmark.
+ */
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-h] [-l] [-c] [-n replays] [-i interval] <trace>...\n"
+            "  -l           also replay every trace against the C library\n"
+            "  -c           check the heap after every request (slow)\n"
+            "  -n replays   replays measured for throughput (default 10)\n"
+            "  -i interval  requests between utilization samples\n",
+            name);
+}
+
+/* Main routine of the benchmark. */
+int main(int argc, char **argv)
+{
+    bool with_libc = false;
+    int repeats = 10;
+    long interval = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hlcn:i:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'l':
+            with_libc = true;
+            break;
+        case 'c':
+            check_heap = true;
+            break;
+        case 'n':
+            repeats = atoi(optarg);
+            break;
+        case 'i':
+            interval = atol(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind == argc || repeats <= 0 || interval < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    mem_init();
+    int res = 0;
+    for (int i = optind; i < argc; i++)
+    {
+        trace_t trace;
+        if (read_trace(argv[i], &trace))
+        {
+            res = 1;
+            continue;
+        }
+        if (bench_trace(&mm_allocator, argv[i], &trace, repeats, interval)
+            || (with_libc && bench_trace(&libc_allocator, argv[i], &trace,
+                                         repeats, interval)))
+        {
+            res = 1;
+        }
+        free(trace.requests);
+    }
+    return res;
+}
@@ -1,10 +1,40 @@
 /* 
  * The program works as a simple dynamic memory allocator, using 
- * 1. explicit free list, 
- * 2. first-fit, 
+ * 1. segregated explicit free lists, one per size class, 
+ * 2. best-fit within the first size class that can serve a request, 
  * 3. immediate coalescing, and
- * 4. add new free block to the end of the list.
- * It uses a circular doubly linked list to search for free blocks.
+ * 4. add new free block to the head of its class list.
+ * Sizes below 128 bytes get one class per 16 bytes, and larger sizes four
+ * classes per power of two. A bitmap of non-empty classes finds the first
+ * usable class in O(1).
+ *
+ * Only free blocks carry a footer: each header records whether the block
+ * before it is allocated, and whether it is a 16-byte mini block, which is
+ * too small for a footer and sits on a singly linked list of its own.
+ *
+ * It is thread-safe. The heap is split into arenas, each with its own lock,
+ * free lists and chunks of the sbrk heap; a thread allocates from the arena
+ * it was assigned first. Each thread also caches a few small freed blocks
+ * per size, so most small malloc and free calls take no lock, and a block
+ * freed by a thread of another arena is pushed onto a lock-free list that
+ * its owner frees in one batch the next time it takes its lock.
+ *
+ * Requests of up to 128 bytes are served from slabs: allocated blocks of
+ * an arena holding objects of a single size, taken from a stack of freed
+ * objects or bumped from the never used rest of the slab, so they skip the
+ * search, split and coalescing of the free lists.
+ *
+ * Requests above MMAP_THRESHOLD get a mapping of their own that goes back
+ * to the system on free, and the pages of a large free block ending a
+ * chunk are handed back too, so the resident heap shrinks after a peak.
+ *
+ * Statistics about the heap, its free lists and the searches of find_fit
+ * are kept in every build and read with mm_get_stats.
+ *
+ * With DEFERRED_COALESCING, freed blocks of 144 to 1024 bytes wait on quick
+ * lists of their exact size, still marked allocated, to be reused without
+ * splitting; they are coalesced in one batch when their list grows past
+ * QUICK_LIMIT or when no free block fits a request.
  * 
  * It supports functions as an allocator including: malloc, calloc, realloc,
  * and free. It also provides a heap checker to help the debugging process.
@@ -19,11 +49,16 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
 
 #include "malloc_simulator.h"
+#include "malloc_stats.h"
 #include "memlib.h"
 
 // #define DEBUG
+// #define DEFERRED_COALESCING
 
 #ifdef DEBUG
 /* When debugging is enabled, the underlying functions get called */
@@ -56,15 +91,41 @@
 
 #define ALIGNMENT 16
 
+/* Number of size classes, described with the size class constants below */
+#define NUM_CLASSES 60
+_Static_assert(NUM_CLASSES == MM_STATS_CLASSES, "stats need every class");
+/* Arenas, at most 255 as the index must fit in a header byte, where 0xFF
+ * marks mapped blocks */
+#define NUM_ARENAS 8
+#ifndef DRIVER
+/* Blocks above this size are mapped on their own; the driver requires
+ * every block to lie in its heap */
+#define MMAP_THRESHOLD (128 * 1024)
+/* Heap memory reads as zero when mem_sbrk first hands it out and after its
+ * pages are trimmed; the driver reuses its heap for every trace */
+#define HEAP_ZERO_FILLED
+#endif
+/* Per-thread cache: one bin per block size up to tcache_max_size, each
+ * holding at most TCACHE_COUNT blocks */
+#define TCACHE_BINS 8
+#define TCACHE_COUNT 16
+/* Slab object sizes, one per dsize up to slab_max_size */
+#define SLAB_CLASSES 8
+/* Quick lists of deferred blocks, one per dsize above slab_max_size up to
+ * quick_max_size, each coalesced once it holds more than QUICK_LIMIT */
+#define QUICK_LISTS 56
+#define QUICK_LIMIT 32
+
 typedef uint64_t word_t;
 
 struct block;
 
-/* previous free block and next free block pointers */
+/* next free block and previous free block pointers; next comes first, as
+ * a mini block only has room for it */
 typedef struct prev_next_ptrs
 {
-    struct block *prev;
     struct block *next;
+    struct block *prev;
 } prev_next_ptrs;
 
 /* block content union */
@@ -80,14 +141,97 @@ typedef struct block
     block_content content;
 } block_t;
 
+/* slab struct, at the payload of an allocated block, followed by the
+ * objects; an object has a header recording its offset from the slab block */
+typedef struct slab
+{
+    struct slab *next;                  // next slab of the size with room
+    struct slab *prev;
+    block_t *free_objects;              // stack of freed objects
+    char *bump;                         // first never used object
+    char *end;                          // end of the slab block
+    size_t object_size;
+    size_t used;                        // number of allocated objects
+} slab_t;
+
+/* arena struct: chunks of the heap with their own free lists and lock */
+typedef struct arena
+{
+    pthread_mutex_t lock;
+    block_t *free_lists[NUM_CLASSES];   // heads of class lists
+    slab_t *slabs[SLAB_CLASSES];        // slabs with room, per object size
+    block_t *quick_lists[QUICK_LISTS];  // deferred blocks, per exact size
+    int quick_counts[QUICK_LISTS];
+    uint64_t class_bitmap;              // bit c set if list c non-empty
+    int counter;                        // number of free blocks
+    block_t *epilogue;                  // epilogue of the newest chunk
+    block_t *released_block;            // free block ending a chunk whose
+    char *released;                     // pages from here on are handed back
+    _Atomic(block_t *) remote_frees;    // blocks freed by other arenas' threads
+    word_t index_bits;                  // arena index in header position
+    mm_stats_t stats;                   // this arena's share of the stats
+} arena_t;
+
+/* per-thread cache of small blocks, kept allocated, one stack per size */
+typedef struct tcache
+{
+    block_t *bins[TCACHE_BINS];
+    int counts[TCACHE_BINS];
+    arena_t *arena;                     // arena the thread allocates from
+    unsigned int generation;            // heap_generation it belongs to
+} tcache_t;
+
 /********************** PROTOTYPES **************************/
+static void *allocate(size_t size, bool *zeroed);
 static size_t get_payload_size(block_t *block);
-static block_t *extend_heap(size_t size);
-static block_t *coalesce(block_t *block);
-static block_t *find_fit(size_t asize);
-static void place(block_t *block, size_t asize);
-static void remove_from_list(block_t *target);
-static void add_to_list(block_t *new);
+static block_t *extend_heap(arena_t *arena, size_t size);
+static block_t *coalesce(arena_t *arena, block_t *block);
+static block_t *find_fit(arena_t *arena, size_t asize);
+static void count_search(arena_t *arena, size_t length, bool found);
+static void place(arena_t *arena, block_t *block, size_t asize);
+static void shrink_block(arena_t *arena, block_t *block, size_t asize,
+                         bool zeroed);
+static bool resize_block(arena_t *arena, block_t *block, size_t asize);
+static void remove_from_list(arena_t *arena, block_t *target);
+static void add_to_list(arena_t *arena, block_t *new);
+static int size_class(size_t size);
+
+static void init_arena(arena_t *arena, int index);
+static arena_t *get_arena(block_t *block);
+static tcache_t *get_tcache(void);
+static void create_tcache_key(void);
+static void flush_tcache(void *arg);
+static void release_block(arena_t *home, block_t *block);
+static void free_block(arena_t *arena, block_t *block);
+static void merge_block(arena_t *arena, block_t *block);
+static void push_remote_free(arena_t *owner, block_t *block);
+static void drain_remote_frees(arena_t *arena);
+
+static block_t *slab_alloc(arena_t *arena, size_t asize);
+static slab_t *create_slab(arena_t *arena, size_t asize);
+static void slab_free(arena_t *arena, block_t *block);
+static void link_slab(arena_t *arena, slab_t *slab);
+static void unlink_slab(arena_t *arena, slab_t *slab);
+static bool slab_full(slab_t *slab);
+static char *slab_first(slab_t *slab);
+static slab_t *get_slab(block_t *block);
+static bool is_slab_object(block_t *block);
+static size_t get_alloc_size(block_t *block);
+
+#ifdef MMAP_THRESHOLD
+static block_t *map_block(size_t asize);
+#endif
+static void unmap_block(block_t *block);
+static bool is_mapped(block_t *block);
+static void trim_block(arena_t *arena, block_t *block, char *released);
+
+static size_t class_min_size(int class);
+
+#ifdef DEFERRED_COALESCING
+static bool defer_block(arena_t *arena, block_t *block);
+static void flush_quick_list(arena_t *arena, int index);
+static bool flush_quick_lists(arena_t *arena);
+#endif
 
 static block_t *get_next_free(block_t *curr);
 static block_t *get_prev_free(block_t *curr);
@@ -98,6 +242,13 @@ static block_t *get_next_block(block_t *curr);
 static block_t *get_prev_block(block_t *curr);
 
 static void write_block(block_t *block, size_t size, bool is_allocated);
+static void write_epilogue(arena_t *arena, block_t *block);
+static void set_prev_status(block_t *block, bool prev_alloc, bool prev_mini);
+static bool get_prev_alloc(block_t *block);
+static bool get_prev_mini(block_t *block);
+static bool get_zeroed(block_t *block);
+static void set_zeroed(block_t *block, bool zeroed);
+static void clear_boundary(block_t *left, block_t *right);
 static void *header_to_payload(block_t *block);
 static block_t *payload_to_header(void *bp);
 static size_t extract_size(word_t word);
@@ -117,44 +268,88 @@ static bool aligned(const void *p);
 /* Global constants */
 static const size_t wsize = sizeof(word_t);     // word and header size (bytes)
 static const size_t dsize = 2 * wsize;          // double word size (bytes)
-static const size_t min_block_size = 2 * dsize; // Minimum block size
+static const size_t min_block_size = dsize;     // Minimum block size: mini
 static const size_t chunksize = (1 << 12);      // requires (chunksize%16==0)
 
+/* Size classes: one per dsize below small_limit, class 0 being the mini
+ * blocks, then class_splits classes per power of two up to max_class_size;
+ * larger blocks share the last one */
+static const size_t small_limit = 128;
+static const int small_limit_log = 7;           // log2(small_limit)
+static const int class_splits_log = 2;          // 4 classes per power of two
+static const size_t max_class_size = (1 << 20);
+static const size_t tcache_max_size = TCACHE_BINS * dsize;
+static const size_t slab_max_size = SLAB_CLASSES * dsize;
+static const size_t slab_size = (1 << 12);      // block size of a slab
+#ifdef DEFERRED_COALESCING
+static const size_t quick_max_size = (SLAB_CLASSES + QUICK_LISTS) * dsize;
+#endif
+static const size_t trim_threshold = (1 << 17); // trim free blocks this large
+static const size_t trim_pad = (1 << 16);       // but keep at least this
+                                                // much, or the bytes in use
+
 static const word_t alloc_mask = 0x1;         // one bit for the alloc flag
-static const word_t size_mask = ~(word_t)0xF; // all bits except last four
+static const word_t prev_alloc_mask = 0x2;    // previous block is allocated
+static const word_t prev_mini_mask = 0x4;     // previous block is a mini block
+static const word_t slab_mask = 0x8;          // slab object, size is offset
+static const word_t size_mask = 0x0000FFFFFFFFFFF0; // bits 4 to 47
+static const int arena_shift = 48;            // bits 48 to 55: arena index
+static const word_t arena_mask = (word_t)0xFF << 48;
+static const word_t mapped_bits = arena_mask;   // arena field of mapped blocks
+static const word_t zero_mask = (word_t)1 << 56; // free block payload is zero
 
 /* Global variables */
-static block_t *free_root = NULL;
-static word_t *prologue = NULL;
-static int counter_global = 0;
+static arena_t arenas[NUM_ARENAS];
+static atomic_bool heap_ready;                  // set once mm_init succeeded
+static atomic_uint heap_generation;             // bumped by every mm_init
+static atomic_uint next_arena;                  // round-robin arena choice
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t sbrk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;                // flushes caches at thread exit
+static __thread tcache_t tcache;
+static size_t page_size;
+static size_t sbrk_calls;                       // protected by sbrk_lock
+static atomic_size_t mapped_bytes;
+static atomic_size_t mapped_blocks;
+static atomic_size_t mmap_calls;
 
 
 /****************** ALLOCATOR METHODS ****************************************/
 /*
- * Initiate heap with prologue, root block for the free block list, and their
- * headers.
+ * Initiate heap with the prologue footer and epilogue header of the first
+ * chunk of arena 0, and arenas with empty free lists. It must not run while
+ * other threads are inside the allocator.
  */
 bool mm_init(void)
 {
     // Create the initial empty heap
-    word_t *start = (word_t *)(mem_sbrk(5 * wsize));
+    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
     if (start == (void *)-1)
         return false;
     
-    start[0] = pack(0, true); // Prologue
-    start[1] = pack(0, true); // Root header
-    start[4] = pack(0, true); // Root footer
-    // Heap starts with first "block header", currently the epilogue footer
-    prologue = (word_t *)&(start[0]);
-    free_root = (block_t *)&(start[1]);
-
-    // Initiate the circular doubly linked list
-    free_root->content.ptrs.prev = free_root;
-    free_root->content.ptrs.next = free_root;
+    start[0] = pack(0, true); // Prologue footer
+    start[1] = pack(0, true) | prev_alloc_mask; // Epilogue header
+    sbrk_calls = 1;
+    atomic_store(&mapped_bytes, 0);
+    atomic_store(&mapped_blocks, 0);
+    atomic_store(&mmap_calls, 0);
+
+    // Initiate arenas with empty class lists; they get chunks on demand
+    for (int i = 0; i < NUM_ARENAS; i++)
+    {
+        init_arena(&arenas[i], i);
+    }
+    arenas[0].epilogue = (block_t *)&(start[1]);
+    // Thread caches of an earlier heap are dropped on their next use
+    atomic_fetch_add(&heap_generation, 1);
+    atomic_store(&next_arena, 0);
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
 
     // Extend the empty heap with a free block of chunksize bytes
-    if (extend_heap(chunksize) == NULL)
+    if (extend_heap(&arenas[0], chunksize) == NULL)
         return false;
+    atomic_store(&heap_ready, true);
     return true;
 }
 
@@ -164,63 +359,49 @@ bool mm_init(void)
  */
 void *malloc(size_t size)
 {
-    dbg_printf(" malloc: required size %zu\n", size);
-    dbg_requires(mm_checkheap(__LINE__));
-    size_t asize;               // Adjusted block size
-    size_t extendsize;          // Amount to extend heap if no fit is found
-    block_t *block;
-    void *bp = NULL;
-
-    if (free_root == NULL)      // Initialize heap if it isn't initialized
-        mm_init();
-    if (size <= 0)              // Ignore spurious request
-        return bp;
-
-    // Adjust block size to include overhead and to meet alignment requirements
-    asize = round_up(size + dsize, dsize);
-    // Search the free list for a fit
-    dbg_printf(" malloc: find_fit start\n");
-    block = find_fit(asize);
-    dbg_printf(" malloc: find_fit end\n");
-
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL)
-    {
-        extendsize = max(asize, chunksize);
-        dbg_printf(" malloc: extend_heap start\n");
-        block = extend_heap(extendsize);
-        dbg_printf(" malloc: extend_heap end\n");
-        if (block == NULL)      // extend_heap returns an error
-            return bp;  
-    }
-
-    place(block, asize);
-    bp = header_to_payload(block);
-
-    dbg_ensures(mm_checkheap(__LINE__));
-    return bp;
+    return allocate(size, NULL);
 }
 
 /*
  * Free the block with the given pointer, which is assumed to be pointing to 
- * the payload of an allocated block. It will coalesce with its neighbors if
- * possible.
+ * the payload of an allocated block. A small block goes to the thread's
+ * cache if it has room; otherwise the block returns to its arena, where it
+ * will coalesce with its neighbors if possible.
  */
 void free(void *ptr)
 {
-    dbg_requires(ptr != NULL);
+    if (ptr == NULL)
+        return;
     block_t *block = payload_to_header(ptr);
-    size_t size = get_size(block);
+    if (is_mapped(block))
+    {
+        unmap_block(block);
+        return;
+    }
+    size_t size = get_alloc_size(block);
 
-    write_block(block, size, false); // renew alloc bit
-    dbg_requires(mm_checkheap(__LINE__));
-    coalesce(block);
+    tcache_t *tc = get_tcache();
+    if (size <= tcache_max_size)
+    {
+        int bin = size / dsize - 1;
+        if (tc->counts[bin] < TCACHE_COUNT)
+        {
+            set_next_free(block, tc->bins[bin]);
+            tc->bins[bin] = block;
+            tc->counts[bin]++;
+            return;
+        }
+    }
+    release_block(tc->arena, block);
 }
 
 /*
  * Reallocate the requested block whose payload is pointed by ptr, with a 
- * reasonable size: min{size, block_size}. It will copy the content to the 
- * new block within the size range. 
+ * reasonable size: min{size, block_size}. The block is resized in place if
+ * it shrinks, or if it can grow into a free successor or at the end of the
+ * heap; a slab object only stays if it is large enough, and a mapped block
+ * if it is still above the threshold. Otherwise it will
+ * copy the content to a new block within the size range. 
  */
 void *realloc(void *ptr, size_t size)
 {
@@ -241,6 +422,40 @@ void *realloc(void *ptr, size_t size)
         return malloc(size);
     }
 
+    // Try to resize in place, under the lock of the block's arena
+    if (size > size_mask - dsize)
+    {
+        return NULL;
+    }
+    size_t asize = round_up(size + wsize, dsize);
+    if (is_slab_object(block))
+    {
+        if (asize <= get_alloc_size(block))
+        {
+            return ptr;
+        }
+    }
+    else if (is_mapped(block))
+    {
+#ifdef MMAP_THRESHOLD
+        if (asize <= get_size(block) && asize > MMAP_THRESHOLD)
+        {
+            return ptr;
+        }
+#endif
+    }
+    else
+    {
+        arena_t *arena = get_arena(block);
+        pthread_mutex_lock(&arena->lock);
+        bool resized = resize_block(arena, block, asize);
+        pthread_mutex_unlock(&arena->lock);
+        if (resized)
+        {
+            return ptr;
+        }
+    }
+
     // Otherwise, proceed with reallocation
     newptr = malloc(size);
     // If malloc fails, the original block is left untouched
@@ -265,130 +480,285 @@ void *realloc(void *ptr, size_t size)
 
 /*
  * Allocates a block of memory for an array of num elements, each of them size 
- * bytes long, and initializes all its bits to zero.
+ * bytes long, and initializes all its bits to zero. Fresh heap memory and
+ * mappings are known to be zero and are not cleared again.
  */
 void *calloc(size_t elements, size_t size)
 {
     void *bp;
+    bool zeroed;
     size_t asize = elements * size;
 
-    if (asize / elements != size)
+    if (elements != 0 && asize / elements != size)
     {
         // Multiplication overflowed
         return NULL;
     }
 
-    bp = malloc(asize);
+    bp = allocate(asize, &zeroed);
     if (bp == NULL)
     {
         return NULL;
     }
-    // Initialize all bits to 0
-    memset(bp, 0, asize);
+    // Initialize all bits to 0, unless the memory was never used
+    if (!zeroed)
+    {
+        memset(bp, 0, asize);
+    }
 
     return bp;
 }
 
 
 /****************** STATIC METHODS *******************************************/
+/*
+ * Allocate a block for malloc and calloc, see malloc. If zeroed is not
+ * NULL, it is set to whether the whole payload is known to be zero.
+ */
+static void *allocate(size_t size, bool *zeroed)
+{
+    dbg_printf(" malloc: required size %zu\n", size);
+    dbg_requires(mm_checkheap(__LINE__));
+    size_t asize;               // Adjusted block size
+    size_t extendsize;          // Amount to extend heap if no fit is found
+    block_t *block;
+    void *bp = NULL;
+
+    if (zeroed != NULL)
+        *zeroed = false;
+
+    if (!atomic_load(&heap_ready))  // Initialize heap if it isn't initialized
+    {
+        pthread_mutex_lock(&init_lock);
+        if (!atomic_load(&heap_ready))
+            mm_init();
+        pthread_mutex_unlock(&init_lock);
+        if (!atomic_load(&heap_ready))
+            return bp;
+    }
+    if (size <= 0 || size > size_mask - dsize)  // Ignore spurious request
+        return bp;
+
+    // Adjust block size to include overhead and to meet alignment requirements
+    // (allocated blocks carry no footer)
+    asize = round_up(size + wsize, dsize);
+#ifdef MMAP_THRESHOLD
+    if (asize > MMAP_THRESHOLD)
+    {
+        block = map_block(asize);
+        if (block == NULL)
+            return bp;
+        if (zeroed != NULL)     // A new mapping reads as zero
+            *zeroed = true;
+        return header_to_payload(block);
+    }
+#endif
+
+    // Serve small requests from the thread's cache without locking
+    tcache_t *tc = get_tcache();
+    if (asize <= tcache_max_size)
+    {
+        int bin = asize / dsize - 1;
+        if (tc->bins[bin] != NULL)
+        {
+            block = tc->bins[bin];
+            tc->bins[bin] = get_next_free(block);
+            tc->counts[bin]--;
+            return header_to_payload(block);
+        }
+    }
+
+    arena_t *arena = tc->arena;
+    pthread_mutex_lock(&arena->lock);
+    drain_remote_frees(arena);
+    // Other small requests take an object of a slab
+    if (asize <= slab_max_size)
+    {
+        block = slab_alloc(arena, asize);
+        pthread_mutex_unlock(&arena->lock);
+        return block == NULL ? bp : header_to_payload(block);
+    }
+#ifdef DEFERRED_COALESCING
+    // A deferred block of the exact size needs no split
+    if (asize <= quick_max_size)
+    {
+        int index = (asize - slab_max_size) / dsize - 1;
+        block = arena->quick_lists[index];
+        if (block != NULL)
+        {
+            arena->quick_lists[index] = get_next_free(block);
+            arena->quick_counts[index]--;
+            arena->stats.deferred_bytes -= asize;
+            arena->stats.deferred_blocks--;
+            arena->stats.in_use_bytes += asize;
+            pthread_mutex_unlock(&arena->lock);
+            return header_to_payload(block);
+        }
+    }
+#endif
+    // Search the free list for a fit
+    dbg_printf(" malloc: find_fit start\n");
+    block = find_fit(arena, asize);
+    dbg_printf(" malloc: find_fit end\n");
+#ifdef DEFERRED_COALESCING
+    // Coalescing the deferred blocks may make room before the heap grows
+    if (block == NULL && flush_quick_lists(arena))
+        block = find_fit(arena, asize);
+#endif
+
+    // If no fit is found, request more memory, and then and place the block
+    if (block == NULL)
+    {
+        extendsize = max(asize, chunksize);
+        dbg_printf(" malloc: extend_heap start\n");
+        block = extend_heap(arena, extendsize);
+        dbg_printf(" malloc: extend_heap end\n");
+        if (block == NULL)      // extend_heap returns an error
+        {
+            pthread_mutex_unlock(&arena->lock);
+            return bp;  
+        }
+    }
+
+    bool block_zeroed = get_zeroed(block);
+    place(arena, block, asize);
+    pthread_mutex_unlock(&arena->lock);
+    bp = header_to_payload(block);
+    if (zeroed != NULL && block_zeroed)
+    {
+        // Clear the words the free lists used: the links and, unless it
+        // went to the split-off rest, the footer
+        memset(bp, 0, dsize);
+        *(word_t *)((char *)block + get_size(block) - wsize) = 0;
+        *zeroed = true;
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return bp;
+}
+
 /*
  * Get the size of payload of the given block 
  */
 static size_t get_payload_size(block_t *block)
 {
-    size_t asize = get_size(block);
-    return asize - dsize;
+    size_t asize = get_alloc_size(block);
+    return asize - wsize;
 }
 
 /*
- * Extend heap with the requested size. 
+ * Extend the arena with a free block of the requested size. If the arena's
+ * newest chunk ends the heap, its epilogue becomes the header of the new
+ * block, which is coalesced with a free block before it; otherwise another
+ * arena grew the heap since, and the block starts a new chunk of its own.
+ * The caller holds the arena's lock.
  */
-static block_t *extend_heap(size_t size)
+static block_t *extend_heap(arena_t *arena, size_t size)
 {
     void *bp;
 
     // Allocate an even number of words to maintain alignment
     size = round_up(size, dsize);
-    if ((bp = mem_sbrk(size)) == (void *)-1)
+    pthread_mutex_lock(&sbrk_lock);
+    bool adjacent = arena->epilogue != NULL
+                    && (char *)arena->epilogue + wsize
+                       == (char *)mem_heap_hi() + 1;
+    // A new chunk also needs its prologue footer and epilogue header
+    bp = mem_sbrk(adjacent ? size : size + dsize);
+    sbrk_calls++;
+    pthread_mutex_unlock(&sbrk_lock);
+    if (bp == (void *)-1)
         return NULL;
     dbg_printf("extend heap: entering\n");        
-    block_t *new_block = (block_t *) bp;
+    block_t *new_block;
+    if (adjacent)
+    {
+        // The old epilogue keeps the status of the block before new_block
+        new_block = payload_to_header(bp);
+    }
+    else
+    {
+        word_t *start = (word_t *)bp;
+        start[0] = pack(0, true); // Prologue footer
+        new_block = (block_t *)&(start[1]);
+        new_block->header = prev_alloc_mask | arena->index_bits;
+    }
     
+    arena->epilogue = (block_t *)((char *)new_block + size);
+    write_epilogue(arena, arena->epilogue);
     write_block(new_block, size, false);
+#ifdef HEAP_ZERO_FILLED
+    set_zeroed(new_block, true);
+#endif
     dbg_printf("************* ex_heap() write_block: finish\n");
     
-    add_to_list(new_block);
-    dbg_printf("add_to_list() end\n");
-    dbg_requires(mm_checkheap(__LINE__));
-    return new_block;
+    return coalesce(arena, new_block);
 }
 
 /*
  * Coalesce neighborhood blocks, physically.
  */
-static block_t *coalesce(block_t *block)
+static block_t *coalesce(arena_t *arena, block_t *block)
 {
-    bool prev_alloc, next_alloc;
-
     dbg_printf("coal() start\n");
     block_t *next_block = get_next_block(block);
-    block_t *prev_block = get_prev_block(block);
     dbg_printf("Coalesce: next pointer: %p\n", next_block);
-    dbg_printf("Coalesce: pre pointer: %p\n", prev_block);
-
-    // Check address validation - whether in heap
-    if(in_heap(prev_block) && prev_block != NULL)
-    {
-        prev_alloc = extract_alloc(*(find_prev_footer(block)));
-    }
-    else
-    {
-        prev_alloc = true;
-    }
 
-    if(in_heap(next_block) && next_block != NULL)
-    {
-        next_alloc = get_alloc(next_block);
-    }
-    else
-    {
-        next_alloc = true;
-    }
+    // The prologue and epilogue are allocated, so both neighbors exist
+    bool prev_alloc = get_prev_alloc(block);
+    bool next_alloc = get_alloc(next_block);
+    // Only a free block can be located from its successor
+    block_t *prev_block = prev_alloc ? NULL : get_prev_block(block);
     
     // Coalesce cases - depending on the prev and next 
     // block's allocation status
     size_t size = get_size(block);    
-    dbg_requires(mm_checkheap(__LINE__));
+    // The result is zero if every part is, once their boundaries are cleared
+    bool zeroed = get_zeroed(block)
+                  && (prev_alloc || get_zeroed(prev_block))
+                  && (next_alloc || get_zeroed(next_block));
 
     if (prev_alloc && next_alloc) // Case 1
     {        
-        add_to_list(block);
+        add_to_list(arena, block);
         return block;
     }
     else if (prev_alloc && !next_alloc) // Case 2
     {        
-        remove_from_list(next_block);
+        remove_from_list(arena, next_block);
         size += get_size(next_block);
+        if (zeroed)
+            clear_boundary(block, next_block);
         write_block(block, size, false);
-        add_to_list(block);
+        set_zeroed(block, zeroed);
+        add_to_list(arena, block);
     }
     else if (!prev_alloc && next_alloc) // Case 3
     {        
-        remove_from_list(prev_block);
+        remove_from_list(arena, prev_block);
         size += get_size(prev_block);
+        if (zeroed)
+            clear_boundary(prev_block, block);
         write_block(prev_block, size, false);
+        set_zeroed(prev_block, zeroed);
         block = prev_block;
-        add_to_list(block);
+        add_to_list(arena, block);
     }
     else // Case 4
     {        
-        remove_from_list(prev_block);
-        remove_from_list(next_block);
+        remove_from_list(arena, prev_block);
+        remove_from_list(arena, next_block);
         size += get_size(next_block) + get_size(prev_block);
+        if (zeroed)
+        {
+            clear_boundary(block, next_block);
+            clear_boundary(prev_block, block);
+        }
         write_block(prev_block, size, false);        
+        set_zeroed(prev_block, zeroed);
 
         block = prev_block;
-        add_to_list(block);
+        add_to_list(arena, block);
     }
 
     dbg_requires(mm_checkheap(__LINE__));
@@ -396,134 +766,797 @@ static block_t *coalesce(block_t *block)
 }
 
 /*
- * Find a fit block in the free block list with a given size asize.
+ * Find a fit block in the free lists with a given size asize: the best fit
+ * in asize's class, or else the best fit in the next non-empty class, where
+ * every block is large enough.
  * Return the pointer to this fit block or NULL if not found.
  */
-static block_t *find_fit(size_t asize)
+static block_t *find_fit(arena_t *arena, size_t asize)
 {
     dbg_requires(mm_checkheap(__LINE__));
-    block_t *block;
+    int class = size_class(asize);
+    uint64_t candidates = arena->class_bitmap & (~(uint64_t)0 << class);
+    size_t length = 0;          // blocks examined
 
-    for (block = get_next_free(free_root); get_size(block) > 0;
-         block = get_next_free(block))
+    while (candidates != 0)
     {
-        dbg_printf("block: %p\n", block);
-        size_t size = get_size(block);
-        if (asize <= size)
-            return block;
+        class = __builtin_ctzll(candidates);
+        block_t *best = NULL;
+        for (block_t *block = arena->free_lists[class]; block != NULL;
+             block = get_next_free(block))
+        {
+            dbg_printf("block: %p\n", block);
+            length++;
+            size_t size = get_size(block);
+            if (asize <= size && (best == NULL || size < get_size(best)))
+            {
+                best = block;
+                if (size == asize)      // Cannot do better than exact
+                    break;
+            }
+        }
+        if (best != NULL)
+        {
+            count_search(arena, length, true);
+            return best;
+        }
+        // Only asize's own class may hold blocks that are too small
+        candidates &= candidates - 1;
     }
+    count_search(arena, length, false);
     return NULL;
 }
 
+/*
+ * Count a search of find_fit that examined length blocks in the arena's
+ * histogram of search lengths.
+ */
+static void count_search(arena_t *arena, size_t length, bool found)
+{
+    int bucket = length == 0 ? 0 : 64 - __builtin_clzll(length);
+    if (bucket >= MM_STATS_SEARCH_BUCKETS)
+        bucket = MM_STATS_SEARCH_BUCKETS - 1;
+    arena->stats.search_lengths[bucket]++;
+    arena->stats.fit_searches++;
+    if (!found)
+        arena->stats.fit_misses++;
+}
+
 /*
  * Place block as allocated with the requested block and asize.
  */
-static void place(block_t *block, size_t asize)
+static void place(arena_t *arena, block_t *block, size_t asize)
 {
+    bool zeroed = get_zeroed(block);
+    char *released = block == arena->released_block ? arena->released : NULL;
     size_t block_size = get_size(block);
-    if ((block_size - asize) >= min_block_size)
+    remove_from_list(arena, block);
+    write_block(block, get_size(block), true); // renew alloc bit
+    arena->stats.in_use_bytes += block_size;
+    // the remining part is a new free block, as zero as the block was
+    shrink_block(arena, block, asize, zeroed);
+    if (released != NULL && get_size(block) < block_size)
     {
-        remove_from_list(block);
-        write_block(block, asize, true); // renew the block size and alloc bit
-        
-        // the remining part is a new free block
-        block_t *new_block;
-        new_block = get_next_block(block);
-        if(new_block == NULL)
-        {
-            return;
-        }
-        write_block(new_block, block_size - asize, false);
-        add_to_list(new_block);
+        // The rest keeps the handed back pages the block did not take
+        block_t *rest = get_next_block(block);
+        char *links = (char *)round_up((size_t)(rest + 1) + dsize, page_size);
+        arena->released_block = rest;
+        arena->released = released > links ? released : links;
     }
-    else
+    dbg_requires(mm_checkheap(__LINE__));
+}
+
+/*
+ * Shrink an allocated block to asize, splitting the rest off as a free
+ * block of the same arena if it is large enough for one, recording whether
+ * its payload is zero. The new free block is coalesced with a free
+ * successor. The whole block must be counted in use, and the part split
+ * off is no longer.
+ */
+static void shrink_block(arena_t *arena, block_t *block, size_t asize,
+                         bool zeroed)
+{
+    size_t block_size = get_size(block);
+    if ((block_size - asize) < min_block_size)
     {
-        remove_from_list(block);
-        write_block(block, block_size, true); // renew alloc bit
-        
+        return;
     }
-    dbg_requires(mm_checkheap(__LINE__));
+    write_block(block, asize, true); // renew the block size
+    
+    block_t *new_block = get_next_block(block);
+    new_block->header = block->header & arena_mask;
+    set_prev_status(new_block, true, asize == min_block_size);
+    write_block(new_block, block_size - asize, false);
+    set_zeroed(new_block, zeroed);
+    arena->stats.in_use_bytes -= block_size - asize;
+    coalesce(arena, new_block);
+}
+
+/*
+ * Resize an allocated block to asize without moving it: shrink it unless
+ * it shrinks to less than a quarter and fits in a free block, absorb
+ * a free successor, or extend the heap first when the block, perhaps
+ * followed by a free block, ends the arena's newest chunk and no free
+ * block could take it. The bytes in use follow the block's size.
+ * Return true if resized, false if the block has to move.
+ */
+static bool resize_block(arena_t *arena, block_t *block, size_t asize)
+{
+    size_t block_size = get_size(block);
+    if (asize <= block_size)
+    {
+        // A small remnant would pin a large region; when it fits elsewhere,
+        // moving only copies the few bytes that are left
+        if (asize < block_size / 4 && find_fit(arena, asize) != NULL)
+            return false;
+        shrink_block(arena, block, asize, false);
+        return true;
+    }
+
+    block_t *next = get_next_block(block);
+    size_t next_free = get_alloc(next) ? 0 : get_size(next);
+    block_t *last = get_alloc(next) ? next : get_next_block(next);
+    // Only extend when moving would have to extend the heap anyway
+    if (last == arena->epilogue && block_size + next_free < asize
+        && find_fit(arena, asize) == NULL)
+    {
+        // The new space coalesces with a free successor, or becomes one
+        size_t extendsize = max(asize - block_size - next_free, chunksize);
+        if (extend_heap(arena, extendsize) == NULL)
+            return false;
+        next = get_next_block(block);
+    }
+
+    if (!get_alloc(next) && block_size + get_size(next) >= asize)
+    {
+        size_t next_size = get_size(next);
+        remove_from_list(arena, next);
+        write_block(block, block_size + next_size, true);
+        arena->stats.in_use_bytes += next_size;
+        shrink_block(arena, block, asize, false);
+        return true;
+    }
+    return false;
 }
 
 /*
- * Remove the target block from the free block list.
+ * Remove the target block from the arena's free list of its size class.
  */
-static void remove_from_list(block_t *target)
+static void remove_from_list(arena_t *arena, block_t *target)
 {    
-    dbg_requires(mm_checkheap(__LINE__));        
     dbg_printf("remove %p\n", target);            
+    if (target == arena->released_block)
+        arena->released_block = NULL;
 
-    block_t *tmp_prev = target->content.ptrs.prev;            
-    block_t *tmp_next = target->content.ptrs.next;
-    tmp_prev->content.ptrs.next = tmp_next;
-    tmp_next->content.ptrs.prev = tmp_prev; 
+    int class = size_class(get_size(target));
+    if (class == 0)
+    {
+        // Mini blocks only link forward, so find the predecessor
+        block_t **link = &arena->free_lists[0];
+        while (*link != target)
+        {
+            link = &((*link)->content.ptrs.next);
+        }
+        *link = get_next_free(target);
+        if (arena->free_lists[0] == NULL)
+            arena->class_bitmap &= ~(uint64_t)1;
+        arena->counter--;
+        arena->stats.class_free_bytes[0] -= min_block_size;
+        arena->stats.class_free_blocks[0]--;
+        return;
+    }
+    block_t *tmp_prev = get_prev_free(target);
+    block_t *tmp_next = get_next_free(target);
+    if (tmp_prev != NULL)
+    {
+        set_next_free(tmp_prev, tmp_next);
+    }
+    else
+    {
+        arena->free_lists[class] = tmp_next;
+        if (tmp_next == NULL)   // The class became empty
+            arena->class_bitmap &= ~((uint64_t)1 << class);
+    }
+    if (tmp_next != NULL)
+    {
+        set_prev_free(tmp_next, tmp_prev);
+    }
     
-    counter_global--;
-
-    dbg_requires(mm_checkheap(__LINE__));    
+    arena->counter--;
+    arena->stats.class_free_bytes[class] -= get_size(target);
+    arena->stats.class_free_blocks[class]--;
     return;
 }
 
 /*
- * Add the given block new to the free block list.
+ * Add the given block new to the head of the arena's free list of its size
+ * class.
  */
-static void add_to_list(block_t *new)
+static void add_to_list(arena_t *arena, block_t *new)
 {
     dbg_printf("add free %p\n", new);
 
-    block_t *old_tail = free_root->content.ptrs.prev;    
-    old_tail->content.ptrs.next = new;
-    new->content.ptrs.next = free_root;
-
-    free_root->content.ptrs.prev = new;
-    new->content.ptrs.prev = old_tail;
+    int class = size_class(get_size(new));
+    block_t *old_head = arena->free_lists[class];
+    set_next_free(new, old_head);
+    // A mini block has no room for a prev pointer
+    if (class != 0)
+    {
+        set_prev_free(new, NULL);
+        if (old_head != NULL)
+        {
+            set_prev_free(old_head, new);
+        }
+    }
+    arena->free_lists[class] = new;
+    arena->class_bitmap |= (uint64_t)1 << class;
 
-    counter_global++;
-    dbg_requires(mm_checkheap(__LINE__));
+    arena->counter++;
+    arena->stats.class_free_bytes[class] += get_size(new);
+    arena->stats.class_free_blocks[class]++;
 }
 
-/****************** STATIC HELPER METHODS ************************************/
-/************ LIST OPERATIONS ************/
-
 /*
- * Get the next free block of curr in the free block list.
+ * Return the size class of a block size: (size / dsize) classes below
+ * small_limit, then class_splits classes per power of two.
  */
-static block_t *get_next_free(block_t *curr)
+static int size_class(size_t size)
 {
-    return curr->content.ptrs.next;
+    if (size < small_limit)
+    {
+        return (int)((size - min_block_size) / dsize);
+    }
+    if (size >= max_class_size)
+    {
+        return NUM_CLASSES - 1;
+    }
+    int small_classes = (int)((small_limit - min_block_size) / dsize);
+    int log = 63 - __builtin_clzll(size);
+    // the two bits below the leading one pick the class within the power
+    int split = (int)(size >> (log - class_splits_log))
+                & ((1 << class_splits_log) - 1);
+    return small_classes + ((log - small_limit_log) << class_splits_log) + split;
 }
 
 /*
- * Get the previous free block of curr in the list.
+ * Return the smallest block size of a size class, inverting size_class.
  */
-static block_t *get_prev_free(block_t *curr)
+static size_t class_min_size(int class)
 {
-    return curr->content.ptrs.prev;
+    int small_classes = (int)((small_limit - min_block_size) / dsize);
+    if (class < small_classes)
+    {
+        return min_block_size + class * dsize;
+    }
+    int log = small_limit_log + ((class - small_classes) >> class_splits_log);
+    size_t split = (class - small_classes) & ((1 << class_splits_log) - 1);
+    return ((size_t)1 << log) + (split << (log - class_splits_log));
 }
 
-/************ HEAP OPERATIONS ************/
+/************ ARENA AND THREAD CACHE OPERATIONS ************/
+
 /*
- * Get the block physically next to the curr block.
+ * Initiate the given arena with empty free lists and no chunk.
  */
-static block_t *get_next_block(block_t *curr)
+static void init_arena(arena_t *arena, int index)
 {
-    dbg_requires(curr != NULL);    
-    block_t *next_block = (block_t *)(((char *)curr) + get_size(curr));
-    return next_block;    
+    pthread_mutex_init(&arena->lock, NULL);
+    for (int i = 0; i < NUM_CLASSES; i++)
+    {
+        arena->free_lists[i] = NULL;
+    }
+    for (int i = 0; i < SLAB_CLASSES; i++)
+    {
+        arena->slabs[i] = NULL;
+    }
+    for (int i = 0; i < QUICK_LISTS; i++)
+    {
+        arena->quick_lists[i] = NULL;
+        arena->quick_counts[i] = 0;
+    }
+    arena->class_bitmap = 0;
+    arena->counter = 0;
+    arena->epilogue = NULL;
+    arena->released_block = NULL;
+    atomic_init(&arena->remote_frees, NULL);
+    arena->index_bits = (word_t)index << arena_shift;
+    memset(&arena->stats, 0, sizeof(mm_stats_t));
 }
 
 /*
- * Get the block physically ahead of the curr block.
+ * Return the arena owning the given block, as recorded in its header.
  */
-static block_t *get_prev_block(block_t *curr)
+static arena_t *get_arena(block_t *block)
 {
-    dbg_requires(curr != NULL);
-    word_t *footerp = find_prev_footer(curr);
-    size_t size = extract_size(*footerp);
-    return (block_t *)((char *)curr - size);
+    return &arenas[(block->header & arena_mask) >> arena_shift];
 }
 
-/************ BLOCK OPERATIONS ************/
+/*
+ * Return the calling thread's cache, setting it up with the next arena in
+ * turn on first use and after mm_init dropped the blocks it held.
+ */
+static tcache_t *get_tcache(void)
+{
+    unsigned int generation = atomic_load(&heap_generation);
+    if (tcache.generation != generation)
+    {
+        for (int i = 0; i < TCACHE_BINS; i++)
+        {
+            tcache.bins[i] = NULL;
+            tcache.counts[i] = 0;
+        }
+        tcache.arena = &arenas[atomic_fetch_add(&next_arena, 1) % NUM_ARENAS];
+        tcache.generation = generation;
+        // Have the cache flushed when the thread exits
+        pthread_once(&tcache_key_once, create_tcache_key);
+        pthread_setspecific(tcache_key, &tcache);
+    }
+    return &tcache;
+}
+
+/*
+ * Create the key whose destructor flushes a thread's cache.
+ */
+static void create_tcache_key(void)
+{
+    pthread_key_create(&tcache_key, flush_tcache);
+}
+
+/*
+ * Return the blocks of an exiting thread's cache to their arenas.
+ */
+static void flush_tcache(void *arg)
+{
+    tcache_t *tc = (tcache_t *)arg;
+    if (tc->generation != atomic_load(&heap_generation))
+        return;
+    for (int i = 0; i < TCACHE_BINS; i++)
+    {
+        while (tc->bins[i] != NULL)
+        {
+            block_t *block = tc->bins[i];
+            tc->bins[i] = get_next_free(block);
+            release_block(tc->arena, block);
+        }
+        tc->counts[i] = 0;
+    }
+}
+
+/*
+ * Return an allocated block to its arena: directly if it is the calling
+ * thread's arena home, otherwise through the owner's remote free list.
+ */
+static void release_block(arena_t *home, block_t *block)
+{
+    arena_t *owner = get_arena(block);
+    if (owner != home)
+    {
+        push_remote_free(owner, block);
+        return;
+    }
+    pthread_mutex_lock(&owner->lock);
+    drain_remote_frees(owner);
+    free_block(owner, block);
+    pthread_mutex_unlock(&owner->lock);
+}
+
+/*
+ * Return a block to the arena: a slab object to its slab, other blocks to
+ * the free lists, or to a quick list when coalescing is deferred.
+ * The caller holds the arena's lock.
+ */
+static void free_block(arena_t *arena, block_t *block)
+{
+    if (is_slab_object(block))
+    {
+        slab_free(arena, block);
+        return;
+    }
+    arena->stats.in_use_bytes -= get_size(block);
+#ifdef DEFERRED_COALESCING
+    if (defer_block(arena, block))
+        return;
+#endif
+    merge_block(arena, block);
+}
+
+/*
+ * Mark the block free and coalesce it, trimming it if it became a large
+ * block at the end of a chunk. The caller holds the arena's lock.
+ */
+static void merge_block(arena_t *arena, block_t *block)
+{
+    write_block(block, get_size(block), false); // renew alloc bit
+    // The pages a trimmed successor handed back stay so once merged
+    block_t *next_block = get_next_block(block);
+    char *released = next_block == arena->released_block
+                     ? arena->released : NULL;
+    block = coalesce(arena, block);
+    if (get_size(block) >= trim_threshold
+        && get_size(get_next_block(block)) == 0)
+    {
+        trim_block(arena, block, released);
+    }
+}
+
+/*
+ * Push a still allocated block onto its owner's remote free list, linking
+ * it through its payload, without taking the owner's lock.
+ */
+static void push_remote_free(arena_t *owner, block_t *block)
+{
+    block_t *head = atomic_load(&owner->remote_frees);
+    do
+    {
+        set_next_free(block, head);
+    } while (!atomic_compare_exchange_weak(&owner->remote_frees, &head, block));
+}
+
+/*
+ * Free every block other threads pushed onto the arena's remote free list.
+ * The caller holds the arena's lock.
+ */
+static void drain_remote_frees(arena_t *arena)
+{
+    // Taking the whole list at once leaves nothing for a push to race with
+    block_t *block = atomic_exchange(&arena->remote_frees, NULL);
+    while (block != NULL)
+    {
+        block_t *next = get_next_free(block);
+        free_block(arena, block);
+        block = next;
+    }
+}
+
+#ifdef DEFERRED_COALESCING
+/*
+ * Put a block above slab_max_size and up to quick_max_size on the quick
+ * list of its size, still marked allocated so that no neighbor coalesces
+ * with it, and coalesce the whole list once it passes QUICK_LIMIT.
+ * Return true if the block was deferred, false if its size has no list.
+ */
+static bool defer_block(arena_t *arena, block_t *block)
+{
+    size_t size = get_size(block);
+    // Smaller blocks are left by shrinking ones, rarely reused as such
+    if (size <= slab_max_size || size > quick_max_size)
+        return false;
+    int index = (size - slab_max_size) / dsize - 1;
+    set_next_free(block, arena->quick_lists[index]);
+    arena->quick_lists[index] = block;
+    arena->stats.deferred_bytes += size;
+    arena->stats.deferred_blocks++;
+    if (++arena->quick_counts[index] > QUICK_LIMIT)
+        flush_quick_list(arena, index);
+    return true;
+}
+
+/*
+ * Coalesce every block of the given quick list into the free lists.
+ */
+static void flush_quick_list(arena_t *arena, int index)
+{
+    block_t *block = arena->quick_lists[index];
+    arena->quick_lists[index] = NULL;
+    arena->quick_counts[index] = 0;
+    while (block != NULL)
+    {
+        block_t *next = get_next_free(block);
+        arena->stats.deferred_bytes -= get_size(block);
+        arena->stats.deferred_blocks--;
+        merge_block(arena, block);
+        block = next;
+    }
+}
+
+/*
+ * Coalesce the blocks of every quick list of the arena.
+ * Return true if there were any.
+ */
+static bool flush_quick_lists(arena_t *arena)
+{
+    if (arena->stats.deferred_blocks == 0)
+        return false;
+    for (int index = 0; index < QUICK_LISTS; index++)
+    {
+        flush_quick_list(arena, index);
+    }
+    return true;
+}
+#endif /* DEFERRED_COALESCING */
+
+/************ SLAB OPERATIONS ************/
+
+/*
+ * Take an object of block size asize from the arena's first slab of that
+ * size with room, creating a slab if there is none. The caller holds the
+ * arena's lock.
+ * Return the object, or NULL if the heap cannot grow.
+ */
+static block_t *slab_alloc(arena_t *arena, size_t asize)
+{
+    slab_t *slab = arena->slabs[asize / dsize - 1];
+    if (slab == NULL && (slab = create_slab(arena, asize)) == NULL)
+        return NULL;
+
+    block_t *block = slab->free_objects;
+    if (block != NULL)
+    {
+        // A freed object kept its header
+        slab->free_objects = get_next_free(block);
+    }
+    else
+    {
+        block = (block_t *)slab->bump;
+        slab->bump += asize;
+        size_t offset = (char *)block - (char *)payload_to_header(slab);
+        block->header = pack(offset, true) | slab_mask | arena->index_bits;
+    }
+    slab->used++;
+    if (slab_full(slab))
+        unlink_slab(arena, slab);
+    return block;
+}
+
+/*
+ * Carve a slab for objects of block size asize out of the arena's heap,
+ * and link it as the first one of its size.
+ * Return the slab, or NULL if the heap cannot grow.
+ */
+static slab_t *create_slab(arena_t *arena, size_t asize)
+{
+    block_t *block = find_fit(arena, slab_size);
+#ifdef DEFERRED_COALESCING
+    if (block == NULL && flush_quick_lists(arena))
+        block = find_fit(arena, slab_size);
+#endif
+    if (block == NULL)
+    {
+        block = extend_heap(arena, max(slab_size, chunksize));
+        if (block == NULL)
+            return NULL;
+    }
+    place(arena, block, slab_size);
+
+    slab_t *slab = (slab_t *)header_to_payload(block);
+    slab->free_objects = NULL;
+    slab->bump = slab_first(slab);
+    slab->end = (char *)block + get_size(block);
+    slab->object_size = asize;
+    slab->used = 0;
+    link_slab(arena, slab);
+    return slab;
+}
+
+/*
+ * Push an object back onto the stack of its slab, which regains room. An
+ * empty slab goes back to the arena as a free block, unless it is the only
+ * one of its size. The caller holds the arena's lock.
+ */
+static void slab_free(arena_t *arena, block_t *block)
+{
+    slab_t *slab = get_slab(block);
+    if (slab_full(slab))
+        link_slab(arena, slab);
+    set_next_free(block, slab->free_objects);
+    slab->free_objects = block;
+    slab->used--;
+
+    int index = slab->object_size / dsize - 1;
+    if (slab->used == 0 && (arena->slabs[index] != slab || slab->next != NULL))
+    {
+        unlink_slab(arena, slab);
+        free_block(arena, payload_to_header(slab));
+    }
+}
+
+/*
+ * Add the slab to the head of the arena's list of slabs with room.
+ */
+static void link_slab(arena_t *arena, slab_t *slab)
+{
+    slab_t **head = &arena->slabs[slab->object_size / dsize - 1];
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head != NULL)
+        (*head)->prev = slab;
+    *head = slab;
+}
+
+/*
+ * Remove the slab from the arena's list of slabs with room.
+ */
+static void unlink_slab(arena_t *arena, slab_t *slab)
+{
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        arena->slabs[slab->object_size / dsize - 1] = slab->next;
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+}
+
+/*
+ * Return whether the slab has neither a freed nor a never used object.
+ */
+static bool slab_full(slab_t *slab)
+{
+    return slab->free_objects == NULL
+           && slab->bump + slab->object_size > slab->end;
+}
+
+/*
+ * Return the first object of the slab, whose header lies one word before
+ * an aligned payload.
+ */
+static char *slab_first(slab_t *slab)
+{
+    return (char *)slab + round_up(sizeof(slab_t) + wsize, dsize) - wsize;
+}
+
+/*
+ * Return the slab of the given slab object.
+ */
+static slab_t *get_slab(block_t *block)
+{
+    return (slab_t *)header_to_payload(
+        (block_t *)((char *)block - get_size(block)));
+}
+
+/*
+ * Return whether the given allocated block is an object of a slab.
+ */
+static bool is_slab_object(block_t *block)
+{
+    return (bool)(block->header & slab_mask);
+}
+
+/*
+ * Return the block size of the given allocated block, which for a slab
+ * object is the object size of its slab.
+ */
+static size_t get_alloc_size(block_t *block)
+{
+    return is_slab_object(block) ? get_slab(block)->object_size
+                                 : get_size(block);
+}
+
+/************ MAPPED BLOCK OPERATIONS ************/
+
+#ifdef MMAP_THRESHOLD
+/*
+ * Map an allocated block of at least asize bytes outside the heap. The
+ * mapping starts one word before the block so the payload is aligned, and
+ * the block size covers the mapping but that word and one more.
+ * Return the block, or NULL if the mapping fails.
+ */
+static block_t *map_block(size_t asize)
+{
+    size_t length = round_up(asize + dsize, page_size);
+    void *start = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == MAP_FAILED)
+        return NULL;
+    block_t *block = (block_t *)((char *)start + wsize);
+    block->header = pack(length - dsize, true) | mapped_bits;
+    atomic_fetch_add(&mapped_bytes, length);
+    atomic_fetch_add(&mapped_blocks, 1);
+    atomic_fetch_add(&mmap_calls, 1);
+    return block;
+}
+#endif /* def MMAP_THRESHOLD */
+
+/*
+ * Give the mapping of a mapped block back to the system.
+ */
+static void unmap_block(block_t *block)
+{
+    atomic_fetch_sub(&mapped_bytes, get_size(block) + dsize);
+    atomic_fetch_sub(&mapped_blocks, 1);
+    munmap((char *)block - wsize, get_size(block) + dsize);
+}
+
+/*
+ * Return whether the given allocated block has a mapping of its own.
+ */
+static bool is_mapped(block_t *block)
+{
+    return (block->header & arena_mask) == mapped_bits;
+}
+
+/*
+ * Hand the whole pages of a free block ending a chunk back to the system,
+ * but for the page of its footer and a pad at its start, which holds its
+ * header and list pointers and serves the next allocations without
+ * faulting pages in: trim_pad bytes, or as many as the arena has in use,
+ * so a heap churning around a steady size keeps its pages. If released is
+ * not NULL, the pages from there on were handed back already, and the
+ * pages freed since only go back once they are at least a pad long. The
+ * pages read as zero when touched again, so a zero block stays zero.
+ * Records what the block has handed back in the arena.
+ */
+static void trim_block(arena_t *arena, block_t *block, char *released)
+{
+    size_t pad = max(trim_pad, arena->stats.in_use_bytes);
+    char *start = (char *)round_up((size_t)block + pad, page_size);
+    char *footer = (char *)block + get_size(block) - wsize;
+    char *end = footer - (size_t)footer % page_size;
+    if (released != NULL && released < end)
+        end = released;
+    if (start >= end || (released != NULL && (size_t)(end - start) < pad))
+    {
+        arena->released_block = released != NULL ? block : NULL;
+        arena->released = released;
+        return;
+    }
+    madvise(start, end - start, MADV_DONTNEED);
+    arena->released_block = block;
+    arena->released = start;
+}
+
+/****************** STATIC HELPER METHODS ************************************/
+/************ LIST OPERATIONS ************/
+
+/*
+ * Get the next free block of curr in the free block list.
+ */
+static block_t *get_next_free(block_t *curr)
+{
+    return curr->content.ptrs.next;
+}
+
+/*
+ * Get the previous free block of curr in the list.
+ */
+static block_t *get_prev_free(block_t *curr)
+{
+    return curr->content.ptrs.prev;
+}
+
+/*
+ * Set the next free block of curr in the list.
+ */
+static void set_next_free(block_t *curr, block_t *next)
+{
+    curr->content.ptrs.next = next;
+}
+
+/*
+ * Set the previous free block of curr in the list.
+ */
+static void set_prev_free(block_t *curr, block_t *prev)
+{
+    curr->content.ptrs.prev = prev;
+}
+
+/************ HEAP OPERATIONS ************/
+/*
+ * Get the block physically next to the curr block.
+ */
+static block_t *get_next_block(block_t *curr)
+{
+    dbg_requires(curr != NULL);    
+    block_t *next_block = (block_t *)(((char *)curr) + get_size(curr));
+    return next_block;    
+}
+
+/*
+ * Get the block physically ahead of the curr block.
+ */
+static block_t *get_prev_block(block_t *curr)
+{
+    dbg_requires(curr != NULL);
+    dbg_requires(!get_prev_alloc(curr));
+    if (get_prev_mini(curr))
+    {
+        return (block_t *)((char *)curr - min_block_size);
+    }
+    word_t *footerp = find_prev_footer(curr);
+    size_t size = extract_size(*footerp);
+    return (block_t *)((char *)curr - size);
+}
+
+/************ BLOCK OPERATIONS ************/
 /*
  * Return the payload pointer with the given block pointer.
  */
@@ -573,7 +1606,58 @@ static bool get_alloc(block_t *block)
 }
 
 /*
- * Return the footer of the physically previous block.
+ * Return whether the block physically ahead of the given block is allocated.
+ */
+static bool get_prev_alloc(block_t *block)
+{
+    return (bool)(block->header & prev_alloc_mask);
+}
+
+/*
+ * Return whether the block physically ahead of the given block is a mini
+ * block.
+ */
+static bool get_prev_mini(block_t *block)
+{
+    return (bool)(block->header & prev_mini_mask);
+}
+
+/*
+ * Return whether the payload of the given free block is known to be zero,
+ * but for its list pointers and footer.
+ */
+static bool get_zeroed(block_t *block)
+{
+    return (bool)(block->header & zero_mask);
+}
+
+/*
+ * Record whether the payload of the given free block is zero, but for its
+ * list pointers and footer. Writing the block again forgets it.
+ */
+static void set_zeroed(block_t *block, bool zeroed)
+{
+    if (zeroed)
+        block->header |= zero_mask;
+    else
+        block->header &= ~zero_mask;
+}
+
+/*
+ * Clear the words between two free blocks about to merge: the footer of
+ * left, and the header and list pointers of right.
+ */
+static void clear_boundary(block_t *left, block_t *right)
+{
+    if (get_size(left) > min_block_size)
+        *find_prev_footer(right) = 0;
+    memset(right, 0, get_size(right) > min_block_size ? sizeof(block_t)
+                                                       : min_block_size);
+}
+
+/*
+ * Return the footer of the physically previous block, which only free
+ * blocks larger than a mini block have.
  */
 static word_t *find_prev_footer(block_t *block)
 {
@@ -582,22 +1666,47 @@ static word_t *find_prev_footer(block_t *block)
 }
 
 /*
- * Write header and footer of the given blcok with a given size and the given
- * allocation flag.
+ * Write header, and footer if it is a free non-mini block, of the given
+ * blcok with a given size and the given allocation flag. The header keeps
+ * its arena and the status of the previous block, and the next block's
+ * header learns the new status of this one.
  */
 static void write_block(block_t *block, size_t size, bool is_allocated)
 {
-    word_t *footerp;
-    block->header = pack(size, is_allocated);
-    if(block == free_root)
+    word_t kept_bits = block->header
+                       & (prev_alloc_mask | prev_mini_mask | arena_mask);
+    block->header = pack(size, is_allocated) | kept_bits;
+    if (!is_allocated && size > min_block_size)
     {
-        return;
-    }
-    else
-    {
-        footerp = (word_t *)(block->content.payload + get_size(block) - dsize);
+        word_t *footerp = (word_t *)(block->content.payload + size - dsize);
+        *footerp = block->header;
     }
-    *footerp = pack(size, is_allocated);
+    block_t *next = (block_t *)((char *)block + size);
+    set_prev_status(next, is_allocated, size == min_block_size);
+}
+
+/*
+ * Record the status of the previous block in the header of the given block.
+ * The block may be allocated and read by its owner without the arena lock,
+ * which is safe as only the prev bits change, never its size or arena.
+ */
+static void set_prev_status(block_t *block, bool prev_alloc, bool prev_mini)
+{
+    word_t header = block->header & ~(prev_alloc_mask | prev_mini_mask);
+    if (prev_alloc)
+        header |= prev_alloc_mask;
+    if (prev_mini)
+        header |= prev_mini_mask;
+    block->header = header;
+}
+
+/*
+ * Write the epilogue header, a zero-size allocated block of the arena, at
+ * the given block position.
+ */
+static void write_epilogue(arena_t *arena, block_t *block)
+{
+    block->header = pack(0, true) | arena->index_bits;
 }
 
 /************ LOW_LEVEL/MATH OPERATIONS ************/
@@ -652,96 +1761,343 @@ static bool aligned(const void *p)
     return align(ip) == ip;
 }
 
+/************ STATISTICS ************/
+/*
+ * Fill stats with the statistics of every arena, taking their locks one
+ * after another, and of the sbrk heap and the mapped blocks.
+ */
+void mm_get_stats(mm_stats_t *stats)
+{
+    memset(stats, 0, sizeof(mm_stats_t));
+    for (int class = 0; class < NUM_CLASSES; class++)
+    {
+        stats->class_sizes[class] = class_min_size(class);
+    }
+    if (!atomic_load(&heap_ready))
+    {
+        return;
+    }
+
+    for (int i = 0; i < NUM_ARENAS; i++)
+    {
+        arena_t *arena = &arenas[i];
+        pthread_mutex_lock(&arena->lock);
+        stats->in_use_bytes += arena->stats.in_use_bytes;
+        stats->deferred_bytes += arena->stats.deferred_bytes;
+        stats->deferred_blocks += arena->stats.deferred_blocks;
+        for (int class = 0; class < NUM_CLASSES; class++)
+        {
+            stats->class_free_bytes[class] += arena->stats.class_free_bytes[class];
+            stats->class_free_blocks[class] += arena->stats.class_free_blocks[class];
+        }
+        stats->fit_searches += arena->stats.fit_searches;
+        stats->fit_misses += arena->stats.fit_misses;
+        for (int k = 0; k < MM_STATS_SEARCH_BUCKETS; k++)
+        {
+            stats->search_lengths[k] += arena->stats.search_lengths[k];
+        }
+        // The largest free block is in the highest non-empty class
+        if (arena->class_bitmap != 0)
+        {
+            int class = 63 - __builtin_clzll(arena->class_bitmap);
+            for (block_t *block = arena->free_lists[class]; block != NULL;
+                 block = get_next_free(block))
+            {
+                stats->largest_free = max(stats->largest_free, get_size(block));
+            }
+        }
+        for (int index = 0; index < SLAB_CLASSES; index++)
+        {
+            for (slab_t *slab = arena->slabs[index]; slab != NULL;
+                 slab = slab->next)
+            {
+                size_t objects = (slab->end - slab_first(slab))
+                                 / slab->object_size;
+                stats->slab_free_bytes += (objects - slab->used)
+                                          * slab->object_size;
+            }
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+    for (int class = 0; class < NUM_CLASSES; class++)
+    {
+        stats->free_bytes += stats->class_free_bytes[class];
+        stats->free_blocks += stats->class_free_blocks[class];
+    }
+    if (stats->free_bytes > 0)
+    {
+        stats->fragmentation = 1.0 - (double)stats->largest_free
+                                     / stats->free_bytes;
+    }
+
+    pthread_mutex_lock(&sbrk_lock);
+    stats->heap_bytes = mem_heapsize();
+    stats->sbrk_calls = sbrk_calls;
+    pthread_mutex_unlock(&sbrk_lock);
+    stats->mapped_bytes = atomic_load(&mapped_bytes);
+    stats->mapped_blocks = atomic_load(&mapped_blocks);
+    stats->mmap_calls = atomic_load(&mmap_calls);
+}
+
 /*
- * Check the correctness and consistency of the heap.
- * May be used in the debug mode.
+ * Check the correctness and consistency of the heap: every chunk from the
+ * start of the heap, then the free lists of every arena.
+ * May be used in the debug mode, while no other thread is allocating.
  */
 bool mm_checkheap(int lineno)
 { 
-    block_t *lo = mem_heap_lo(); 
-    block_t *hi = mem_heap_hi();
     dbg_printf("mm_checkheap: start");
-    block_t *curr = (block_t *) (prologue + 5 * wsize);
-    block_t *next;
-
-    size_t size;
-    word_t hdr;
-    word_t ftr;
-    if (curr == NULL)
+    if (!atomic_load(&heap_ready))
     {
         return true;
     }
-    while ((next = get_next_block(curr)) + 1 < hi)
+    int heap_free = 0;
+    size_t in_use[NUM_ARENAS] = {0};    // allocated bytes found per arena
+    word_t *fence = (word_t *)mem_heap_lo();
+    while ((char *)fence <= (char *)mem_heap_hi())
     {
-        hdr = curr->header;
-        ftr = *find_prev_footer(next);
-        bool allocated = get_alloc(curr);
-        
-        // check header and footer
-        if (hdr != ftr)
+        block_t *first = (block_t *)(fence + 1);
+        word_t chunk_arena = first->header & arena_mask;
+        // check prologue
+        if (*fence != pack(0, true)
+            || !get_prev_alloc(first) || get_prev_mini(first))
         {
-            printf("[%d] header (0x%016lX) != footer (0x%016lX) at %p\n",
-                   lineno, hdr, ftr, curr);
+            printf("[%d] bad prologue at %p\n", lineno, first);
             return false;
         }
-        // check payload address alignment
-        if (allocated)
+
+        // check blocks in address order, up to the epilogue
+        block_t *curr;
+        for (curr = first; get_size(curr) > 0; curr = get_next_block(curr))
         {
+            word_t hdr = curr->header;
+            size_t size = get_size(curr);
+            block_t *next = get_next_block(curr);
+        
+            // check header and footer of free blocks that have one
+            word_t ftr = *find_prev_footer(next);
+            if (!get_alloc(curr) && size > min_block_size
+                && (extract_size(hdr) != extract_size(ftr)
+                    || extract_alloc(ftr)))
+            {
+                printf("[%d] header (0x%016lX) != footer (0x%016lX) at %p\n",
+                       lineno, hdr, ftr, curr);
+                return false;
+            }
+            // check the status the next block records about this one
+            if (get_prev_alloc(next) != get_alloc(curr)
+                || get_prev_mini(next) != (size == min_block_size))
+            {
+                printf("[%d] block %p: prev bits of next block %p are stale\n",
+                       lineno, curr, next);
+                return false;
+            }
+            // check that the chunk belongs to a single arena
+            if ((hdr & arena_mask) != chunk_arena)
+            {
+                printf("[%d] block %p is not in the arena of its chunk\n",
+                       lineno, curr);
+                return false;
+            }
+            // check payload address alignment
             if (!aligned(curr->content.payload))
             {
                 printf("[%d] payload (0x%016lX) not aligned at block %p\n",
                        lineno, (word_t) & (curr->content.payload), curr);
                 return false;
             }
+            // check minimum size
+            if (size < min_block_size)
+            {
+                printf("[%d] block %p with header (0x%016lX): its size less than min_block_size.\n",
+                       lineno, curr, hdr);
+                return false;
+            }
+            if (size % dsize != 0)
+            {
+                printf("[%d] block %p with header (0x%016lX): size not dsize.\n",
+                       lineno, curr, hdr);
+                return false;
+            }
+            // check coalescing: no adjacent free blocks
+            if (!get_alloc(curr) && !get_alloc(next))
+            {
+                printf("[%d] block %p and next block %p: two adjacent free blocks.\n",
+                       lineno, curr, next);
+                return false;
+            }
+            if (!get_alloc(curr))
+            {
+                heap_free++;
+            }
+            else
+            {
+                in_use[chunk_arena >> arena_shift] += size;
+            }
         }
-        // check minimum size
-        size = get_size(curr);
-        if (size < min_block_size)
+        // check epilogue; the next chunk starts right after it
+        if (!get_alloc(curr) || (curr->header & arena_mask) != chunk_arena)
         {
-            printf("[%d] block %p with header (0x%016lX): its size less than min_block_size.\n",
-                   lineno, curr, hdr);
+            printf("[%d] bad epilogue at %p\n", lineno, curr);
             return false;
         }
-        if (size % dsize != 0)
+        fence = &(curr->header) + 1;
+    }
+    if ((char *)fence != (char *)mem_heap_hi() + 1)
+    {
+        printf("[%d] last chunk ends at %p, past the heap\n", lineno, fence);
+        return false;
+    }
+
+    // check free lists of every arena
+    int count = 0;
+    for (int i = 0; i < NUM_ARENAS; i++)
+    {
+        arena_t *arena = &arenas[i];
+        int arena_count = 0;
+        if (arena->epilogue != NULL && (get_size(arena->epilogue) != 0
+            || !get_alloc(arena->epilogue)
+            || get_arena(arena->epilogue) != arena))
         {
-            printf("[%d] block %p with header (0x%016lX): size not dsize.\n",
-                   lineno, curr, hdr);
+            printf("[%d] arena %d: bad epilogue %p\n", lineno, i,
+                   arena->epilogue);
             return false;
         }
-        // check coalescing: no adjacent free blocks
-        bool curr_alloc = get_alloc(curr);
-        bool next_alloc = get_alloc(next);
-        if (!curr_alloc || !next_alloc)
+        for (int class = 0; class < NUM_CLASSES; class++)
+        {
+            bool has_bit = (arena->class_bitmap >> class) & 1;
+            if (has_bit != (arena->free_lists[class] != NULL))
+            {
+                printf("[%d] arena %d class %d bitmap bit does not match"
+                       " its list\n", lineno, i, class);
+                return false;
+            }
+            block_t *prev = NULL;
+            size_t class_bytes = 0, class_blocks = 0;
+            for (block_t *tmp = arena->free_lists[class]; tmp != NULL;
+                 tmp = get_next_free(tmp))
+            {
+                // Check address boundary
+                if (!in_heap(tmp))
+                {
+                    printf("[%d] block(%p) exceeds heap range(%p, %p)\n",
+                           lineno, tmp, mem_heap_lo(), mem_heap_hi());
+                    return false;
+                }
+                if (get_alloc(tmp) || size_class(get_size(tmp)) != class
+                    || get_arena(tmp) != arena
+                    || (class != 0 && get_prev_free(tmp) != prev))
+                {
+                    printf("[%d] free block %p misplaced in class %d\n", lineno,
+                           tmp, class);
+                    return false;
+                }
+                // Check block number - to debug "add_to_list" and
+                // "remove_from_list"
+                arena_count++;
+                class_bytes += get_size(tmp);
+                class_blocks++;
+                prev = tmp;
+            }
+            if (class_bytes != arena->stats.class_free_bytes[class]
+                || class_blocks != arena->stats.class_free_blocks[class])
+            {
+                printf("[%d] arena %d class %d: free stats are stale\n",
+                       lineno, i, class);
+                return false;
+            }
+        }
+        // deferred blocks are still marked allocated
+        size_t deferred = 0, deferred_blocks = 0;
+        for (int index = 0; index < QUICK_LISTS; index++)
+        {
+            int length = 0;
+            for (block_t *tmp = arena->quick_lists[index]; tmp != NULL;
+                 tmp = get_next_free(tmp))
+            {
+                if (!in_heap(tmp) || !get_alloc(tmp) || get_arena(tmp) != arena
+                    || get_size(tmp) != slab_max_size + (index + 1) * dsize)
+                {
+                    printf("[%d] deferred block %p misplaced in quick list"
+                           " %d\n", lineno, tmp, index);
+                    return false;
+                }
+                deferred += get_size(tmp);
+                deferred_blocks++;
+                length++;
+            }
+            if (length != arena->quick_counts[index] || length > QUICK_LIMIT)
+            {
+                printf("[%d] arena %d quick list %d: length %d, count %d\n",
+                       lineno, i, index, length, arena->quick_counts[index]);
+                return false;
+            }
+        }
+        if (deferred != arena->stats.deferred_bytes
+            || deferred_blocks != arena->stats.deferred_blocks)
         {
-            printf("[%d] block %p and next block %p: two adjacent free blocks. (%d and %d)\n",
-                   lineno, curr, next, curr_alloc, next_alloc);
+            printf("[%d] arena %d: deferred stats are stale\n", lineno, i);
             return false;
         }
-        curr = next;
-    }
-
-    // check free blocks    
-    int count = 0;
-    for (block_t *tmp = get_next_free(free_root); get_size(tmp) > 0; tmp = get_next_free(tmp))
-    {
-        // Check address boundary        
-        if(tmp < lo || tmp > hi)
+        if (in_use[i] != arena->stats.in_use_bytes + deferred)
         {
-            dbg_printf("[%d] block(%p) exceeds heap range(%p, %p)", lineno, tmp, lo, hi);
+            printf("[%d] arena %d: %zu bytes in use, stats say %zu\n", lineno,
+                   i, in_use[i], arena->stats.in_use_bytes + deferred);
             return false;
         }
-        // Check block number - to debug "add_to_list" and "remove_from_list"
-        count++;
-
-        // Check alignment
-        if(aligned(tmp->content.payload))
+        for (int index = 0; index < SLAB_CLASSES; index++)
         {
-            dbg_printf("[%d] %d free block aligned %p\n", lineno, count, tmp);
+            slab_t *prev = NULL;
+            for (slab_t *slab = arena->slabs[index]; slab != NULL;
+                 slab = slab->next)
+            {
+                block_t *slab_block = payload_to_header(slab);
+                if (!in_heap(slab) || !get_alloc(slab_block)
+                    || get_arena(slab_block) != arena || slab->prev != prev
+                    || slab->object_size != (size_t)(index + 1) * dsize
+                    || slab_full(slab))
+                {
+                    printf("[%d] slab %p misplaced in arena %d\n", lineno,
+                           slab, i);
+                    return false;
+                }
+                // every object is allocated, freed or never used
+                size_t objects = slab->used
+                                 + (slab->end - slab->bump) / slab->object_size;
+                for (block_t *obj = slab->free_objects; obj != NULL;
+                     obj = get_next_free(obj))
+                {
+                    if (!is_slab_object(obj) || get_slab(obj) != slab)
+                    {
+                        printf("[%d] object %p is not in slab %p\n", lineno,
+                               obj, slab);
+                        return false;
+                    }
+                    objects++;
+                }
+                if (objects
+                    != (slab->end - slab_first(slab)) / slab->object_size)
+                {
+                    printf("[%d] slab %p lost objects\n", lineno, slab);
+                    return false;
+                }
+                prev = slab;
+            }
         }
-
-        
+        if (arena_count != arena->counter)
+        {
+            printf("[%d] arena %d: the length of free lists: %d, counter: %d\n",
+                   lineno, i, arena_count, arena->counter);
+            return false;
+        }
+        count += arena_count;
+    }
+    if (count != heap_free)
+    {
+        printf("[%d] the length of free lists: %d, heap: %d\n",
+               lineno, count, heap_free);
+        return false;
     }
-    dbg_printf("[%d] the length of free :%d  global: %d\n", lineno, count, counter_global);
     dbg_printf("mm_checkheap: end");
     return true;
 }
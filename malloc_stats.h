@@ -0,0 +1,51 @@
+/*
+ * malloc_stats.h
+ *
+ * Runtime statistics of the allocator in malloc_simulator.c, to tune its
+ * size classes and chunk size from real workloads. The counters are kept
+ * up to date under the locks the allocator takes anyway; a query locks
+ * one arena at a time, so it is a snapshot of each arena, not of the heap
+ * as a whole.
+ *
+ * Author: Jinyi Li
+ */
+#ifndef MALLOC_STATS_H
+#define MALLOC_STATS_H
+
+#include <stddef.h>
+
+/* Size classes of the free lists */
+#define MM_STATS_CLASSES 60
+/* find_fit search lengths: bucket 0 counts searches that examined no
+ * block, bucket k > 0 those that examined [2^(k-1), 2^k) blocks, and the
+ * last one every longer search */
+#define MM_STATS_SEARCH_BUCKETS 16
+
+typedef struct mm_stats
+{
+    size_t heap_bytes;                  // bytes obtained with mem_sbrk
+    size_t sbrk_calls;
+    size_t mapped_bytes;                // bytes of blocks mapped on their own
+    size_t mapped_blocks;
+    size_t mmap_calls;
+    size_t in_use_bytes;                // allocated heap blocks, with headers
+                                        // and whole slabs
+    size_t slab_free_bytes;             // unused objects of slabs with room
+    size_t deferred_bytes;              // freed blocks waiting on quick lists
+    size_t deferred_blocks;
+    size_t free_bytes;                  // blocks on the free lists
+    size_t free_blocks;
+    size_t class_sizes[MM_STATS_CLASSES];       // smallest block of a class
+    size_t class_free_bytes[MM_STATS_CLASSES];
+    size_t class_free_blocks[MM_STATS_CLASSES];
+    size_t largest_free;                // largest block on the free lists
+    double fragmentation;               // 1 - largest_free / free_bytes
+    size_t fit_searches;                // find_fit calls
+    size_t fit_misses;                  // of them, the ones finding no block
+    size_t search_lengths[MM_STATS_SEARCH_BUCKETS];
+} mm_stats_t;
+
+/* Fill stats with the current statistics of the allocator */
+void mm_get_stats(mm_stats_t *stats);
+
+#endif /* MALLOC_STATS_H */
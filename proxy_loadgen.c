@@ -0,0 +1,490 @@
+/*
+ * The program loads the proxy of proxy_simulator.c with GET requests, from
+ * client threads that each keep one request outstanding, and reports
+ * 1. throughput in requests and bytes per second, and
+ * 2. the latency of a request, from sending it to reading the last byte of
+ *    its response: mean, p50, p90, p99, p99.9 and max,
+ * and, with -a, the proxy's own statistics page at the end of the run.
+ *
+ * The URLs are the lines of a trace file (-t), or base?N for N below the
+ * number of objects (-u and -o). Their popularity follows a Zipf
+ * distribution over their order, with the given exponent, so the first
+ * URL is requested most; an exponent of 0 requests all equally.
+ *
+ * Build it on its own, e.g.
+ *     gcc -O2 -pthread proxy_loadgen.c -o proxy_loadgen -lm
+ *
+ * Author: Jinyi Li
+ */
+#define _GNU_SOURCE             // For memmem and strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+/* Max text line length */
+#define MAXLINE 8192
+/* Bytes read from the proxy at once */
+#define READ_CHUNK (64*1024)
+/* Default number of client threads, requests and objects */
+#define DEFAULT_CLIENTS 16
+#define DEFAULT_REQUESTS 10000
+#define DEFAULT_OBJECTS 1000
+/* Default Zipf exponent */
+#define DEFAULT_ZIPF 0.99
+
+/* The load to generate. */
+typedef struct {
+    char *proxy_host;
+    char *proxy_port;
+    char **urls;
+    size_t nurls;
+    double *cdf;                // cdf[i]: probability of the first i+1 URLs
+    long requests;
+    bool keep_alive;
+} load;
+
+/* A client thread and what it measured. */
+typedef struct {
+    pthread_t tid;
+    unsigned long seed;
+    long *latencies;            // Nanoseconds per request that succeeded
+    long capacity;              // Room in latencies
+    long done;
+    long errors;
+    size_t bytes;
+} client;
+
+/* The load every client shares. */
+load work;
+/* Requests handed out to clients so far. */
+atomic_long issued;
+
+
+/*
+ * Nanoseconds on the monotonic clock.
+ */
+long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/*
+ * Return a random number in [0, 1) from the client's xorshift64* state.
+ */
+double next_random(client *c) {
+    c->seed ^= c->seed >> 12;
+    c->seed ^= c->seed << 25;
+    c->seed ^= c->seed >> 27;
+    return ((c->seed * 2685821657736338717UL) >> 11) * (1.0 / (1UL << 53));
+}
+
+/*
+ * Compute the cumulative Zipf distribution with exponent s over n ranks.
+ */
+double *zipf_cdf(size_t n, double s) {
+    double *cdf = malloc(n * sizeof(double));
+    if (!cdf) {
+        return NULL;
+    }
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += 1.0 / pow(i + 1, s);
+        cdf[i] = sum;
+    }
+    for (size_t i = 0; i < n; i++) {
+        cdf[i] /= sum;
+    }
+    return cdf;
+}
+
+/*
+ * Return the index of a URL drawn from the Zipf distribution.
+ */
+size_t pick_url(client *c) {
+    double u = next_random(c);
+    size_t low = 0, high = work.nurls - 1;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (work.cdf[mid] < u) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/*
+ * Open a connection to the proxy.
+ *
+ * Return the socket, or -1 if fails.
+ */
+int open_proxy(void) {
+    struct addrinfo hints, *listp, *p;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(work.proxy_host, work.proxy_port, &hints, &listp) != 0) {
+        return -1;
+    }
+    for (p = listp; p; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+            continue;
+        }
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(listp);
+    return fd;
+}
+
+/*
+ * Write n bytes of buf to fd.
+ *
+ * Return 0 if succeeds, or 1 if fails.
+ */
+int write_all(int fd, const char *buf, size_t n) {
+    while (n > 0) {
+        ssize_t written = write(fd, buf, n);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return 1;
+        }
+        buf += written;
+        n -= written;
+    }
+    return 0;
+}
+
+/*
+ * Send a GET request for url on fd and read its whole response, framed by
+ * Content-Length, or by the end of the stream if it has none. *open is
+ * cleared if the connection cannot carry another request.
+ *
+ * Return the bytes of the response, or -1 if fails.
+ */
+ssize_t fetch(int fd, char *url, bool *open) {
+    char buf[READ_CHUNK];
+    int len = snprintf(buf, MAXLINE, "GET %s HTTP/1.%c\r\n%s\r\n", url,
+                       work.keep_alive ? '1' : '0',
+                       work.keep_alive ? "" : "Connection: close\r\n");
+    if (write_all(fd, buf, len)) {
+        return -1;
+    }
+
+    // Read the headers.
+    size_t got = 0;
+    char *end = NULL;
+    while (!end) {
+        if (got >= MAXLINE) {
+            return -1;
+        }
+        ssize_t n = read(fd, buf + got, READ_CHUNK - got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        got += n;
+        end = memmem(buf, got, "\r\n\r\n", 4);
+    }
+    size_t head_len = end - buf + 4;
+    char saved = buf[head_len - 1];
+    buf[head_len - 1] = '\0';
+    char *length = strcasestr(buf, "\r\nContent-Length:");
+    char *connection = strcasestr(buf, "\r\nConnection:");
+    *open = *open && length && connection
+            && !strncasecmp(connection + strlen("\r\nConnection: "),
+                            "keep-alive", strlen("keep-alive"));
+    size_t body_len = length ? strtoul(length + strlen("\r\nContent-Length:"),
+                                       NULL, 10) : SIZE_MAX;
+    buf[head_len - 1] = saved;
+
+    // Read the body.
+    size_t body = got - head_len;
+    while (body < body_len) {
+        ssize_t n = read(fd, buf, READ_CHUNK);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 || (n == 0 && body_len != SIZE_MAX)) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        body += n;
+    }
+    return head_len + body;
+}
+
+/*
+ * A client thread: take requests until all are issued, keeping its
+ * connection between them with -k.
+ */
+void *run_client(void *arg) {
+    client *c = arg;
+    int fd = -1;
+    while (atomic_fetch_add(&issued, 1) < work.requests) {
+        char *url = work.urls[pick_url(c)];
+        long start = now_ns();
+        if (fd < 0 && (fd = open_proxy()) < 0) {
+            c->errors++;
+            continue;
+        }
+        bool open = work.keep_alive;
+        ssize_t bytes = fetch(fd, url, &open);
+        if (bytes < 0) {
+            c->errors++;
+        } else {
+            long latency = now_ns() - start;
+            if (c->done == c->capacity) {
+                c->capacity *= 2;
+                c->latencies = realloc(c->latencies,
+                                       c->capacity * sizeof(long));
+                if (!c->latencies) {
+                    fprintf(stderr, "out of memory\n");
+                    exit(1);
+                }
+            }
+            c->latencies[c->done++] = latency;
+            c->bytes += bytes;
+        }
+        if (bytes < 0 || !open) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * Read the URLs of a trace file, one per line, skipping empty lines.
+ *
+ * Return 0 if succeeds, or 1 if fails.
+ */
+int read_trace(char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return 1;
+    }
+    char line[MAXLINE];
+    size_t cap = 0;
+    while (fgets(line, MAXLINE, file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!line[0]) {
+            continue;
+        }
+        if (work.nurls == cap) {
+            cap = cap ? cap * 2 : 1024;
+            work.urls = realloc(work.urls, cap * sizeof(char *));
+        }
+        work.urls[work.nurls++] = strdup(line);
+    }
+    fclose(file);
+    if (!work.nurls) {
+        fprintf(stderr, "%s: no URLs\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Make the URLs base?0 to base?(n-1).
+ */
+void make_urls(char *base, size_t n) {
+    work.urls = malloc(n * sizeof(char *));
+    for (size_t i = 0; i < n; i++) {
+        char line[MAXLINE];
+        snprintf(line, MAXLINE, "%s?%zu", base, i);
+        work.urls[i] = strdup(line);
+    }
+    work.nurls = n;
+}
+
+/*
+ * Compare latencies for qsort.
+ */
+int compare_latency(const void *a, const void *b) {
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Print the proxy's statistics page.
+ */
+void print_proxy_stats(void) {
+    int fd = open_proxy();
+    if (fd < 0) {
+        fprintf(stderr, "cannot connect to the proxy for its statistics\n");
+        return;
+    }
+    const char *request = "GET /proxy-stats HTTP/1.0\r\n\r\n";
+    char buf[READ_CHUNK];
+    ssize_t n;
+    size_t got = 0;
+    if (!write_all(fd, request, strlen(request))) {
+        while ((n = read(fd, buf + got, READ_CHUNK - 1 - got)) > 0) {
+            got += n;
+        }
+    }
+    close(fd);
+    buf[got] = '\0';
+    char *page = strstr(buf, "\r\n\r\n");
+    printf("\nproxy statistics:\n%s", page ? page + 4 : buf);
+}
+
+/*
+ * Print the usage of the load generator.
+ */
+void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-k] [-a] [-c clients] [-n requests] [-s exponent]"
+            " (-t trace | -u base [-o objects]) <proxy host> <proxy port>\n"
+            "  -k        keep connections to the proxy open\n"
+            "  -a        print the proxy's statistics at the end\n"
+            "  -c N      client threads (default %d)\n"
+            "  -n N      requests in all (default %d)\n"
+            "  -s x      Zipf exponent of URL popularity (default %.2f)\n"
+            "  -t file   URLs to request, one per line, most popular first\n"
+            "  -u url    request url?0 to url?(objects-1)\n"
+            "  -o N      objects with -u (default %d)\n",
+            name, DEFAULT_CLIENTS, DEFAULT_REQUESTS, DEFAULT_ZIPF,
+            DEFAULT_OBJECTS);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    signal(SIGPIPE, SIG_IGN);
+
+    // Get options and the proxy address from the command line arguments.
+    int clients = DEFAULT_CLIENTS;
+    long objects = DEFAULT_OBJECTS;
+    double exponent = DEFAULT_ZIPF;
+    char *trace = NULL, *base = NULL;
+    bool admin = false;
+    work.requests = DEFAULT_REQUESTS;
+    int opt;
+    while ((opt = getopt(argc, argv, "kac:n:s:t:u:o:")) != -1) {
+        switch (opt) {
+        case 'k':
+            work.keep_alive = true;
+            break;
+        case 'a':
+            admin = true;
+            break;
+        case 'c':
+            clients = atoi(optarg);
+            break;
+        case 'n':
+            work.requests = atol(optarg);
+            break;
+        case 's':
+            exponent = atof(optarg);
+            break;
+        case 't':
+            trace = optarg;
+            break;
+        case 'u':
+            base = optarg;
+            break;
+        case 'o':
+            objects = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2 || clients < 1 || work.requests < 1
+        || objects < 1 || exponent < 0 || !trace == !base) {
+        usage(argv[0]);
+    }
+    work.proxy_host = argv[optind];
+    work.proxy_port = argv[optind + 1];
+    if (trace) {
+        if (read_trace(trace)) {
+            return 1;
+        }
+    } else {
+        make_urls(base, objects);
+    }
+    if (!(work.cdf = zipf_cdf(work.nurls, exponent))) {
+        return 1;
+    }
+
+    // Run the clients, each with room for its share of the requests to
+    // start with.
+    client *all = calloc(clients, sizeof(client));
+    long start = now_ns();
+    for (int i = 0; i < clients; i++) {
+        all[i].seed = 0x9E3779B97F4A7C15UL * (i + 1);
+        all[i].capacity = work.requests / clients + 1;
+        all[i].latencies = malloc(all[i].capacity * sizeof(long));
+        if (!all[i].latencies) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        pthread_create(&all[i].tid, NULL, run_client, &all[i]);
+    }
+    long done = 0, errors = 0;
+    size_t bytes = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(all[i].tid, NULL);
+        done += all[i].done;
+        errors += all[i].errors;
+        bytes += all[i].bytes;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    // Merge the latencies and report.
+    long *latencies = malloc((done ? done : 1) * sizeof(long));
+    long merged = 0, sum = 0;
+    for (int i = 0; i < clients; i++) {
+        for (long j = 0; j < all[i].done; j++) {
+            sum += all[i].latencies[j];
+            latencies[merged++] = all[i].latencies[j];
+        }
+    }
+    qsort(latencies, done, sizeof(long), compare_latency);
+    printf("%ld requests (%ld failed) over %zu URLs, %d clients%s, "
+           "Zipf %.2f\n", done + errors, errors, work.nurls, clients,
+           work.keep_alive ? " keeping connections" : "", exponent);
+    printf("throughput: %.0f requests/s, %.1f MB/s over %.2f s\n",
+           done / seconds, bytes / seconds / (1024 * 1024), seconds);
+    if (done) {
+        printf("latency ms: mean %.3f p50 %.3f p90 %.3f p99 %.3f"
+               " p99.9 %.3f max %.3f\n", sum / 1e6 / done,
+               latencies[done / 2] / 1e6, latencies[done * 9 / 10] / 1e6,
+               latencies[done * 99 / 100] / 1e6,
+               latencies[done * 999 / 1000] / 1e6, latencies[done - 1] / 1e6);
+    }
+    if (admin) {
+        print_proxy_stats();
+    }
+    return errors > 0;
+}
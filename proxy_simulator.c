@@ -13,11 +13,48 @@
  * Meanwhile, if the response object is small enough to be held in cache,
  * it'll be cached.
  *
+ * The cache is split into shards by a hash of the normalized URL, each a
+ * hash table under a reader-writer lock, so hits share a read lock and
+ * only inserts and evictions of the same shard exclude them. A hit only
+ * sets the reference bit of its entry, which the CLOCK hand of the shard
+ * clears and evicts unreferenced entries by, until the cache fits in its
+ * byte budget (-c). Entries are reference counted: a hit keeps its entry
+ * alive while the response is written, even if the entry is evicted
+ * meanwhile.
+ *
+ * Servers are asked to keep their connections open: a connection whose
+ * response had a known length goes back to a pool of idle connections to
+ * its origin, and server addresses are resolved once per DNS_TTL. In the
+ * worker mode, clients may send request after request on a connection;
+ * between requests a poller thread, not a worker, waits on it. Concurrent
+ * misses on one URL are fetched once: the first becomes
+ * the leader of an in-flight fetch, and the others follow the response
+ * as it arrives.
+ *
+ * Every thread counts requests, hits, misses and bytes, and histograms
+ * the latency of the stages of a request, in counters only it writes;
+ * GET /proxy-stats sent to the proxy itself returns their sums.
+ *
+ * By default a pool of worker threads serves the client connections,
+ * taking them from a bounded queue that main fills as it accepts them, so
+ * a busy proxy stops accepting instead of piling up threads; SIGUSR1
+ * prints how long connections waited in the queue. With -e,
+ * the proxy instead runs one event loop per core, each accepting on its own
+ * SO_REUSEPORT listening socket and driving non-blocking connections with
+ * epoll through the same stages: request, headers, response. An origin
+ * not resolved lately is looked up and connected to by a resolver thread,
+ * which wakes the loop through an eventfd, so getaddrinfo never blocks it.
+ *
  * Author: Jinyi Li
  */
+#define _GNU_SOURCE             // For splice, memmem and strcasestr
 #include "csapp.h"
-#include "cache.h"
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
 
 //#define DEBUG
 
@@ -29,14 +66,48 @@
 #define dbg_printf(...)
 #endif
 
-/* Max web object size */
+/* Default cache budget and max web object size */
+#define MAX_CACHE_SIZE (1024*1024)
 #define MAX_OBJECT_SIZE (100*1024)
+/* Number of cache shards, each with a lock of its own */
+#define CACHE_SHARDS 16
+/* Initial hash buckets of a shard, doubled when it has more entries */
+#define INITIAL_BUCKETS 64
+/* Bytes of a response read from the server at once */
+#define RESPONSE_CHUNK (64*1024)
+/* Initial capacity of a cache object buffer, doubled when it fills up */
+#define INITIAL_OBJ_CAP (16*1024)
+/* Seconds an idle client connection waits for its next request */
+#define CLIENT_IDLE_TIMEOUT 5
+/* Idle server connections kept per origin, and for how many seconds */
+#define MAX_IDLE_PER_ORIGIN 8
+#define UPSTREAM_IDLE_TIMEOUT 30
+/* Buckets of the idle connection pool, and slots of the address cache */
+#define POOL_BUCKETS 64
+#define DNS_SLOTS 256
+/* Seconds a resolved server address is used before it is looked up again */
+#define DNS_TTL 60
+/* Buckets of the table of in-flight fetches */
+#define FLIGHT_BUCKETS 64
 /* Max text line length */
 #define MAXLINE 8192
 /* Length of host address */
 #define HOSTLEN 256
 /* Length of port number */
 #define SERVLEN 8
+/* Events an event loop takes from epoll_wait at once */
+#define MAX_EVENTS 64
+/* Threads resolving origins for the event loops */
+#define RESOLVERS 4
+/* Default number of worker threads and of queued connections */
+#define DEFAULT_WORKERS 16
+#define DEFAULT_QUEUE 64
+/* Latency histogram buckets: bucket k counts times below 2^k us */
+#define LATENCY_BUCKETS 32
+/* Path of the statistics page, requested from the proxy itself */
+#define ADMIN_PATH "/proxy-stats"
+/* Bytes of the statistics page */
+#define STATS_LEN (4*1024)
 
 /* Information about a connected client. */
 typedef struct {
@@ -47,36 +118,658 @@ typedef struct {
     char serv[SERVLEN];         // Client service (port)
 } client_info;
 
+/* An accepted connection waiting for a worker. */
+typedef struct {
+    int connfd;
+    struct timespec queued;     // When it was accepted
+} queued_conn;
+
+/* A client connection kept alive, waiting for its next request. */
+typedef struct idle_client {
+    int connfd;
+    time_t since;               // When its last request was served
+    struct idle_client *prev;   // Neighbours on the list, oldest first
+    struct idle_client *next;
+} idle_client;
+
+/* Bounded queue of accepted connections, shared by main and the workers. */
+typedef struct {
+    queued_conn *buf;           // Buffer array
+    int n;                      // Maximum number of slots
+    int front;                  // buf[(front+1)%n] is first item
+    int rear;                   // buf[rear%n] is last item
+    sem_t mutex;                // Protects accesses to buf
+    sem_t slots;                // Counts available slots
+    sem_t items;                // Counts available items
+} sbuf_t;
+
+/* A cached web object. */
+typedef struct entry {
+    char *url;
+    char *response;
+    size_t obj_len;
+    size_t head_len;            // Headers before the final Connection: close,
+                                // or 0 if the response is kept as it came
+    size_t hash;                // Hash of url, which picks shard and bucket
+    atomic_int refs;            // The cache's reference and those of hits
+    atomic_bool referenced;     // Hit since the CLOCK hand last passed
+    struct entry *next;         // Next entry of the hash bucket
+    struct entry *clock_prev;   // Neighbours on the CLOCK ring of the shard
+    struct entry *clock_next;
+} entry;
+
+/* A response object being filled for the cache. */
+typedef struct {
+    char *data;                 // NULL until the first bytes arrive
+    size_t len;
+    size_t cap;
+} obj_buf;
+
+/* A part of the cache, holding the entries of the URLs hashed to it. */
+typedef struct {
+    pthread_rwlock_t lock;      // Read for lookups, write for changes
+    entry **buckets;
+    size_t nbuckets;            // A power of two
+    size_t count;
+    entry *hand;                // Next entry the CLOCK hand looks at
+} cache_shard;
+
+/* Request headers the proxy replaces, or adds when missing. */
+typedef struct {
+    bool host;
+    bool user_agent;
+    bool connection;
+    bool proxy_connection;
+    bool keep_alive;            // Client asked for a persistent connection
+    bool close;                 // Client asked to close the connection
+} header_flags;
+
+/* Stages of a request whose latency is measured. */
+typedef enum {
+    STAGE_PARSE,                // Request line read until headers parsed
+    STAGE_CONNECT,              // Getting a server connection, new or idle
+    STAGE_FIRST_BYTE,           // Sending the request until response headers
+    STAGE_TOTAL,                // Request line read until response written
+    STAGES
+} stage;
+
+/* Counters of a thread. Only the thread writes them, so the atomic
+ * updates never contend; readers sum them over all threads. */
+typedef struct thread_stats {
+    atomic_ulong requests;
+    atomic_ulong hits;
+    atomic_ulong coalesced;     // Misses that followed an in-flight fetch
+    atomic_ulong misses;
+    atomic_ulong errors;
+    atomic_ulong admin_requests;
+    atomic_ulong hit_bytes;     // Response bytes written from the cache
+    atomic_ulong origin_bytes;  // Response bytes written from servers
+    atomic_ulong new_connects;
+    atomic_ulong reused_connects;
+    atomic_ulong clients_opened;
+    atomic_ulong clients_closed;
+    atomic_ulong latency_count[STAGES];
+    atomic_ulong latency_sum[STAGES];
+    atomic_ulong latency_max[STAGES];
+    atomic_ulong latency_hist[STAGES][LATENCY_BUCKETS];
+    struct thread_stats *next;
+} thread_stats;
+
+/* What the proxy needs to know of a response's headers. */
+typedef struct {
+    int status;
+    bool framed;                // Body length known, so the connection can
+                                // carry another response after it
+    size_t body_len;
+    bool keep_alive;            // Server keeps the connection open
+} response_head;
+
+/* An idle connection to an origin server. */
+typedef struct idle_conn {
+    char *origin;               // "host:port"
+    int fd;
+    time_t since;
+    struct idle_conn *next;
+} idle_conn;
+
+/* A bucket of the pool of idle connections. */
+typedef struct {
+    pthread_mutex_t lock;
+    idle_conn *head;
+} pool_bucket;
+
+/* Stages of an in-flight fetch. */
+typedef enum {
+    FLIGHT_RUNNING,
+    FLIGHT_DONE,                // The response is cached as result
+    FLIGHT_FAILED               // Followers fetch it themselves if they can
+} flight_status;
+
+/* A fetch of a URL that later misses on the URL follow. */
+typedef struct inflight {
+    char *url;
+    size_t hash;
+    pthread_mutex_t lock;       // Protects the fields below
+    pthread_cond_t changed;     // Signaled when any of them changes
+    flight_status status;
+    char *data;                 // Response in its cached form, allocated at
+                                // its full length, or NULL until streamed
+    size_t head_len;            // As head_len of an entry
+    size_t published;           // Bytes of data readable by followers
+    char *owned;                // data, if the leader failed and left it
+    entry *result;              // Cached response once done
+    atomic_int refs;            // The leader's and the followers'
+    struct inflight *next;
+} inflight;
+
+/* A bucket of the table of in-flight fetches. */
+typedef struct {
+    pthread_mutex_t lock;
+    inflight *head;
+} flight_bucket;
+
+/* A resolved server address. */
+typedef struct {
+    char *origin;               // "host:port", or NULL if the slot is free
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int family, socktype, protocol;
+    time_t expires;
+} dns_slot;
+
+/* Stages of a connection in the event-driven mode. */
+typedef enum {
+    READ_REQUEST,           // Reading request line and headers from client
+    CONNECT_SERVER,         // Waiting for the connection to the server
+    RESOLVE_SERVER,         // Waiting for a resolver to open the server
+    WRITE_REQUEST,          // Sending the rewritten request to the server
+    READ_RESPONSE,          // Waiting for response bytes from the server
+    WRITE_RESPONSE,         // Forwarding them to the client
+    WRITE_CACHED            // Sending a cached response to the client
+} conn_state;
+
+struct connection;
+
+/* A socket of a connection, as registered with epoll. */
+typedef struct {
+    int fd;
+    struct connection *conn;
+} endpoint;
+
+/* A connection whose origin a resolver thread opens. */
+typedef struct resolve_job {
+    struct connection *conn;
+    char *host;
+    char *port;
+    int serverfd;               // The connection, or -1 if it failed
+    struct resolve_job *next;
+} resolve_job;
+
+/* An event loop, and the jobs resolver threads have done for it. */
+typedef struct {
+    int epfd;
+    endpoint resolved;          // eventfd, written when a job is done
+    pthread_mutex_t lock;       // Protects done
+    resolve_job *done;
+} loop_state;
+
+/* A client connection driven by an event loop. */
+typedef struct connection {
+    loop_state *loop;           // Event loop driving the connection
+    endpoint client;
+    endpoint server;            // fd is -1 until the request is sent on
+    conn_state state;
+    bool closed;                // Freed once the current events are done
+    char head[MAXLINE];         // Request line and headers read so far
+    size_t head_len;
+    char *out;                  // Bytes to write to the server or client
+    size_t out_cap, out_len, out_pos;
+    entry *cached;              // Cache entry whose response is in out
+    char *url;                  // Cache entry's url and response object
+    obj_buf obj;
+    bool cacheable;             // Response still fits in MAX_OBJECT_SIZE
+    bool requested;             // Request line and headers are all in
+    bool responding;            // Server sent its first bytes
+    struct timespec started;    // First bytes of the request came in
+    struct timespec stage_start;
+    struct connection *next_closed;
+} connection;
+
 /* User-Agent header string. */
 static const char *header_user_agent = "User-Agent: Mozilla/5.0"
                                        " (X11; Linux x86_64; rv:3.10.0)"
                                        " Gecko/20181101 Firefox/61.0.1\r\n";
 /* Connection header string. */
 static const char *header_connection = "Connection: close\r\n";
+static const char *header_connection_keep_alive = "Connection: keep-alive\r\n";
 /* Proxy connection header string. */
 static const char *header_proxy_connection = "Proxy-Connection: close\r\n";
-/* Semaphore that protects the shared cache. */
-sem_t mutex;
+static const char *header_proxy_connection_keep_alive =
+        "Proxy-Connection: keep-alive\r\n";
+/* The shared cache. */
+cache_shard cache[CACHE_SHARDS];
+/* Bytes of the objects in the cache, and the most it may hold. */
+atomic_size_t cache_bytes;
+size_t cache_budget = MAX_CACHE_SIZE;
+/* Shard the next eviction starts at. */
+atomic_uint next_victim_shard;
+/* Names of the stages on the statistics page. */
+static const char *stage_names[STAGES] = {"parse", "connect", "first_byte",
+                                          "total"};
+/* Counters of this thread, and of all threads. */
+static __thread thread_stats *my_stats;
+_Atomic(thread_stats *) all_stats;
+/* Object buffer a thread kept from a response it did not cache. */
+static __thread obj_buf spare_obj;
+/* Idle connections to origin servers, by hash of the origin. */
+pool_bucket idle_pool[POOL_BUCKETS];
+/* In-flight fetches of the worker mode, by hash of the URL. */
+flight_bucket flights[FLIGHT_BUCKETS];
+/* Resolved server addresses, by hash of the origin. */
+dns_slot dns_cache[DNS_SLOTS];
+pthread_rwlock_t dns_lock = PTHREAD_RWLOCK_INITIALIZER;
+/* Connections accepted for the worker pool. */
+sbuf_t sbuf;
+/* Origins waiting for a resolver thread, oldest first. */
+resolve_job *resolve_head, *resolve_tail;
+pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t resolve_ready = PTHREAD_COND_INITIALIZER;
+/* Clients kept alive between requests, as a list around the sentinel, and
+ * the epoll instance of the poller watching them. */
+idle_client idle_clients;
+pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+int idle_epfd;
+/* Queue wait of the connections the workers took, in microseconds. */
+atomic_ulong queue_waits;
+atomic_ulong queue_wait_total;
+atomic_ulong queue_wait_max;
+atomic_ulong queue_wait_hist[LATENCY_BUCKETS];
+atomic_int queue_length;
+
+
+/*
+ * Hash the URL with FNV-1a.
+ */
+size_t hash_url(const char *url) {
+    size_t hash = 14695981039346656037UL;
+    for (; *url; url++) {
+        hash = (hash ^ (unsigned char) *url) * 1099511628211UL;
+    }
+    return hash;
+}
+
+/*
+ * Return the counters of this thread, registering them on first use.
+ */
+thread_stats *get_stats(void) {
+    if (!my_stats) {
+        my_stats = Calloc(1, sizeof(thread_stats));
+        thread_stats *head = atomic_load(&all_stats);
+        do {
+            my_stats->next = head;
+        } while (!atomic_compare_exchange_weak(&all_stats, &head, my_stats));
+    }
+    return my_stats;
+}
+
+/* Add n to a counter of this thread */
+#define count_stat(field, n) \
+    atomic_fetch_add_explicit(&get_stats()->field, (n), memory_order_relaxed)
+
+/*
+ * Microseconds since the time, from the monotonic clock.
+ */
+unsigned long elapsed_us(struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000
+           + (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+/*
+ * Return the histogram bucket of a latency in microseconds.
+ */
+int latency_bucket(unsigned long us) {
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzl(us);
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+/*
+ * Return the upper bound, in microseconds, of the bucket that holds the
+ * given percentile of the count times in the histogram.
+ */
+unsigned long bucket_percentile(unsigned long *hist, unsigned long count,
+                                int percent) {
+    unsigned long seen = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS && count > 0; bucket++) {
+        seen += hist[bucket];
+        if (seen * 100 >= count * percent) {
+            return 1UL << bucket;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Add the time since the stage started to its histogram of this thread.
+ */
+void record_latency(stage s, struct timespec *since) {
+    thread_stats *stats = get_stats();
+    unsigned long us = elapsed_us(since);
+    atomic_fetch_add_explicit(&stats->latency_hist[s][latency_bucket(us)], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->latency_count[s], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->latency_sum[s], us,
+                              memory_order_relaxed);
+    if (us > atomic_load_explicit(&stats->latency_max[s],
+                                  memory_order_relaxed)) {
+        atomic_store_explicit(&stats->latency_max[s], us,
+                              memory_order_relaxed);
+    }
+}
+
+/*
+ * Initialize the empty cache.
+ */
+void init_cache(void) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_rwlock_init(&cache[i].lock, NULL);
+        cache[i].buckets = Calloc(INITIAL_BUCKETS, sizeof(entry *));
+        cache[i].nbuckets = INITIAL_BUCKETS;
+        cache[i].count = 0;
+        cache[i].hand = NULL;
+    }
+    atomic_store(&cache_bytes, 0);
+}
+
+/*
+ * Create an entry for the response object of url, taking over both.
+ */
+entry *create_entry(char *url, char *response, int obj_len) {
+    entry *new_entry = Malloc(sizeof(entry));
+    new_entry->url = url;
+    new_entry->response = response;
+    new_entry->obj_len = obj_len;
+    new_entry->head_len = 0;
+    new_entry->hash = hash_url(url);
+    atomic_init(&new_entry->refs, 1);
+    atomic_init(&new_entry->referenced, false);
+    new_entry->next = NULL;
+    new_entry->clock_prev = new_entry->clock_next = NULL;
+    return new_entry;
+}
+
+/*
+ * Drop a reference to the entry, and free it with the last one.
+ */
+void release_entry(entry *old_entry) {
+    if (atomic_fetch_sub(&old_entry->refs, 1) == 1) {
+        Free(old_entry->url);
+        Free(old_entry->response);
+        Free(old_entry);
+    }
+}
+
+/*
+ * Return the shard the hash belongs to. Shards take the low bits of the
+ * hash, buckets the high ones.
+ */
+cache_shard *get_shard(size_t hash) {
+    return &cache[hash % CACHE_SHARDS];
+}
+
+/*
+ * Return the link to the entry of url in the shard, or to the NULL that
+ * ends its bucket if url is not cached. The shard must be locked.
+ */
+entry **find_link(cache_shard *shard, char *url, size_t hash) {
+    entry **link = &shard->buckets[(hash >> 32) & (shard->nbuckets - 1)];
+    while (*link && ((*link)->hash != hash || strcmp((*link)->url, url))) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/*
+ * Double the buckets of the shard. The shard must be write-locked.
+ */
+void grow_buckets(cache_shard *shard) {
+    size_t nbuckets = shard->nbuckets * 2;
+    entry **buckets = Calloc(nbuckets, sizeof(entry *));
+    for (size_t i = 0; i < shard->nbuckets; i++) {
+        entry *old_entry = shard->buckets[i], *next;
+        for (; old_entry; old_entry = next) {
+            next = old_entry->next;
+            entry **head = &buckets[(old_entry->hash >> 32) & (nbuckets - 1)];
+            old_entry->next = *head;
+            *head = old_entry;
+        }
+    }
+    Free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nbuckets = nbuckets;
+}
+
+/*
+ * Look up the entry of url, under the read lock of its shard only. A hit
+ * only sets the entry's reference bit, and only if it is clear.
+ *
+ * Return the entry with a reference the caller releases, or NULL if
+ * url is not cached.
+ */
+entry *read_entry(char *url) {
+    size_t hash = hash_url(url);
+    cache_shard *shard = get_shard(hash);
+    pthread_rwlock_rdlock(&shard->lock);
+    entry *found = *find_link(shard, url, hash);
+    if (found) {
+        atomic_fetch_add(&found->refs, 1);
+        if (!atomic_load_explicit(&found->referenced, memory_order_relaxed)) {
+            atomic_store_explicit(&found->referenced, true,
+                                  memory_order_relaxed);
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return found;
+}
+
+/*
+ * Turn the CLOCK hand of the shard: clear the reference bits of the
+ * entries it passes, and remove the first entry whose bit was clear.
+ *
+ * Return the bytes freed, or 0 if the shard is empty.
+ */
+size_t evict_from_shard(cache_shard *shard) {
+    pthread_rwlock_wrlock(&shard->lock);
+    entry *old_entry = shard->hand;
+    if (!old_entry) {
+        pthread_rwlock_unlock(&shard->lock);
+        return 0;
+    }
+    while (atomic_exchange_explicit(&old_entry->referenced, false,
+                                    memory_order_relaxed)) {
+        old_entry = old_entry->clock_next;
+    }
+
+    // Unlink it from its bucket and from the ring.
+    *find_link(shard, old_entry->url, old_entry->hash) = old_entry->next;
+    if (old_entry->clock_next == old_entry) {
+        shard->hand = NULL;
+    } else {
+        old_entry->clock_prev->clock_next = old_entry->clock_next;
+        old_entry->clock_next->clock_prev = old_entry->clock_prev;
+        shard->hand = old_entry->clock_next;
+    }
+    shard->count--;
+    pthread_rwlock_unlock(&shard->lock);
+
+    size_t freed = old_entry->obj_len;
+    atomic_fetch_sub(&cache_bytes, freed);
+    release_entry(old_entry);
+    return freed;
+}
+
+/*
+ * Add the entry to the cache, unless its url is cached already or it is
+ * larger than the whole budget, and evict entries until the cache fits in
+ * its budget again. The shards are evicted from in turn, so only one
+ * shard is locked at a time.
+ */
+void put_new_entry(entry *new_entry) {
+    if (new_entry->obj_len > cache_budget) {
+        release_entry(new_entry);
+        return;
+    }
+    cache_shard *shard = get_shard(new_entry->hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    entry **link = find_link(shard, new_entry->url, new_entry->hash);
+    if (*link) {
+        pthread_rwlock_unlock(&shard->lock);
+        release_entry(new_entry);
+        return;
+    }
+    *link = new_entry;
+
+    // Insert it just behind the hand, which reaches it last.
+    if (shard->hand) {
+        new_entry->clock_next = shard->hand;
+        new_entry->clock_prev = shard->hand->clock_prev;
+        new_entry->clock_prev->clock_next = new_entry;
+        shard->hand->clock_prev = new_entry;
+    } else {
+        new_entry->clock_next = new_entry->clock_prev = new_entry;
+        shard->hand = new_entry;
+    }
+    if (++shard->count > shard->nbuckets) {
+        grow_buckets(shard);
+    }
+
+    // Count it before unlocking: from then on, its only reference is the
+    // cache's, and another thread may evict and free it.
+    atomic_fetch_add(&cache_bytes, new_entry->obj_len);
+    pthread_rwlock_unlock(&shard->lock);
 
+    int empty_shards = 0;
+    while (atomic_load(&cache_bytes) > cache_budget
+           && empty_shards < CACHE_SHARDS) {
+        unsigned int i = atomic_fetch_add(&next_victim_shard, 1);
+        empty_shards = evict_from_shard(&cache[i % CACHE_SHARDS])
+                       ? 0 : empty_shards + 1;
+    }
+}
+
+/*
+ * Write the statistics page, the sums of the counters of all threads
+ * with the state of the cache and of the worker queue, into buf of size
+ * bytes.
+ */
+void format_stats(char *buf, size_t size) {
+    thread_stats total;
+    memset(&total, 0, sizeof(thread_stats));
+    unsigned long count[STAGES] = {0}, sum[STAGES] = {0}, max[STAGES] = {0},
+            hist[STAGES][LATENCY_BUCKETS] = {{0}};
+    for (thread_stats *stats = atomic_load(&all_stats); stats;
+         stats = stats->next) {
+        total.requests += atomic_load(&stats->requests);
+        total.hits += atomic_load(&stats->hits);
+        total.coalesced += atomic_load(&stats->coalesced);
+        total.misses += atomic_load(&stats->misses);
+        total.errors += atomic_load(&stats->errors);
+        total.admin_requests += atomic_load(&stats->admin_requests);
+        total.hit_bytes += atomic_load(&stats->hit_bytes);
+        total.origin_bytes += atomic_load(&stats->origin_bytes);
+        total.new_connects += atomic_load(&stats->new_connects);
+        total.reused_connects += atomic_load(&stats->reused_connects);
+        total.clients_opened += atomic_load(&stats->clients_opened);
+        total.clients_closed += atomic_load(&stats->clients_closed);
+        for (int s = 0; s < STAGES; s++) {
+            count[s] += atomic_load(&stats->latency_count[s]);
+            sum[s] += atomic_load(&stats->latency_sum[s]);
+            unsigned long stage_max = atomic_load(&stats->latency_max[s]);
+            max[s] = stage_max > max[s] ? stage_max : max[s];
+            for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                hist[s][b] += atomic_load(&stats->latency_hist[s][b]);
+            }
+        }
+    }
+    size_t entries = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_rwlock_rdlock(&cache[i].lock);
+        entries += cache[i].count;
+        pthread_rwlock_unlock(&cache[i].lock);
+    }
+
+    unsigned long requests = total.requests, hits = total.hits;
+    size_t len = snprintf(buf, size,
+            "requests %lu\nhits %lu (%.1f%%)\ncoalesced %lu\nmisses %lu\n"
+            "errors %lu\nadmin_requests %lu\nhit_bytes %lu\n"
+            "origin_bytes %lu\nserver_connects %lu new, %lu reused\n"
+            "active_clients %lu\ncache %zu entries, %zu of %zu bytes\n"
+            "queue %d waiting\n",
+            requests, hits, requests ? 100.0 * hits / requests : 0.0,
+            (unsigned long) total.coalesced, (unsigned long) total.misses,
+            (unsigned long) total.errors, (unsigned long) total.admin_requests,
+            (unsigned long) total.hit_bytes, (unsigned long) total.origin_bytes,
+            (unsigned long) total.new_connects,
+            (unsigned long) total.reused_connects,
+            (unsigned long) (total.clients_opened - total.clients_closed),
+            entries, atomic_load(&cache_bytes), cache_budget,
+            atomic_load(&queue_length));
+    for (int s = 0; s < STAGES && len < size; s++) {
+        len += snprintf(buf + len, size - len,
+                        "%s_us count %lu mean %lu p50 < %lu p99 < %lu"
+                        " max %lu\n", stage_names[s], count[s],
+                        count[s] ? sum[s] / count[s] : 0,
+                        bucket_percentile(hist[s], count[s], 50),
+                        bucket_percentile(hist[s], count[s], 99), max[s]);
+    }
+}
+
+/*
+ * Return whether the request line in buf asks for the statistics page.
+ */
+bool is_admin_request(char *buf) {
+    return !strncmp(buf, "GET " ADMIN_PATH " ", strlen("GET " ADMIN_PATH " "));
+}
+
+/*
+ * Build an HTTP response with the statistics page.
+ *
+ * Return the malloc-ed response, whose length is put in *len.
+ */
+char *stats_response(size_t *len) {
+    char page[STATS_LEN];
+    format_stats(page, STATS_LEN);
+    char *response = Malloc(STATS_LEN + MAXLINE);
+    *len = snprintf(response, STATS_LEN + MAXLINE,
+                    "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n"
+                    "Content-Length: %zu\r\n%s\r\n%s",
+                    strlen(page), header_connection, page);
+    count_stat(admin_requests, 1);
+    return response;
+}
 
 /*
  * Process the client request in buf by parsing it into method, host,
- * port, resource, version. It will take pointers to save the parsing result.
+ * port, resource, version (the digit after "HTTP/1."). It will take
+ * pointers to save the parsing result. The URI is normalized to
+ * "host:port/resource", with the host in lower case, so every spelling of
+ * a URL shares one cache entry.
  *
  * It will return 0 if succeeds, or 1 if fails.
  */
 int process_request(char *buf, char *socket_address, char *host, char *port,
-                    char *uri, char *method, char *resource) {
-    char version;
-
+                    char *uri, char *method, char *resource, char *version) {
     // Parse request into: method, URI, version.
-    if (sscanf(buf, "%s %s HTTP/1.%c", method, uri, &version) != 3
-        || (version != '0' && version != '1')) {
+    if (sscanf(buf, "%s %s HTTP/1.%c", method, uri, version) != 3
+        || (*version != '0' && *version != '1')) {
         return 1;
     }
 
     // Parse URI into: (protocol,) socket address, resource.
     char request_protocol[MAXLINE];
+    strcpy(resource, "/");
     if (strstr(uri, "://")) {
         // e.g.: "http://www.hi.com:1234/data1.txt"
         sscanf(uri, "%[^:]://%[^/]%s", request_protocol, socket_address,
@@ -93,9 +786,13 @@ int process_request(char *buf, char *socket_address, char *host, char *port,
     if (strstr(socket_address, ":")) {
         sscanf(socket_address, "%[^:]:%[0-9]", host, port);
     } else {
-        host = socket_address;
-        port = "80";
+        strcpy(host, socket_address);
+        strcpy(port, "80");
+    }
+    for (char *c = host; *c; c++) {
+        *c = tolower((unsigned char) *c);
     }
+    snprintf(uri, MAXLINE, "%s:%s%s", host, port, resource);
 
     // Reformat request.
     strcpy(buf, method);
@@ -109,235 +806,1778 @@ int process_request(char *buf, char *socket_address, char *host, char *port,
 }
 
 /*
- * Process request headers line by line. Replace User-Agent, Connection, and
- * Proxy-Connection headers with prepared values, and add Host header if not
- * exists in the original request.
+ * Replace the header line in buf with the prepared value if it is a
+ * User-Agent, Connection or Proxy-Connection header, and record in seen
+ * which of these headers, or Host, the request has, and whether the
+ * client asked to keep the connection open or to close it. The prepared
+ * values ask the server to keep the connection open if keep_alive is set.
+ */
+void rewrite_header(char *buf, header_flags *seen, bool keep_alive) {
+    bool proxy_connection = !strncasecmp(buf, "Proxy-Connection:",
+                                         strlen("Proxy-Connection:"));
+    bool connection = !strncasecmp(buf, "Connection:", strlen("Connection:"));
+    if (proxy_connection || connection) {
+        seen->keep_alive |= strcasestr(buf, "keep-alive") != NULL;
+        seen->close |= strcasestr(buf, "close") != NULL;
+    }
+
+    if (!strncasecmp(buf, "Host:", strlen("Host:"))) {
+        // If having Host header, keep it.
+        seen->host = true;
+    } else if (!strncasecmp(buf, "User-Agent:", strlen("User-Agent:"))) {
+        seen->user_agent = true;
+        strcpy(buf, header_user_agent);
+    } else if (proxy_connection) {
+        seen->proxy_connection = true;
+        strcpy(buf, keep_alive ? header_proxy_connection_keep_alive
+                               : header_proxy_connection);
+    } else if (connection) {
+        seen->connection = true;
+        strcpy(buf, keep_alive ? header_connection_keep_alive
+                               : header_connection);
+    }
+}
+
+/*
+ * Write into buf, of MAXLINE bytes, the headers the request was missing
+ * according to seen, followed by the empty line that ends the headers.
+ */
+void end_headers(char *buf, char *socket_address, header_flags *seen,
+                 bool keep_alive) {
+    snprintf(buf, MAXLINE, "%s%s%s%s%s%s\r\n",
+             seen->host ? "" : "Host: ",
+             seen->host ? "" : socket_address,
+             seen->host ? "" : "\r\n",
+             seen->user_agent ? "" : header_user_agent,
+             seen->connection ? "" : keep_alive
+                                     ? header_connection_keep_alive
+                                     : header_connection,
+             seen->proxy_connection ? "" : keep_alive
+                                           ? header_proxy_connection_keep_alive
+                                           : header_proxy_connection);
+}
+
+/*
+ * Read request headers line by line, and append them to the request line
+ * in head, of MAXLINE bytes. Replace User-Agent, Connection, and
+ * Proxy-Connection headers with prepared values, and add Host header if
+ * not exists in the original request. The request is kept whole, so it
+ * can be sent again if an idle server connection turns out to be closed.
  *
  * Return 0 if succeeds, or 1 if fails.
  */
-int process_headers(rio_t rio, int proxyfd, char *socket_address, char *buf) {
-    bool has_host, has_useragent, has_connection, has_proxyconnection;
-    ssize_t rc;
+int read_headers(rio_t *rio, char *head, char *socket_address,
+                 header_flags *seen) {
+    char buf[MAXLINE];
+    size_t head_len = strlen(head);
 
-    do {
-        // Read in a new header.
-        if ((rc = rio_readlineb(&rio, buf, MAXLINE)) < 0) {
+    while (true) {
+        // Read in a new header, up to the empty line ending the headers.
+        if (rio_readlineb(rio, buf, MAXLINE) <= 0) {
             return 1;
         }
+        if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n")) {
+            break;
+        }
 
         // Replace some headers with specific values.
-        if (strncmp(buf, "Host:", sizeof("Host:"))) {
-            // If having Host header, keep it.
-            has_host = true;
-        } else if (strstr(buf, "User-Agent:")) {
-            has_useragent = true;
-            strcpy(buf, header_user_agent);
-        } else if (strstr(buf, "Proxy-Connection:")) {
-            has_proxyconnection = true;
-            strcpy(buf, header_proxy_connection);
-        } else if (strstr(buf, "Connection:")) {
-            has_connection = true;
-            strcpy(buf, header_connection);
-        }
-
-        // Write this header to server.
-        if ((size_t) rio_writen(proxyfd, buf, strlen(buf)) != strlen(buf)) {
+        rewrite_header(buf, seen, true);
+        if (head_len + strlen(buf) >= MAXLINE) {
             return 1;
         }
+        strcpy(head + head_len, buf);
+        head_len += strlen(buf);
         dbg_printf("%s", buf);
-    } while (strncmp(buf, "\r\n", sizeof("\r\n")));
+    }
 
     // Add some headers if not exists in the original request.
-    if (!has_host) {
-        strcpy(buf, "Host: ");
-        strcpy(buf, socket_address);
-        if ((size_t) rio_writen(proxyfd, buf, strlen(buf)) != strlen(buf)) {
-            return 1;
-        }
-    }
-    if (!has_useragent) {
-        strcpy(buf, header_user_agent);
-        if ((size_t) rio_writen(proxyfd, buf, strlen(buf)) != strlen(buf)) {
-            return 1;
-        }
+    end_headers(buf, socket_address, seen, true);
+    if (head_len + strlen(buf) >= MAXLINE) {
+        return 1;
     }
-    if (!has_connection) {
-        strcpy(buf, header_connection);
-        if ((size_t) rio_writen(proxyfd, buf, strlen(buf)) != strlen(buf)) {
-            return 1;
-        }
+    strcpy(head + head_len, buf);
+    return 0;
+}
+
+/*
+ * Take an object buffer to fill, the thread's spare one if it has one.
+ */
+obj_buf take_obj_buf(void) {
+    obj_buf obj = spare_obj;
+    spare_obj.data = NULL;
+    spare_obj.cap = 0;
+    obj.len = 0;
+    return obj;
+}
+
+/*
+ * Give back an object buffer that is not cached, keeping it as the
+ * thread's spare one if there is none.
+ */
+void return_obj_buf(obj_buf *obj) {
+    if (!spare_obj.data) {
+        spare_obj = *obj;
+    } else {
+        Free(obj->data);
     }
-    if (!has_proxyconnection) {
-        strcpy(buf, header_proxy_connection);
-        if ((size_t) rio_writen(proxyfd, buf, strlen(buf)) != strlen(buf)) {
-            return 1;
-        }
+    obj->data = NULL;
+    obj->cap = obj->len = 0;
+}
+
+/*
+ * Hand the filled object over to a cache entry, trimmed to its length.
+ */
+char *detach_obj_buf(obj_buf *obj) {
+    char *data = obj->data;
+    if (obj->cap > obj->len) {
+        data = Realloc(data, obj->len ? obj->len : 1);
     }
-    return 0;
+    obj->data = NULL;
+    obj->cap = 0;
+    return data;
 }
 
 /*
- * Append content in buf to 'entry_obj' with a current length of obj_len.
+ * Append size bytes of buf to the object, growing its buffer as needed.
  *
- * Return 0 if succeeds, or 1 if fails.
+ * Return 0 if succeeds, or 1 if the object would exceed MAX_OBJECT_SIZE.
  */
-int append_to_cache_obj(char *entry_obj, int *obj_len, int size, char *buf) {
-    if ((*obj_len + size) > MAX_OBJECT_SIZE) {
+int append_to_cache_obj(obj_buf *obj, char *buf, size_t size) {
+    if ((obj->len + size) > MAX_OBJECT_SIZE) {
         return 1;
     }
-    // Update pointer position where I should continue writing.
-    void *write_pos = (void *) (entry_obj + *obj_len);
-    memcpy(write_pos, buf, size);
-    // Update current response object size.
-    *obj_len += size;
+    if (obj->len + size > obj->cap) {
+        size_t cap = obj->cap ? obj->cap : INITIAL_OBJ_CAP;
+        while (cap < obj->len + size) {
+            cap *= 2;
+        }
+        obj->data = Realloc(obj->data, cap);
+        obj->cap = cap;
+    }
+    memcpy(obj->data + obj->len, buf, size);
+    obj->len += size;
     return 0;
 }
 
 /*
- * Process response from server line by line.
+ * Join the in-flight fetch of url, or start one if there is none, in
+ * which case *leader is set and the caller must fetch the response.
  *
- * Return 0 if succeeds, or 1 if fails.
+ * Return the fetch, with a reference the caller releases.
  */
-int process_response(rio_t pxyrio, int pxyfd, int clientfd, char *pxybuf,
-                     char *entry_obj, int *obj_len) {
-    // Initialize reading from proxy-server socket.
-    Rio_readinitb(&pxyrio, pxyfd);
-    ssize_t size;
-
-    // Read from server, write to client.
-    bool is_valid_obj = true;
-    while ((size = rio_readlineb(&pxyrio, pxybuf, MAXLINE)) > 0) {
-        if ((size_t) rio_writen(clientfd, pxybuf, size) != size) {
-            return 1;
-        }
+inflight *join_flight(char *url, bool *leader) {
+    size_t hash = hash_url(url);
+    flight_bucket *bucket = &flights[hash % FLIGHT_BUCKETS];
+    pthread_mutex_lock(&bucket->lock);
+    inflight *flight = bucket->head;
+    while (flight && (flight->hash != hash || strcmp(flight->url, url))) {
+        flight = flight->next;
+    }
+    *leader = !flight;
+    if (flight) {
+        atomic_fetch_add(&flight->refs, 1);
+    } else {
+        flight = Malloc(sizeof(inflight));
+        flight->url = Malloc(strlen(url) + 1);
+        strcpy(flight->url, url);
+        flight->hash = hash;
+        pthread_mutex_init(&flight->lock, NULL);
+        pthread_cond_init(&flight->changed, NULL);
+        flight->status = FLIGHT_RUNNING;
+        flight->data = flight->owned = NULL;
+        flight->head_len = flight->published = 0;
+        flight->result = NULL;
+        atomic_init(&flight->refs, 1);
+        flight->next = bucket->head;
+        bucket->head = flight;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+    return flight;
+}
 
-        // Write to cache object.
-        if (is_valid_obj) {
-            if (append_to_cache_obj(entry_obj, obj_len, size, pxybuf)) {
-                is_valid_obj = false;
-            }
+/*
+ * Drop a reference to the fetch, and free it with the last one.
+ */
+void release_flight(inflight *flight) {
+    if (atomic_fetch_sub(&flight->refs, 1) == 1) {
+        if (flight->result) {
+            release_entry(flight->result);
         }
+        Free(flight->owned);
+        Free(flight->url);
+        pthread_mutex_destroy(&flight->lock);
+        pthread_cond_destroy(&flight->changed);
+        Free(flight);
     }
-    // If failed rio_writen or invalid cache obj, all need to return 1
-    // to free all malloc-ed resource and close the proxy-client socket.
-    return is_valid_obj ? 0 : 1;
 }
 
 /*
- * Free malloc-ed resource and close proxy-client socket.
+ * Make the first published bytes of data, a response whose cached form
+ * is known to fit in its allocation, readable by followers.
  */
-void free_resource(char *url, char *obj, int proxyfd) {
-    Free(url);
-    Free(obj);
-    Close(proxyfd);
+void publish_flight(inflight *flight, char *data, size_t head_len,
+                    size_t published) {
+    pthread_mutex_lock(&flight->lock);
+    flight->data = data;
+    flight->head_len = head_len;
+    flight->published = published;
+    pthread_cond_broadcast(&flight->changed);
+    pthread_mutex_unlock(&flight->lock);
 }
 
 /*
- * When no cached data, serve this request to the corresponding server.
+ * Finish the fetch with the cached response, or fail it if result is
+ * NULL. A failed leader hands over the data followers may be reading.
  */
-void serve_request(char *host, char *port, char *uri, char *socket_address,
-                   char *buf, rio_t rio, int connfd) {
-    int proxyfd;
-
-    // Initialize for cache entry's url and response object.
-    char *entry_url = Malloc(sizeof(char) * (strlen(uri) + 1));
-    strcpy(entry_url, uri);
-    char *entry_obj = Malloc(MAX_OBJECT_SIZE);
-    int obj_len = 0;
-
-    // Open a proxy-server connection.
-    if ((proxyfd = open_clientfd(host, port)) < 0) {
-        Free(entry_url);
-        Free(entry_obj);
-        return;
-    }
-    // Send request.
-    if ((size_t) rio_writen(proxyfd, buf, strlen(buf)) != strlen(buf)) {
-        free_resource(entry_url, entry_obj, proxyfd);
-        return;
-    }
-    // Send headers.
-    if (process_headers(rio, proxyfd, socket_address, buf)) {
-        free_resource(entry_url, entry_obj, proxyfd);
-        return;
-    }
-    // Send response: read from server, write to client.
-    rio_t pxyrio;
-    char pxybuf[MAXLINE];
-    int response_res = process_response(pxyrio, proxyfd, connfd, pxybuf,
-                                        entry_obj, &obj_len);
-    if (response_res == 1) {
-        free_resource(entry_url, entry_obj, proxyfd);
-        return;
-    } else {
-        // Save the valid-size response object to cache.
-        entry *new_entry = create_entry(entry_url, entry_obj, obj_len);
-
-        // Add lock to protect the cache.
-        P(&mutex);
-        put_new_entry(new_entry);
-        V(&mutex);
-
-        Close(proxyfd);
+void finish_flight(inflight *flight, entry *result, obj_buf *obj) {
+    pthread_mutex_lock(&flight->lock);
+    if (flight->status == FLIGHT_RUNNING) {
+        if (result) {
+            atomic_fetch_add(&result->refs, 1);
+            flight->result = result;
+            flight->status = FLIGHT_DONE;
+        } else {
+            if (flight->data && obj && flight->data == obj->data) {
+                flight->owned = obj->data;
+                obj->data = NULL;
+                obj->cap = obj->len = 0;
+            }
+            flight->status = FLIGHT_FAILED;
+        }
+        pthread_cond_broadcast(&flight->changed);
     }
+    pthread_mutex_unlock(&flight->lock);
 }
 
 /*
- * When having cached data, serve the client with cached entry.
+ * Remove the fetch from the table once its leader is done, failing it if
+ * the leader did not finish it.
  */
-void serve_cache(entry *cache_entry, int connfd, char *buf, rio_t rio) {
-    // Send response: read from server, write to client.
-    if ((size_t) rio_writen(connfd, cache_entry->response,
-                            cache_entry->obj_len) != cache_entry->obj_len) {
-        return;
+void end_flight(inflight *flight) {
+    flight_bucket *bucket = &flights[flight->hash % FLIGHT_BUCKETS];
+    pthread_mutex_lock(&bucket->lock);
+    inflight **link = &bucket->head;
+    while (*link != flight) {
+        link = &(*link)->next;
     }
+    *link = flight->next;
+    pthread_mutex_unlock(&bucket->lock);
+    finish_flight(flight, NULL, NULL);
 }
 
 /*
- * Serve the client with a HTTP response.
+ * Forward the rest of the response from pxyfd to clientfd through a pipe
+ * with splice, without copying it to user space: remaining bytes, or up
+ * to the end of the stream if remaining is SIZE_MAX. Falls back to read
+ * and write where splice does not work on the sockets.
  *
- * If error occurs during reading or writing, the function will return.
+ * Return 0 if succeeds, or 1 if fails.
  */
-void serve(int connfd) {
-    char buf[MAXLINE], socket_address[MAXLINE], host[MAXLINE], port[MAXLINE],
-            uri[MAXLINE], method[MAXLINE], resource[MAXLINE];
-
-    // Initialize client-proxy file descriptor.
-    rio_t rio;
-    Rio_readinitb(&rio, connfd);
-
-    // Process request line.
-    ssize_t rc;
-    if ((rc = rio_readlineb(&rio, buf, MAXLINE)) < 0) {
-        return;
+int splice_response(int pxyfd, int clientfd, size_t remaining) {
+    int pipefd[2];
+    if (pipe(pipefd) < 0) {
+        return 1;
     }
-    dbg_printf("Request: %s\n", buf);
-    if (process_request(buf, socket_address, host,
-                        port, uri, method, resource)) {
-        return;
+    ssize_t size = 0;
+    while (remaining > 0
+           && (size = splice(pxyfd, NULL, pipefd[1], NULL,
+                             remaining < RESPONSE_CHUNK ? remaining
+                                                        : RESPONSE_CHUNK,
+                             SPLICE_F_MOVE | SPLICE_F_MORE)) > 0) {
+        if (remaining != SIZE_MAX) {
+            remaining -= size;
+        }
+        count_stat(origin_bytes, size);
+        while (size > 0) {
+            ssize_t n = splice(pipefd[0], NULL, clientfd, NULL, size,
+                               SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n <= 0) {
+                close(pipefd[0]);
+                close(pipefd[1]);
+                return 1;
+            }
+            size -= n;
+        }
     }
-
-    entry *cache_entry = read_entry(uri);
-    if (cache_entry) {                          // Serve cached response
-        serve_cache(cache_entry, connfd, buf, rio);
-    } else {                                    // Serve requested response.
-        serve_request(host, port, uri, socket_address, buf, rio, connfd);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    if (size < 0 && errno == EINVAL) {
+        char buf[RESPONSE_CHUNK];
+        while (remaining > 0
+               && (size = read(pxyfd, buf, remaining < RESPONSE_CHUNK
+                                           ? remaining : RESPONSE_CHUNK)) > 0) {
+            if (rio_writen(clientfd, buf, size) != size) {
+                return 1;
+            }
+            count_stat(origin_bytes, size);
+            if (remaining != SIZE_MAX) {
+                remaining -= size;
+            }
+        }
     }
+    return size < 0 || (size == 0 && remaining != SIZE_MAX && remaining > 0);
 }
 
 /*
- * A thread handler to detach, serve, and free the thread to process a request.
+ * Read from the server into pxybuf, of RESPONSE_CHUNK bytes, until the
+ * empty line that ends the response headers is in, which must be within
+ * MAXLINE bytes. The headers are *head_len bytes long, and the bytes
+ * after them belong to the body.
+ *
+ * Return the bytes read, or 0 if the server closed the connection first,
+ * or -1 if fails or the headers are longer than MAXLINE bytes.
  */
-void *thread(void *thread_arg) {
-    pthread_detach(pthread_self());
-    int connfd = *((int *) thread_arg);
-    Free(thread_arg);
-    serve(connfd);
-    Close(connfd);
-    return NULL;
-}
-
-
+ssize_t read_response_head(int pxyfd, char *pxybuf, size_t *head_len) {
+    size_t len = 0;
+    while (len < MAXLINE) {
+        ssize_t n = read(pxyfd, pxybuf + len, RESPONSE_CHUNK - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 || len > 0 ? -1 : 0;
+        }
+        len += n;
+
+        // Only look for the end within MAXLINE bytes, so it fits in head.
+        size_t searched = len < MAXLINE ? len : MAXLINE;
+        char *end = memmem(pxybuf, searched, "\r\n\r\n", 4);
+        if (end) {
+            *head_len = end - pxybuf + 4;
+            return len;
+        }
+        if ((end = memmem(pxybuf, searched, "\n\n", 2))) {
+            *head_len = end - pxybuf + 2;
+            return len;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Parse the response headers in pxybuf, head_len bytes, into resp, and
+ * copy them to clean without the Connection, Proxy-Connection and
+ * Keep-Alive headers and without the final empty line. A response to a
+ * HEAD request has no body, whatever its Content-Length says.
+ *
+ * Return 0 if succeeds, or 1 if the headers are not valid.
+ */
+int parse_response_head(char *pxybuf, size_t head_len, bool head_request,
+                        char *clean, response_head *resp) {
+    char head[MAXLINE + 1];
+    if (head_len > MAXLINE) {
+        return 1;
+    }
+    memcpy(head, pxybuf, head_len);
+    head[head_len] = '\0';
+
+    char version;
+    if (sscanf(head, "HTTP/1.%c %d", &version, &resp->status) != 2) {
+        return 1;
+    }
+    bool server_keep_alive = version == '1', chunked = false, has_len = false;
+    resp->body_len = 0;
+
+    char *line = head, *line_end;
+    clean[0] = '\0';
+    size_t clean_len = 0;
+    while ((line_end = strchr(line, '\n')) && line_end != line
+           && !(line_end == line + 1 && *line == '\r')) {
+        line_end++;
+        char saved = *line_end;
+        *line_end = '\0';
+        if (!strncasecmp(line, "Connection:", strlen("Connection:"))
+            || !strncasecmp(line, "Proxy-Connection:",
+                            strlen("Proxy-Connection:"))) {
+            if (strcasestr(line, "close")) {
+                server_keep_alive = false;
+            } else if (strcasestr(line, "keep-alive")) {
+                server_keep_alive = true;
+            }
+        } else if (strncasecmp(line, "Keep-Alive:", strlen("Keep-Alive:"))) {
+            if (!strncasecmp(line, "Content-Length:",
+                             strlen("Content-Length:"))) {
+                resp->body_len = strtoul(line + strlen("Content-Length:"),
+                                         NULL, 10);
+                has_len = true;
+            } else if (!strncasecmp(line, "Transfer-Encoding:",
+                                    strlen("Transfer-Encoding:"))) {
+                chunked = true;
+            }
+            strcpy(clean + clean_len, line);
+            clean_len += line_end - line;
+        }
+        *line_end = saved;
+        line = line_end;
+    }
+
+    bool no_body = head_request || resp->status / 100 == 1
+                   || resp->status == 204 || resp->status == 304;
+    if (no_body) {
+        resp->body_len = 0;
+    }
+    resp->framed = no_body || (has_len && !chunked);
+    resp->keep_alive = server_keep_alive && resp->framed;
+    return 0;
+}
+
+/*
+ * Forward the body of the response from the server to the client, size
+ * bytes of which are in pxybuf already, and collect it in obj for the
+ * cache while cacheable. remaining is the length of the body, or SIZE_MAX
+ * if it ends with the stream. Once it is larger than MAX_OBJECT_SIZE,
+ * the rest is spliced to the client. The bytes collected are published to
+ * the followers of flight, if any, once the leader published the headers,
+ * and before they are written to the client. If the client is gone, or
+ * goes while the body is forwarded, *client_ok is cleared, but a response
+ * collected for a flight is still read to its end for the followers.
+ *
+ * Return 0 if the whole body is read, or 1 if fails.
+ */
+int process_response(int pxyfd, int clientfd, char *pxybuf, size_t size,
+                     size_t remaining, obj_buf *obj, bool *cacheable,
+                     inflight *flight, bool *client_ok) {
+    while (true) {
+        if (size > 0) {
+            if (remaining != SIZE_MAX) {
+                remaining -= size;
+            }
+
+            // Write to cache object.
+            if (*cacheable && append_to_cache_obj(obj, pxybuf, size)) {
+                *cacheable = false;
+                if (flight) {
+                    finish_flight(flight, NULL, NULL);
+                }
+                return_obj_buf(obj);
+                if (!*client_ok
+                    || (size_t) rio_writen(clientfd, pxybuf, size) != size) {
+                    return 1;
+                }
+                count_stat(origin_bytes, size);
+                return splice_response(pxyfd, clientfd, remaining);
+            }
+            if (flight && flight->data) {
+                publish_flight(flight, obj->data, flight->head_len, obj->len);
+            }
+
+            if (*client_ok) {
+                if ((size_t) rio_writen(clientfd, pxybuf, size) == size) {
+                    count_stat(origin_bytes, size);
+                } else {
+                    *client_ok = false;
+                }
+            }
+            if (!*client_ok && !(flight && *cacheable)) {
+                return 1;
+            }
+        }
+        if (remaining == 0) {
+            return 0;
+        }
+
+        // Read from server, write to client.
+        ssize_t n = read(pxyfd, pxybuf, remaining < RESPONSE_CHUNK
+                                        ? remaining : RESPONSE_CHUNK);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+        } else if (n < 0) {
+            return 1;
+        } else if (n == 0) {
+            return remaining != SIZE_MAX;
+        }
+        size = n;
+    }
+}
+
+/*
+ * Current time in seconds, from the cheap coarse clock.
+ */
+time_t now_sec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return now.tv_sec;
+}
+
+/*
+ * Initialize the empty pool of idle server connections, and the empty
+ * table of in-flight fetches.
+ */
+void init_pool(void) {
+    for (int i = 0; i < POOL_BUCKETS; i++) {
+        pthread_mutex_init(&idle_pool[i].lock, NULL);
+        idle_pool[i].head = NULL;
+    }
+    for (int i = 0; i < FLIGHT_BUCKETS; i++) {
+        pthread_mutex_init(&flights[i].lock, NULL);
+        flights[i].head = NULL;
+    }
+}
+
+/*
+ * Take an idle connection to the origin from the pool. Connections idle
+ * for longer than UPSTREAM_IDLE_TIMEOUT, or that the server closed or
+ * sent unexpected bytes on, are closed on the way.
+ *
+ * Return the connection, or -1 if the pool has none.
+ */
+int take_idle_conn(char *origin) {
+    pool_bucket *bucket = &idle_pool[hash_url(origin) % POOL_BUCKETS];
+    time_t now = now_sec();
+    while (true) {
+        pthread_mutex_lock(&bucket->lock);
+        idle_conn **link = &bucket->head, *conn = NULL;
+        while (*link) {
+            idle_conn *idle = *link;
+            if (now - idle->since > UPSTREAM_IDLE_TIMEOUT) {
+                *link = idle->next;
+                Close(idle->fd);
+                Free(idle->origin);
+                Free(idle);
+            } else if (!strcmp(idle->origin, origin)) {
+                *link = idle->next;
+                conn = idle;
+                break;
+            } else {
+                link = &idle->next;
+            }
+        }
+        pthread_mutex_unlock(&bucket->lock);
+        if (!conn) {
+            return -1;
+        }
+
+        int fd = conn->fd;
+        Free(conn->origin);
+        Free(conn);
+        char byte;
+        if (recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0
+            && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return fd;
+        }
+        Close(fd);
+    }
+}
+
+/*
+ * Put a connection to the origin into the pool, or close it if the pool
+ * holds MAX_IDLE_PER_ORIGIN connections to the origin already.
+ */
+void put_idle_conn(char *origin, int fd) {
+    pool_bucket *bucket = &idle_pool[hash_url(origin) % POOL_BUCKETS];
+    pthread_mutex_lock(&bucket->lock);
+    int count = 0;
+    for (idle_conn *idle = bucket->head; idle; idle = idle->next) {
+        count += !strcmp(idle->origin, origin);
+    }
+    if (count >= MAX_IDLE_PER_ORIGIN) {
+        pthread_mutex_unlock(&bucket->lock);
+        Close(fd);
+        return;
+    }
+    idle_conn *idle = Malloc(sizeof(idle_conn));
+    idle->origin = Malloc(strlen(origin) + 1);
+    strcpy(idle->origin, origin);
+    idle->fd = fd;
+    idle->since = now_sec();
+    idle->next = bucket->head;
+    bucket->head = idle;
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+/*
+ * Connect a new socket to the address, non-blocking if asked to.
+ *
+ * Return the socket, or -1 if fails.
+ */
+int connect_addr(int family, int socktype, int protocol,
+                 struct sockaddr *addr, socklen_t addrlen, bool nonblocking) {
+    int serverfd = socket(family, socktype | (nonblocking ? SOCK_NONBLOCK : 0),
+                          protocol);
+    if (serverfd < 0) {
+        return -1;
+    }
+    if (connect(serverfd, addr, addrlen) == 0
+        || (nonblocking && errno == EINPROGRESS)) {
+        return serverfd;
+    }
+    close(serverfd);
+    return -1;
+}
+
+/*
+ * Open a connection to the address the origin server was last reached at,
+ * if that was resolved less than DNS_TTL seconds ago. A non-blocking
+ * connection may still be in progress.
+ *
+ * Return the connection, or -1 if there is no such address or fails.
+ */
+int open_remembered(char *host, char *port, bool nonblocking) {
+    char origin[MAXLINE];
+    snprintf(origin, MAXLINE, "%s:%s", host, port);
+    dns_slot *slot = &dns_cache[hash_url(origin) % DNS_SLOTS];
+
+    pthread_rwlock_rdlock(&dns_lock);
+    dns_slot cached = *slot;
+    bool hit = slot->origin && !strcmp(slot->origin, origin)
+               && slot->expires > now_sec();
+    pthread_rwlock_unlock(&dns_lock);
+    if (!hit) {
+        return -1;
+    }
+    return connect_addr(cached.family, cached.socktype, cached.protocol,
+                        (struct sockaddr *) &cached.addr, cached.addrlen,
+                        nonblocking);
+}
+
+/*
+ * Open a connection to the origin server, to the address it was last
+ * reached at if that was resolved less than DNS_TTL seconds ago, or else
+ * to the first address getaddrinfo returns that accepts it, which is
+ * remembered. A non-blocking connection may still be in progress.
+ *
+ * Return the connection, or -1 if fails.
+ */
+int open_origin(char *host, char *port, bool nonblocking) {
+    int serverfd = open_remembered(host, port, nonblocking);
+    if (serverfd >= 0) {
+        return serverfd;
+    }
+
+    // Resolve it again.
+    char origin[MAXLINE];
+    snprintf(origin, MAXLINE, "%s:%s", host, port);
+    dns_slot *slot = &dns_cache[hash_url(origin) % DNS_SLOTS];
+    struct addrinfo hints, *listp, *p;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(host, port, &hints, &listp) != 0) {
+        return -1;
+    }
+    serverfd = -1;
+    for (p = listp; p; p = p->ai_next) {
+        if ((serverfd = connect_addr(p->ai_family, p->ai_socktype,
+                                     p->ai_protocol, p->ai_addr,
+                                     p->ai_addrlen, nonblocking)) >= 0) {
+            break;
+        }
+    }
+    if (p && p->ai_addrlen <= sizeof(struct sockaddr_storage)) {
+        pthread_rwlock_wrlock(&dns_lock);
+        Free(slot->origin);
+        slot->origin = Malloc(strlen(origin) + 1);
+        strcpy(slot->origin, origin);
+        memcpy(&slot->addr, p->ai_addr, p->ai_addrlen);
+        slot->addrlen = p->ai_addrlen;
+        slot->family = p->ai_family;
+        slot->socktype = p->ai_socktype;
+        slot->protocol = p->ai_protocol;
+        slot->expires = now_sec() + DNS_TTL;
+        pthread_rwlock_unlock(&dns_lock);
+    }
+    freeaddrinfo(listp);
+    return serverfd;
+}
+
+/*
+ * When no cached data, serve this request to the corresponding server,
+ * on an idle connection to it if the pool has one. request holds the
+ * rewritten request line and headers. The client is told to keep its
+ * connection if it asked to and the response has a known length; the
+ * server connection goes back to the pool if the server keeps it too.
+ * If the request leads a flight, the response is published to its
+ * followers as it arrives if its length is known and it fits in
+ * MAX_OBJECT_SIZE, or else handed to them once cached; it is fetched to
+ * its end for them even if the client of the leader goes away.
+ *
+ * Return 0 if the client connection can take another request, or 1 if
+ * it is to be closed.
+ */
+int serve_request(char *host, char *port, char *uri, char *request,
+                  bool head_request, bool keep_alive, int connfd,
+                  inflight *flight) {
+    char origin[MAXLINE], pxybuf[RESPONSE_CHUNK], clean[MAXLINE + 64];
+    snprintf(origin, MAXLINE, "%s:%s", host, port);
+
+    // Send request, again on a new connection if an idle one fails.
+    int proxyfd;
+    ssize_t size;
+    size_t head_len;
+    for (bool retry = true; ; retry = false) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool reused = retry && (proxyfd = take_idle_conn(origin)) >= 0;
+        if (!reused && (proxyfd = open_origin(host, port, false)) < 0) {
+            count_stat(errors, 1);
+            return 1;
+        }
+        record_latency(STAGE_CONNECT, &start);
+        if (reused) {
+            count_stat(reused_connects, 1);
+        } else {
+            count_stat(new_connects, 1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if ((size_t) rio_writen(proxyfd, request, strlen(request))
+            == strlen(request)
+            && (size = read_response_head(proxyfd, pxybuf, &head_len)) > 0) {
+            record_latency(STAGE_FIRST_BYTE, &start);
+            break;
+        }
+        Close(proxyfd);
+        if (!reused) {
+            count_stat(errors, 1);
+            return 1;
+        }
+    }
+
+    response_head resp;
+    if (parse_response_head(pxybuf, head_len, head_request, clean, &resp)) {
+        count_stat(errors, 1);
+        Close(proxyfd);
+        return 1;
+    }
+    keep_alive = keep_alive && resp.framed;
+
+    // Collect and publish the response before it goes to the client, so
+    // that followers neither wait for this client nor depend on it.
+    size_t clean_len = strlen(clean);
+    obj_buf entry_obj = take_obj_buf();
+    bool cacheable = !head_request;
+    strcpy(clean + clean_len, header_connection);
+    strcat(clean, "\r\n");
+    if (cacheable) {
+        append_to_cache_obj(&entry_obj, clean, strlen(clean));
+    }
+    size_t total = strlen(clean) + resp.body_len;
+    if (flight && cacheable && resp.framed && total <= MAX_OBJECT_SIZE) {
+        // Allocate it whole, so followers can read it while it grows.
+        entry_obj.data = Realloc(entry_obj.data, total ? total : 1);
+        entry_obj.cap = total;
+        publish_flight(flight, entry_obj.data, clean_len, entry_obj.len);
+    } else if (flight && (!cacheable || (resp.framed
+                                          && total > MAX_OBJECT_SIZE))) {
+        finish_flight(flight, NULL, NULL);
+        flight = NULL;
+    }
+
+    // Send response headers, telling the client whether the connection
+    // stays open. The cached copy always says it does not.
+    strcpy(clean + clean_len, keep_alive ? header_connection_keep_alive
+                                         : header_connection);
+    strcat(clean, "\r\n");
+    bool client_ok = (size_t) rio_writen(connfd, clean, strlen(clean))
+                     == strlen(clean);
+    if (client_ok) {
+        count_stat(origin_bytes, strlen(clean));
+    } else if (!flight) {
+        return_obj_buf(&entry_obj);
+        Close(proxyfd);
+        return 1;
+    }
+
+    // Send response: read from server, write to client.
+    size -= head_len;
+    if (resp.framed && (size_t) size > resp.body_len) {
+        size = resp.body_len;
+    }
+    memmove(pxybuf, pxybuf + head_len, size);
+    if (process_response(proxyfd, connfd, pxybuf, size,
+                         resp.framed ? resp.body_len : SIZE_MAX,
+                         &entry_obj, &cacheable, flight, &client_ok)) {
+        count_stat(errors, 1);
+        if (flight) {
+            finish_flight(flight, NULL, &entry_obj);
+        }
+        return_obj_buf(&entry_obj);
+        Close(proxyfd);
+        return 1;
+    }
+    if (resp.keep_alive) {
+        put_idle_conn(origin, proxyfd);
+    } else {
+        Close(proxyfd);
+    }
+
+    // Save the valid-size response object to cache.
+    if (cacheable) {
+        size_t obj_len = entry_obj.len;
+        char *entry_url = Malloc(sizeof(char) * (strlen(uri) + 1));
+        strcpy(entry_url, uri);
+        entry *new_entry = create_entry(entry_url, detach_obj_buf(&entry_obj),
+                                        obj_len);
+        new_entry->head_len = resp.framed ? clean_len : 0;
+        if (flight) {
+            finish_flight(flight, new_entry, NULL);
+        }
+        put_new_entry(new_entry);
+    } else {
+        return_obj_buf(&entry_obj);
+    }
+    return keep_alive && client_ok ? 0 : 1;
+}
+
+/*
+ * Write bytes from up to to of a response in its cached form to the
+ * client. If the client keeps the connection, the final Connection: close
+ * after the head_len bytes of headers is swapped for a keep-alive one;
+ * from is then either 0 or past that header.
+ *
+ * Return 0 if succeeds, or 1 if fails.
+ */
+int write_cached(int connfd, char *data, size_t head_len, size_t from,
+                 size_t to, bool keep_alive) {
+    struct iovec iov[3];
+    int iovcnt = 0;
+    size_t body = head_len + strlen(header_connection);
+    if (keep_alive && from == 0 && to >= body) {
+        iov[0].iov_base = data;
+        iov[0].iov_len = head_len;
+        iov[1].iov_base = (void *) header_connection_keep_alive;
+        iov[1].iov_len = strlen(header_connection_keep_alive);
+        from = body;
+        iovcnt = 2;
+    }
+    iov[iovcnt].iov_base = data + from;
+    iov[iovcnt].iov_len = to - from;
+    iovcnt++;
+
+    // Send response: headers, connection header, body.
+    struct iovec *next = iov;
+    while (iovcnt > 0) {
+        ssize_t n = writev(connfd, next, iovcnt);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return 1;
+        }
+        while (iovcnt > 0 && (size_t) n >= next->iov_len) {
+            n -= next->iov_len;
+            next++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            next->iov_base = (char *) next->iov_base + n;
+            next->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * When having cached data, serve the client with cached entry. If the
+ * client keeps the connection, the entry's final Connection: close is
+ * swapped for a keep-alive one as the response is written.
+ *
+ * Return 0 if the client connection can take another request, or 1 if
+ * it is to be closed.
+ */
+int serve_cache(entry *cache_entry, int connfd, bool keep_alive) {
+    keep_alive = keep_alive && cache_entry->head_len;
+    if (write_cached(connfd, cache_entry->response, cache_entry->head_len, 0,
+                     cache_entry->obj_len, keep_alive)) {
+        return 1;
+    }
+    return keep_alive ? 0 : 1;
+}
+
+/*
+ * Serve the client with the response of an in-flight fetch, writing its
+ * bytes as the leader publishes them, or the cached response once the
+ * leader is done if it published none.
+ *
+ * Return 0 if the client connection can take another request, 1 if it is
+ * to be closed, or -1 if the fetch failed before anything was written, so
+ * the caller can fetch the response itself.
+ */
+int follow_flight(inflight *flight, int connfd, bool keep_alive) {
+    size_t sent = 0;
+    pthread_mutex_lock(&flight->lock);
+    while (true) {
+        while (flight->status == FLIGHT_RUNNING && flight->published == sent) {
+            pthread_cond_wait(&flight->changed, &flight->lock);
+        }
+        if (flight->status == FLIGHT_FAILED) {
+            pthread_mutex_unlock(&flight->lock);
+            return sent ? 1 : -1;
+        }
+        if (flight->status == FLIGHT_DONE && !flight->data) {
+            pthread_mutex_unlock(&flight->lock);
+            return serve_cache(flight->result, connfd, keep_alive);
+        }
+        bool done = flight->status == FLIGHT_DONE;
+        char *data = done ? flight->result->response : flight->data;
+        size_t head_len = flight->head_len;
+        size_t to = done ? flight->result->obj_len : flight->published;
+        pthread_mutex_unlock(&flight->lock);
+
+        if (write_cached(connfd, data, head_len, sent, to, keep_alive)) {
+            return 1;
+        }
+        sent = to;
+        if (done) {
+            return keep_alive ? 0 : 1;
+        }
+        pthread_mutex_lock(&flight->lock);
+    }
+}
+
+/*
+ * Serve the client with HTTP responses, one request after another while
+ * the client keeps the connection and its next request is already in.
+ * GET requests of HTTP/1.1 clients, or of HTTP/1.0 clients asking for
+ * keep-alive, keep it.
+ *
+ * Return 0 if the client keeps the connection and is to wait for its next
+ * request with the poller, or 1 if the connection is to be closed, also
+ * when error occurs during reading or writing.
+ */
+int serve(int connfd) {
+    char buf[MAXLINE], socket_address[MAXLINE], host[MAXLINE], port[MAXLINE],
+            uri[MAXLINE], method[MAXLINE], resource[MAXLINE], version;
+
+    // Initialize client-proxy file descriptor.
+    rio_t rio;
+    Rio_readinitb(&rio, connfd);
+
+    bool keep_alive = true, first = true;
+    while (keep_alive) {
+        // Give the worker back between requests, unless the next request
+        // is buffered or readable already.
+        if (!first && rio.rio_cnt == 0) {
+            char c;
+            ssize_t n = recv(connfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (n <= 0) {
+                return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)
+                       ? 0 : 1;
+            }
+        }
+        first = false;
+
+        // Process request line and headers.
+        if (rio_readlineb(&rio, buf, MAXLINE) <= 0) {
+            return 1;
+        }
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        dbg_printf("Request: %s\n", buf);
+        if (is_admin_request(buf)) {
+            size_t len;
+            char *response = stats_response(&len);
+            rio_writen(connfd, response, len);
+            Free(response);
+            return 1;
+        }
+        count_stat(requests, 1);
+        if (process_request(buf, socket_address, host,
+                            port, uri, method, resource, &version)) {
+            count_stat(errors, 1);
+            return 1;
+        }
+        header_flags seen = {false, false, false, false, false, false};
+        if (read_headers(&rio, buf, socket_address, &seen)) {
+            count_stat(errors, 1);
+            return 1;
+        }
+        record_latency(STAGE_PARSE, &start);
+        keep_alive = !strcmp(method, "GET") && !seen.close
+                     && (version == '1' || seen.keep_alive);
+
+        entry *cache_entry = read_entry(uri);
+        if (cache_entry) {                      // Serve cached response
+            count_stat(hits, 1);
+            count_stat(hit_bytes, cache_entry->obj_len);
+            keep_alive = !serve_cache(cache_entry, connfd, keep_alive);
+            release_entry(cache_entry);
+            record_latency(STAGE_TOTAL, &start);
+            continue;
+        }
+
+        // Follow a fetch of the same URL in flight, or lead one.
+        inflight *flight = NULL;
+        bool leader = true;
+        if (!strcmp(method, "GET")) {
+            flight = join_flight(uri, &leader);
+            if (!leader) {
+                int res = follow_flight(flight, connfd, keep_alive);
+                release_flight(flight);
+                flight = NULL;
+                if (res >= 0) {
+                    count_stat(coalesced, 1);
+                    keep_alive = !res;
+                    record_latency(STAGE_TOTAL, &start);
+                    continue;
+                }
+            }
+        }
+
+        // Serve requested response.
+        count_stat(misses, 1);
+        keep_alive = !serve_request(host, port, uri, buf,
+                                    !strcmp(method, "HEAD"), keep_alive,
+                                    connfd, flight);
+        if (flight) {
+            end_flight(flight);
+            release_flight(flight);
+        }
+        record_latency(STAGE_TOTAL, &start);
+    }
+    return 1;
+}
+
+/*
+ * Create an empty, bounded queue with n slots.
+ */
+void sbuf_init(sbuf_t *sp, int n) {
+    sp->buf = Malloc(n * sizeof(queued_conn));
+    sp->n = n;
+    sp->front = sp->rear = 0;
+    Sem_init(&sp->mutex, 0, 1);
+    Sem_init(&sp->slots, 0, n);
+    Sem_init(&sp->items, 0, 0);
+}
+
+/*
+ * Insert connfd onto the rear of the queue, stamped with the current
+ * time, waiting while the queue is full.
+ */
+void sbuf_insert(sbuf_t *sp, int connfd) {
+    P(&sp->slots);
+    P(&sp->mutex);
+    queued_conn *item = &sp->buf[(++sp->rear) % (sp->n)];
+    item->connfd = connfd;
+    clock_gettime(CLOCK_MONOTONIC, &item->queued);
+    atomic_fetch_add(&queue_length, 1);
+    V(&sp->mutex);
+    V(&sp->items);
+}
+
+/*
+ * Remove and return the first connection of the queue, waiting while the
+ * queue is empty.
+ */
+queued_conn sbuf_remove(sbuf_t *sp) {
+    P(&sp->items);
+    P(&sp->mutex);
+    queued_conn item = sp->buf[(++sp->front) % (sp->n)];
+    atomic_fetch_sub(&queue_length, 1);
+    V(&sp->mutex);
+    V(&sp->slots);
+    return item;
+}
+
+/*
+ * Add the time since the connection was queued to the queue wait metric.
+ */
+void record_queue_wait(queued_conn *item) {
+    unsigned long wait = elapsed_us(&item->queued);
+    atomic_fetch_add(&queue_wait_hist[latency_bucket(wait)], 1);
+    atomic_fetch_add(&queue_waits, 1);
+    atomic_fetch_add(&queue_wait_total, wait);
+    unsigned long max = atomic_load(&queue_wait_max);
+    while (wait > max
+           && !atomic_compare_exchange_weak(&queue_wait_max, &max, wait)) {
+    }
+}
+
+/*
+ * SIGUSR1 handler: print the queue length and the queue wait metric,
+ * with async-signal-safe output only.
+ */
+void sigusr1_handler(int sig) {
+    int olderrno = errno;
+    unsigned long waits = atomic_load(&queue_waits);
+    unsigned long hist[LATENCY_BUCKETS];
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        hist[bucket] = atomic_load(&queue_wait_hist[bucket]);
+    }
+    unsigned long p50 = bucket_percentile(hist, waits, 50);
+    unsigned long p99 = bucket_percentile(hist, waits, 99);
+    Sio_printf("queue: %d waiting, %lu served, wait mean %lu us, "
+               "p50 < %lu us, p99 < %lu us, max %lu us\n",
+               atomic_load(&queue_length), waits,
+               waits ? atomic_load(&queue_wait_total) / waits : 0,
+               p50, p99, atomic_load(&queue_wait_max));
+    errno = olderrno;
+}
+
+/*
+ * Hand a client kept alive to the poller, which queues it for a worker
+ * again once its next request comes in.
+ */
+void park_client(int connfd) {
+    idle_client *client = Malloc(sizeof(idle_client));
+    client->connfd = connfd;
+    client->since = now_sec();
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = client;
+
+    pthread_mutex_lock(&idle_lock);
+    client->next = &idle_clients;
+    client->prev = idle_clients.prev;
+    client->prev->next = client;
+    idle_clients.prev = client;
+    epoll_ctl(idle_epfd, EPOLL_CTL_ADD, connfd, &event);
+    pthread_mutex_unlock(&idle_lock);
+}
+
+/*
+ * Take the client off the list of clients kept alive and stop watching
+ * it. The caller holds idle_lock.
+ */
+void unpark_client(idle_client *client) {
+    client->prev->next = client->next;
+    client->next->prev = client->prev;
+    epoll_ctl(idle_epfd, EPOLL_CTL_DEL, client->connfd, NULL);
+}
+
+/*
+ * The poller thread: queue a client kept alive for a worker when its next
+ * request, or its close, comes in, and close the clients that have been
+ * idle for CLIENT_IDLE_TIMEOUT seconds.
+ */
+void *poll_idle_clients(void *thread_arg) {
+    struct epoll_event events[MAX_EVENTS];
+    pthread_detach(pthread_self());
+    while (1) {
+        int n = epoll_wait(idle_epfd, events, MAX_EVENTS, 1000);
+        for (int i = 0; i < n; i++) {
+            idle_client *client = events[i].data.ptr;
+            pthread_mutex_lock(&idle_lock);
+            unpark_client(client);
+            pthread_mutex_unlock(&idle_lock);
+            sbuf_insert(&sbuf, client->connfd);
+            Free(client);
+        }
+
+        // The list is in the order clients were parked: oldest first.
+        time_t now = now_sec();
+        pthread_mutex_lock(&idle_lock);
+        while (idle_clients.next != &idle_clients
+               && idle_clients.next->since + CLIENT_IDLE_TIMEOUT <= now) {
+            idle_client *client = idle_clients.next;
+            unpark_client(client);
+            Close(client->connfd);
+            count_stat(clients_closed, 1);
+            Free(client);
+        }
+        pthread_mutex_unlock(&idle_lock);
+    }
+    return NULL;
+}
+
+/*
+ * A worker thread: serve the connections of the queue one after another,
+ * parking those the clients keep between their requests.
+ */
+void *worker(void *thread_arg) {
+    pthread_detach(pthread_self());
+    while (1) {
+        queued_conn item = sbuf_remove(&sbuf);
+        record_queue_wait(&item);
+        if (serve(item.connfd)) {
+            Close(item.connfd);
+            count_stat(clients_closed, 1);
+        } else {
+            park_client(item.connfd);
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Make the file descriptor non-blocking.
+ *
+ * Return 0 if succeeds, or 1 if fails.
+ */
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Open a non-blocking listening socket on port that other sockets of the
+ * process may share with SO_REUSEPORT, so the kernel spreads incoming
+ * connections over the event loops.
+ *
+ * Return the socket, or -1 if fails.
+ */
+int open_reuseport_listenfd(char *port) {
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if (getaddrinfo(NULL, port, &hints, &listp) != 0) {
+        return -1;
+    }
+    for (p = listp; p; p = p->ai_next) {
+        if ((listenfd = socket(p->ai_family, p->ai_socktype,
+                               p->ai_protocol)) < 0) {
+            continue;
+        }
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval,
+                       sizeof(int)) == 0
+            && bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(listenfd);
+        listenfd = -1;
+    }
+    freeaddrinfo(listp);
+
+    if (listenfd < 0 || listen(listenfd, LISTENQ) < 0
+        || set_nonblocking(listenfd)) {
+        if (listenfd >= 0) {
+            close(listenfd);
+        }
+        return -1;
+    }
+    return listenfd;
+}
+
+/*
+ * Set the events epoll reports for the endpoint. Errors and hang-ups are
+ * always reported.
+ */
+void watch(int epfd, endpoint *ep, uint32_t events) {
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = ep;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, ep->fd, &event);
+}
+
+/*
+ * Close the sockets of the connection and queue it on closed_list, to be
+ * freed once the events already returned by epoll_wait are handled.
+ */
+void close_connection(connection *conn, connection **closed_list) {
+    if (conn->closed) {
+        return;
+    }
+    conn->closed = true;
+    if (conn->requested) {
+        record_latency(STAGE_TOTAL, &conn->started);
+    }
+    Close(conn->client.fd);
+    if (conn->server.fd >= 0) {
+        Close(conn->server.fd);
+    }
+    conn->next_closed = *closed_list;
+    *closed_list = conn;
+}
+
+/*
+ * Free a closed connection with the resource it holds.
+ */
+void free_connection(connection *conn) {
+    if (conn->cached) {
+        release_entry(conn->cached);
+    } else {
+        Free(conn->out);
+    }
+    Free(conn->url);
+    return_obj_buf(&conn->obj);
+    Free(conn);
+    count_stat(clients_closed, 1);
+}
+
+/*
+ * Accept every pending client on listenfd, and watch it for its request.
+ */
+void accept_clients(loop_state *loop, int listenfd) {
+    int connfd;
+    while ((connfd = accept(listenfd, NULL, NULL)) >= 0) {
+        if (set_nonblocking(connfd)) {
+            Close(connfd);
+            continue;
+        }
+        connection *conn = Malloc(sizeof(connection));
+        memset(conn, 0, sizeof(connection));
+        conn->loop = loop;
+        conn->client.fd = connfd;
+        conn->client.conn = conn;
+        conn->server.fd = -1;
+        conn->server.conn = conn;
+        conn->state = READ_REQUEST;
+        count_stat(clients_opened, 1);
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &conn->client;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, connfd, &event) < 0) {
+            Close(connfd);
+            Free(conn);
+        }
+    }
+}
+
+/*
+ * Write what is left of the connection's output to fd, as far as the
+ * socket takes it.
+ *
+ * Return 1 if all is written, 0 if the socket is full, or -1 if fails.
+ */
+int write_pending(int fd, connection *conn) {
+    while (conn->out_pos < conn->out_len) {
+        ssize_t n = write(fd, conn->out + conn->out_pos,
+                          conn->out_len - conn->out_pos);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        conn->out_pos += n;
+    }
+    return 1;
+}
+
+/*
+ * Watch the connection being established to the server, and nothing of
+ * the client until it is.
+ *
+ * Return 0 if succeeds, or 1 if fails.
+ */
+int await_server(int epfd, connection *conn, int serverfd) {
+    conn->server.fd = serverfd;
+    struct epoll_event event;
+    event.events = EPOLLOUT;
+    event.data.ptr = &conn->server;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, serverfd, &event) < 0) {
+        return 1;
+    }
+    conn->state = CONNECT_SERVER;
+    watch(epfd, &conn->client, 0);
+    return 0;
+}
+
+/*
+ * A resolver thread: take the queued jobs, open their origins, which may
+ * take a getaddrinfo, and hand them back to their event loops.
+ */
+void *resolver(void *vargp) {
+    pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&resolve_lock);
+        while (!resolve_head) {
+            pthread_cond_wait(&resolve_ready, &resolve_lock);
+        }
+        resolve_job *job = resolve_head;
+        if (!(resolve_head = job->next)) {
+            resolve_tail = NULL;
+        }
+        pthread_mutex_unlock(&resolve_lock);
+
+        job->serverfd = open_origin(job->host, job->port, true);
+        loop_state *loop = job->conn->loop;
+        pthread_mutex_lock(&loop->lock);
+        job->next = loop->done;
+        loop->done = job;
+        pthread_mutex_unlock(&loop->lock);
+        uint64_t one = 1;
+        if (write(loop->resolved.fd, &one, sizeof(one)) < 0) {
+            unix_error("eventfd write error");
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Queue the connection for a resolver thread to open its origin. Until it
+ * comes back, the loop does not watch the client, so no event refers to
+ * the connection and it stays allocated.
+ *
+ * Return 0 if succeeds, or 1 if fails.
+ */
+int resolve_origin(connection *conn, char *host, char *port) {
+    if (epoll_ctl(conn->loop->epfd, EPOLL_CTL_DEL, conn->client.fd,
+                  NULL) < 0) {
+        return 1;
+    }
+    resolve_job *job = Malloc(sizeof(resolve_job));
+    job->conn = conn;
+    job->host = Malloc(strlen(host) + 1);
+    strcpy(job->host, host);
+    job->port = Malloc(strlen(port) + 1);
+    strcpy(job->port, port);
+    job->next = NULL;
+    conn->state = RESOLVE_SERVER;
+
+    pthread_mutex_lock(&resolve_lock);
+    if (resolve_tail) {
+        resolve_tail->next = job;
+    } else {
+        resolve_head = job;
+    }
+    resolve_tail = job;
+    pthread_cond_signal(&resolve_ready);
+    pthread_mutex_unlock(&resolve_lock);
+    return 0;
+}
+
+/*
+ * Take back the connections the resolver threads are done with, watch
+ * their clients again and wait for their servers, or close them if their
+ * origin could not be opened.
+ */
+void finish_resolved(loop_state *loop, connection **closed_list) {
+    uint64_t count;
+    if (read(loop->resolved.fd, &count, sizeof(count)) < 0) {
+        return;
+    }
+    pthread_mutex_lock(&loop->lock);
+    resolve_job *job = loop->done;
+    loop->done = NULL;
+    pthread_mutex_unlock(&loop->lock);
+
+    while (job) {
+        resolve_job *next = job->next;
+        connection *conn = job->conn;
+        int serverfd = job->serverfd;
+        Free(job->host);
+        Free(job->port);
+        Free(job);
+        job = next;
+
+        struct epoll_event event;
+        event.events = 0;
+        event.data.ptr = &conn->client;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, conn->client.fd,
+                      &event) < 0
+            || serverfd < 0 || await_server(loop->epfd, conn, serverfd)) {
+            if (serverfd >= 0 && conn->server.fd < 0) {
+                Close(serverfd);
+            }
+            count_stat(errors, 1);
+            close_connection(conn, closed_list);
+        }
+    }
+}
+
+/*
+ * The request line and headers are in: serve a cached response, or
+ * rewrite the request like serve() does and start connecting to the
+ * server.
+ *
+ * Return 0 if succeeds, or 1 if fails.
+ */
+int start_request(int epfd, connection *conn) {
+    char buf[MAXLINE], socket_address[MAXLINE], host[MAXLINE], port[MAXLINE],
+            uri[MAXLINE], method[MAXLINE], resource[MAXLINE];
+
+    // Process request line.
+    char *line_end = strchr(conn->head, '\n') + 1;
+    size_t line_len = line_end - conn->head;
+    memcpy(buf, conn->head, line_len);
+    buf[line_len] = '\0';
+    dbg_printf("Request: %s\n", buf);
+    if (is_admin_request(buf)) {
+        conn->out = stats_response(&conn->out_len);
+        conn->state = WRITE_CACHED;
+        watch(epfd, &conn->client, EPOLLOUT);
+        return 0;
+    }
+    conn->requested = true;
+    count_stat(requests, 1);
+    char version;
+    if (process_request(buf, socket_address, host,
+                        port, uri, method, resource, &version)) {
+        return 1;
+    }
+    record_latency(STAGE_PARSE, &conn->started);
+
+    // Serve cached response straight from the entry, which the connection
+    // holds a reference to.
+    entry *cache_entry = read_entry(uri);
+    if (cache_entry) {
+        count_stat(hits, 1);
+        count_stat(hit_bytes, cache_entry->obj_len);
+        conn->cached = cache_entry;
+        conn->out = cache_entry->response;
+        conn->out_len = cache_entry->obj_len;
+        conn->state = WRITE_CACHED;
+        watch(epfd, &conn->client, EPOLLOUT);
+        return 0;
+    }
+
+    // Rewrite the request line and headers for the server; the buffer
+    // later holds response bytes on their way to the client.
+    conn->out_cap = strlen(buf) + conn->head_len + MAXLINE;
+    if (conn->out_cap < RESPONSE_CHUNK) {
+        conn->out_cap = RESPONSE_CHUNK;
+    }
+    conn->out = Malloc(conn->out_cap);
+    strcpy(conn->out, buf);
+    header_flags seen = {false, false, false, false, false, false};
+    char *header = line_end;
+    while (*header != '\r' && *header != '\n') {
+        line_end = strchr(header, '\n') + 1;
+        memcpy(buf, header, line_end - header);
+        buf[line_end - header] = '\0';
+        rewrite_header(buf, &seen, false);
+        strcat(conn->out, buf);
+        header = line_end;
+    }
+    end_headers(buf, socket_address, &seen, false);
+    strcat(conn->out, buf);
+    conn->out_len = strlen(conn->out);
+
+    // Initialize for cache entry's url and response object.
+    conn->url = Malloc(sizeof(char) * (strlen(uri) + 1));
+    strcpy(conn->url, uri);
+    conn->obj = take_obj_buf();
+    conn->cacheable = true;
+    count_stat(misses, 1);
+
+    // Open a proxy-server connection, and wait until it is established.
+    // An origin without a fresh remembered address goes to a resolver.
+    clock_gettime(CLOCK_MONOTONIC, &conn->stage_start);
+    int serverfd = open_remembered(host, port, true);
+    if (serverfd < 0) {
+        return resolve_origin(conn, host, port);
+    }
+    return await_server(epfd, conn, serverfd);
+}
+
+/*
+ * Handle events of the client socket: read the request until the empty
+ * line that ends its headers, or write the response.
+ *
+ * Return 0 if succeeds, or 1 if the connection is to be closed.
+ */
+int client_event(int epfd, connection *conn, uint32_t events) {
+    if (conn->state == READ_REQUEST && (events & EPOLLIN)) {
+        if (conn->head_len == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &conn->started);
+        }
+        ssize_t n = read(conn->client.fd, conn->head + conn->head_len,
+                         MAXLINE - 1 - conn->head_len);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EINTR ? 0 : 1;
+        }
+        if (n == 0) {
+            return 1;
+        }
+        conn->head_len += n;
+        conn->head[conn->head_len] = '\0';
+        if (strstr(conn->head, "\r\n\r\n") || strstr(conn->head, "\n\n")) {
+            if (start_request(epfd, conn)) {
+                count_stat(errors, 1);
+                return 1;
+            }
+            return 0;
+        }
+        // Request line and headers must fit in the buffer.
+        return conn->head_len == MAXLINE - 1;
+    }
+
+    if ((conn->state == WRITE_RESPONSE || conn->state == WRITE_CACHED)
+        && (events & EPOLLOUT)) {
+        int res = write_pending(conn->client.fd, conn);
+        if (res <= 0) {
+            return res < 0;
+        }
+        if (conn->state == WRITE_CACHED) {
+            return 1;
+        }
+        // Read on from the server once the client took everything.
+        conn->state = READ_RESPONSE;
+        watch(epfd, &conn->client, 0);
+        watch(epfd, &conn->server, EPOLLIN);
+        return 0;
+    }
+    return (events & (EPOLLERR | EPOLLHUP)) ? 1 : 0;
+}
+
+/*
+ * Handle events of the server socket: finish connecting, send the request,
+ * or read the response and hand it to the client, appending it to the
+ * cache object. At the end of the response, the object is cached if it is
+ * small enough.
+ *
+ * Return 0 if succeeds, or 1 if the connection is to be closed.
+ */
+int server_event(int epfd, connection *conn, uint32_t events) {
+    if (conn->state == CONNECT_SERVER && (events & (EPOLLOUT | EPOLLERR))) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(conn->server.fd, SOL_SOCKET, SO_ERROR, &error, &len)
+            || error) {
+            count_stat(errors, 1);
+            return 1;
+        }
+        record_latency(STAGE_CONNECT, &conn->stage_start);
+        count_stat(new_connects, 1);
+        clock_gettime(CLOCK_MONOTONIC, &conn->stage_start);
+        conn->state = WRITE_REQUEST;
+    }
+
+    if (conn->state == WRITE_REQUEST) {
+        int res = write_pending(conn->server.fd, conn);
+        if (res <= 0) {
+            return res < 0;
+        }
+        conn->state = READ_RESPONSE;
+        watch(epfd, &conn->server, EPOLLIN);
+        return 0;
+    }
+
+    if (conn->state == READ_RESPONSE && (events & (EPOLLIN | EPOLLHUP))) {
+        ssize_t n = read(conn->server.fd, conn->out, conn->out_cap);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EINTR ? 0 : 1;
+        }
+        if (n == 0) {
+            // Save the valid-size response object to cache.
+            if (conn->cacheable) {
+                size_t obj_len = conn->obj.len;
+                put_new_entry(create_entry(conn->url,
+                                           detach_obj_buf(&conn->obj),
+                                           obj_len));
+                conn->url = NULL;
+            }
+            return 1;
+        }
+
+        if (!conn->responding) {
+            record_latency(STAGE_FIRST_BYTE, &conn->stage_start);
+            conn->responding = true;
+        }
+        count_stat(origin_bytes, n);
+
+        // Write to cache object.
+        if (conn->cacheable
+            && append_to_cache_obj(&conn->obj, conn->out, n)) {
+            conn->cacheable = false;
+            return_obj_buf(&conn->obj);
+        }
+        conn->out_len = n;
+        conn->out_pos = 0;
+        conn->state = WRITE_RESPONSE;
+        watch(epfd, &conn->server, 0);
+        watch(epfd, &conn->client, EPOLLOUT);
+        return 0;
+    }
+    return (events & (EPOLLERR | EPOLLHUP)) ? 1 : 0;
+}
+
+/*
+ * An event loop thread: accept clients on a listening socket of its own
+ * and drive all their connections.
+ */
+void *event_loop(void *thread_arg) {
+    char *proxyport = (char *) thread_arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    int listenfd = open_reuseport_listenfd(proxyport);
+    int epfd = epoll_create1(0);
+    if (listenfd < 0 || epfd < 0) {
+        fprintf(stderr, "Cannot listen to port %s: %s\n", proxyport,
+                strerror(errno));
+        exit(1);
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;          // Listening socket
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &event) < 0) {
+        unix_error("epoll_ctl error");
+    }
+
+    // Watch the eventfd the resolver threads wake the loop with.
+    loop_state loop = {.epfd = epfd, .done = NULL};
+    pthread_mutex_init(&loop.lock, NULL);
+    loop.resolved.conn = NULL;
+    if ((loop.resolved.fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        unix_error("eventfd error");
+    }
+    event.data.ptr = &loop.resolved;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, loop.resolved.fd, &event) < 0) {
+        unix_error("epoll_ctl error");
+    }
+
+    while (1) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        connection *closed_list = NULL;
+        for (int i = 0; i < n; i++) {
+            endpoint *ep = (endpoint *) events[i].data.ptr;
+            if (ep == NULL) {
+                accept_clients(&loop, listenfd);
+                continue;
+            }
+            if (ep == &loop.resolved) {
+                finish_resolved(&loop, &closed_list);
+                continue;
+            }
+            connection *conn = ep->conn;
+            if (conn->closed) {
+                continue;
+            }
+            int res = ep == &conn->client
+                      ? client_event(epfd, conn, events[i].events)
+                      : server_event(epfd, conn, events[i].events);
+            if (res) {
+                close_connection(conn, &closed_list);
+            }
+        }
+        // No event of this batch refers to these connections any more.
+        while (closed_list) {
+            connection *conn = closed_list;
+            closed_list = conn->next_closed;
+            free_connection(conn);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Run the proxy with loops event loops, one per thread, main thread
+ * included, and the resolver threads they share.
+ */
+void run_event_loops(char *proxyport, long loops) {
+    pthread_t tid;
+    for (int i = 0; i < RESOLVERS; i++) {
+        Pthread_create(&tid, NULL, resolver, NULL);
+    }
+    for (long i = 1; i < loops; i++) {
+        Pthread_create(&tid, NULL, event_loop, proxyport);
+    }
+    event_loop(proxyport);
+}
+
+/*
+ * Parse a byte count such as "65536", "512k", "64m" or "2g".
+ *
+ * Return the count, or 0 if it is not valid.
+ */
+size_t parse_size(char *arg) {
+    char *end;
+    size_t size = strtoul(arg, &end, 10);
+    switch (tolower((unsigned char) *end)) {
+    case 'g':
+        size <<= 10;
+        // Fall through.
+    case 'm':
+        size <<= 10;
+        // Fall through.
+    case 'k':
+        size <<= 10;
+        end++;
+        break;
+    }
+    return *end ? 0 : size;
+}
+
+
 /* Main routine of the proxy server. */
 int main(int argc, char **argv) {
     // Block SIGPIPE signal.
@@ -346,36 +2586,95 @@ int main(int argc, char **argv) {
     Sigaddset(&mask, SIGPIPE);
     Sigprocmask(SIG_BLOCK, &mask, &prev);
 
-    int listenfd, *connfdp;
+    int listenfd, connfd;
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
     pthread_t tid;
 
-    // Get port number from the command line argument.
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+    // Get options and port number from the command line arguments.
+    bool event_mode = false;
+    long loops = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = DEFAULT_WORKERS, queue_depth = DEFAULT_QUEUE;
+    int opt;
+    while ((opt = getopt(argc, argv, "en:w:q:c:")) != -1) {
+        switch (opt) {
+        case 'e':
+            event_mode = true;
+            break;
+        case 'n':
+            loops = atol(optarg);
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'q':
+            queue_depth = atoi(optarg);
+            break;
+        case 'c':
+            cache_budget = parse_size(optarg);
+            break;
+        default:
+            loops = 0;
+            break;
+        }
+    }
+    if (optind != argc - 1 || loops < 1 || workers < 1 || queue_depth < 1
+        || cache_budget == 0) {
+        fprintf(stderr, "Usage: %s [-e] [-n loops] [-w workers] [-q depth]"
+                        " [-c bytes] <port>\n"
+                        "  -e        serve clients with epoll event loops\n"
+                        "  -n loops  event loops (default: one per core)\n"
+                        "  -w N      worker threads otherwise (default %d)\n"
+                        "  -q N      accepted connections waiting for a"
+                        " worker (default %d)\n"
+                        "  -c bytes  cache budget, with an optional k, m"
+                        " or g suffix (default 1m)\n",
+                argv[0], DEFAULT_WORKERS, DEFAULT_QUEUE);
         exit(1);
     }
 
     // Create server socket - listen to port and accept client sockets.
-    char *proxyport = argv[1];
+    char *proxyport = argv[optind];
 
-    // Initiate the cache.
+    // Initiate the cache and the pool of server connections.
     init_cache();
-    // Initiate the Semaphore.
-    Sem_init(&mutex, 0, 1);
+    init_pool();
+
+    if (event_mode) {
+        run_event_loops(proxyport, loops);
+    }
+
+    // Start the worker pool and the poller of the clients kept alive, and
+    // print the queue metric on SIGUSR1.
+    sbuf_init(&sbuf, queue_depth);
+    for (int i = 0; i < workers; i++) {
+        Pthread_create(&tid, NULL, worker, NULL);
+    }
+    idle_clients.prev = idle_clients.next = &idle_clients;
+    if ((idle_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        unix_error("epoll_create1 error");
+    }
+    Pthread_create(&tid, NULL, poll_idle_clients, NULL);
+    Signal(SIGUSR1, sigusr1_handler);
 
     listenfd = Open_listenfd(proxyport);
     while (1) {
         // Save client info on stack.
         clientlen = sizeof(struct sockaddr_storage);
-        connfdp = malloc(sizeof(int));
-        if (!connfdp) {
-            continue;
-        }
-        *connfdp = Accept(listenfd, (SA * ) & clientaddr, &clientlen);
+        connfd = Accept(listenfd, (SA * ) & clientaddr, &clientlen);
+        count_stat(clients_opened, 1);
+
+        // A worker waits at most this long for a request to come in.
+        struct timeval timeout = {CLIENT_IDLE_TIMEOUT, 0};
+        setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof(timeout));
+        // Headers and body go out in separate writes; don't hold the last
+        // segment of a response back for the client's delayed ACK.
+        int nodelay = 1;
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+                   sizeof(nodelay));
 
-        // Create a thread to handle this request.
-        Pthread_create(&tid, NULL, thread, connfdp);
+        // Queue it for a worker, waiting while the queue is full.
+        sbuf_insert(&sbuf, connfd);
     }
 }
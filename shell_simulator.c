@@ -3,24 +3,33 @@
  *
  * It supports four builtin command: fg, bg, jobs, and quit. 
  * For non-builtin commands, it runs the corresponding executable if exists.
- * It supports I/O redirection, i.e. reading from/writing to files.
+ * It supports I/O redirection, i.e. reading from/writing to files, and
+ * pipelines of commands separated by `|`, which run in one process group
+ * and are controlled as a single job. With -f, it runs the lines of a
+ * script file as background jobs, up to -j of them at a time, and reports
+ * the wall and CPU time of every job.
  *
  * It specifically handles three signals: SIGCHLD, SIGINT, and SIGTSTP.
  *
  * Author: Jinyi Li
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <spawn.h>
 
 #include <ctype.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 
 #include "tsh_helper.h"
@@ -43,16 +52,62 @@
 #define dbg_ensures(...)
 #endif
 
+/* Maximum number of processes of all jobs */
+#define MAXSTAGES 1024
+
 /* A global atomic flag for the parent to get notified by SIGCHLD handler. */
 volatile sig_atomic_t waitpidNeeded;
 
+/* Number of jobs started and not yet terminated, lowered by SIGCHLD handler */
+volatile sig_atomic_t runningJobs;
+
+/* Whether the command lines come from a script file (-f) */
+bool scriptMode;
+
+/* CPU time of the jobs of the script terminated so far, and their number */
+struct timeval scriptUser, scriptSys;
+int scriptJobs;
+
+/*
+ * The processes of the jobs. The job list keeps one pid per job, the pid
+ * of its first process, which is also its process group; every process of
+ * a pipeline has a stage here so that the job ends when all of them have
+ * terminated and stops when none of them is running.
+ */
+typedef enum { STAGE_FREE, STAGE_RUNNING, STAGE_STOPPED, STAGE_DONE } stage_state;
+
+typedef struct {
+    pid_t pid;
+    pid_t pgid;          // pid of the first process of the job
+    stage_state state;
+    int status;          // status reported by wait4 once done
+    struct timespec started;
+    struct timeval user; // CPU time reported by wait4 once done
+    struct timeval sys;
+} stage;
+
+stage stages[MAXSTAGES];
+
 /* Function prototypes */
 pid_t get_valid_pid(struct cmdline_tokens token);
 
 int builtin_command(struct cmdline_tokens token, const char *cmdline);
 
+int split_pipeline(struct cmdline_tokens *token, char **argvs[]);
+
+int free_stages(void);
+
+void add_stage(pid_t pid, pid_t pgid);
+
+void resume_stages(pid_t pgid);
+
+pid_t launch_stage(char **argv, int inputFileId, int outputFileId, pid_t pgid,
+                   const sigset_t *prev);
+
 void eval(const char *cmdline);
 
+void run_script(const char *file, int maxJobs);
+
 void sigchld_handler(int sig);
 
 void sigtstp_handler(int sig);
@@ -75,13 +130,15 @@ int main(int argc, char **argv) {
     char c;
     char cmdline[MAXLINE_TSH]; // Cmdline for fgets
     bool emit_prompt = true;   // Emit prompt (default)
+    char *script = NULL;       // Script file to run instead of stdin
+    int maxJobs = 1;           // Jobs of the script running at a time
 
     // Redirect stderr to stdout (so that driver will get all output
     // on the pipe connected to stdout)
     Dup2(STDOUT_FILENO, STDERR_FILENO);
 
     // Parse the command line
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    while ((c = getopt(argc, argv, "hvpf:j:")) != EOF) {
         switch (c) {
             case 'h': // Prints help message
                 usage();
@@ -92,6 +149,12 @@ int main(int argc, char **argv) {
             case 'p': // Disables prompt printing
                 emit_prompt = false;
                 break;
+            case 'f': // Runs the lines of a script file as background jobs
+                script = optarg;
+                break;
+            case 'j': // Sets the jobs of the script running at a time
+                maxJobs = atoi(optarg);
+                break;
             default:
                 usage();
         }
@@ -132,6 +195,16 @@ int main(int argc, char **argv) {
 
     Signal(SIGQUIT, sigquit_handler);
 
+    // Run the script instead of reading commands
+    if (script != NULL) {
+        if (maxJobs < 1 || maxJobs > MAXJOBS) {
+            printf("-j must be between 1 and %d\n", MAXJOBS);
+            exit(1);
+        }
+        run_script(script, maxJobs);
+        return 0;
+    }
+
     // Execute the shell's read/eval loop
     while (true) {
         if (emit_prompt) {
@@ -252,6 +325,7 @@ int builtin_command(struct cmdline_tokens token, const char *cmdline) {
             processId = get_valid_pid(token);
             if (processId) {
                 jobId = job_from_pid(processId);
+                resume_stages(processId);
                 Kill(-processId, SIGCONT);
                 job_set_state(jobId, BG);
                 Sio_printf("[%d] (%d) %s\n", jobId, processId,
@@ -264,6 +338,7 @@ int builtin_command(struct cmdline_tokens token, const char *cmdline) {
             if (processId) {
                 jobId = job_from_pid(processId);
                 waitpidNeeded = 0;
+                resume_stages(processId);
                 Kill(-processId, SIGCONT);
                 job_set_state(jobId, FG);
                 while (!waitpidNeeded) {
@@ -276,10 +351,153 @@ int builtin_command(struct cmdline_tokens token, const char *cmdline) {
     }
 }
 
+/*
+ * Split the words of a command line into the commands of a pipeline at
+ * every `|` word, which is replaced by the NULL ending the command before.
+ * Print an info message if a command of the pipeline is empty.
+ *
+ * @return the number of commands, or 0 if the pipeline is malformed.
+ */
+int split_pipeline(struct cmdline_tokens *token, char **argvs[]) {
+    int i, count = 0;
+
+    argvs[count++] = token->argv;
+    for (i = 0; i < token->argc; i++) {
+        if (strcmp(token->argv[i], "|") == 0) {
+            token->argv[i] = NULL;
+            argvs[count++] = &token->argv[i + 1];
+        }
+    }
+    token->argv[token->argc] = NULL;
+
+    for (i = 0; i < count; i++) {
+        if (argvs[i][0] == NULL) {
+            Sio_printf("syntax error near '|'\n");
+            return 0;
+        }
+    }
+    return count;
+}
+
+/*
+ * Count the free slots of the stage table.
+ * SIGCHLD must be blocked.
+ *
+ * @return the number of processes that can still be added.
+ */
+int free_stages(void) {
+    int i, count = 0;
+
+    for (i = 0; i < MAXSTAGES; i++) {
+        if (stages[i].state == STAGE_FREE) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/*
+ * Record a running process of the job whose process group is pgid.
+ * SIGCHLD must be blocked, and a slot must be free.
+ */
+void add_stage(pid_t pid, pid_t pgid) {
+    int i;
+
+    for (i = 0; i < MAXSTAGES; i++) {
+        if (stages[i].state == STAGE_FREE) {
+            stages[i].pid = pid;
+            stages[i].pgid = pgid;
+            stages[i].state = STAGE_RUNNING;
+            stages[i].status = 0;
+            clock_gettime(CLOCK_MONOTONIC, &stages[i].started);
+            timerclear(&stages[i].user);
+            timerclear(&stages[i].sys);
+            return;
+        }
+    }
+}
+
+/*
+ * Mark the stopped processes of a job as running before it gets SIGCONT.
+ * SIGCHLD must be blocked.
+ */
+void resume_stages(pid_t pgid) {
+    int i;
+
+    for (i = 0; i < MAXSTAGES; i++) {
+        if (stages[i].state == STAGE_STOPPED && stages[i].pgid == pgid) {
+            stages[i].state = STAGE_RUNNING;
+        }
+    }
+}
+
+/*
+ * Start one command of a job in the process group pgid, or in a new group
+ * if pgid is 0, reading from inputFileId and writing to outputFileId
+ * unless they are -1. The descriptors are close-on-exec, so a child keeps
+ * only its standard input and output.
+ *
+ * Executables are started with posix_spawn, which needs no copy of the
+ * shell's page tables; only the `jobs` builtin, which has to run shell
+ * code in the child, forks. Print an info message if the command cannot
+ * be started.
+ *
+ * @return the pid of the child, or 0 if it could not be started.
+ */
+pid_t launch_stage(char **argv, int inputFileId, int outputFileId, pid_t pgid,
+                   const sigset_t *prev) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    pid_t processId;
+    int err;
+
+    if (strcmp(argv[0], "jobs") == 0) {
+        if ((processId = Fork()) == 0) {
+            setpgid(0, pgid);
+            if (inputFileId >= 0) {
+                Dup2(inputFileId, STDIN_FILENO);
+            }
+            if (outputFileId >= 0) {
+                Dup2(outputFileId, STDOUT_FILENO);
+            }
+            list_jobs(STDOUT_FILENO);
+            _exit(0);
+        }
+        // the later commands may join the group before the child has run
+        setpgid(processId, pgid ? pgid : processId);
+        return processId;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    if (inputFileId >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, inputFileId, STDIN_FILENO);
+    }
+    if (outputFileId >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, outputFileId,
+                                         STDOUT_FILENO);
+    }
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP
+                             | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setsigmask(&attr, prev);
+
+    err = posix_spawn(&processId, argv[0], &actions, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        Sio_printf("%s: %s\n", argv[0], strerror(err));
+        return 0;
+    }
+    return processId;
+}
+
 /*
  * Main routine that parses, interprets, and executes the command line.
- * It runs builtin jobs immediately in the main routine,
- * and it forks a child to run a non-builtin command.
+ * It runs a single builtin command immediately in the main routine,
+ * and it starts a child for every command of a pipeline otherwise.
+ * The children share one process group and form one job. The infile is
+ * read by the first command and the outfile written by the last one.
  *
  * The parent process accepts signals from children and handles it.
  *
@@ -288,11 +506,13 @@ int builtin_command(struct cmdline_tokens token, const char *cmdline) {
 void eval(const char *cmdline) {
     parseline_return parse_result;
     struct cmdline_tokens token;
-    pid_t processId;
+    char **argvs[MAXARGS];
+    pid_t processId, groupId = 0;
     jid_t jobId;
     sigset_t mask, prev;
     job_state state;
-    int isBuiltinCmd, outputFileId = 0, inputFileId = 0;
+    int count, i, pipeFds[2];
+    int outputFileId = -1, inputFileId = -1, nextInputFileId;
 
     // create signal sets
     Sigemptyset(&mask);
@@ -305,71 +525,174 @@ void eval(const char *cmdline) {
     if (parse_result == PARSELINE_ERROR || parse_result == PARSELINE_EMPTY) {
         return;
     }
+    if ((count = split_pipeline(&token, argvs)) == 0) {
+        return;
+    }
 
-    // if builtin command, execute it; else, fork a child and run it in there.
-    isBuiltinCmd = builtin_command(token, cmdline);
+    // if builtin command, execute it; else, start the pipeline.
+    if (count == 1 && builtin_command(token, cmdline)) {
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        if (strcmp(argvs[i][0], "quit") == 0 || strcmp(argvs[i][0], "fg") == 0
+            || strcmp(argvs[i][0], "bg") == 0) {
+            Sio_printf("%s: cannot be part of a pipeline\n", argvs[i][0]);
+            return;
+        }
+    }
 
-    if (!isBuiltinCmd) {
-        Sigprocmask(SIG_BLOCK, &mask, &prev);
+    Sigprocmask(SIG_BLOCK, &mask, &prev);
+    if (free_stages() < count) {
+        Sio_printf("Too many processes\n");
+        Sigprocmask(SIG_SETMASK, &prev, NULL);
+        return;
+    }
 
-        // in child process
-        if ((processId = Fork()) == 0) {
-            Setpgid(0, 0);
-            // unblock SIGCHLD
+    // handle I/O redirection if needed
+    if (token.infile != NULL) {
+        inputFileId = open(token.infile, O_RDONLY | O_CLOEXEC);
+        if (inputFileId < 0) {
+            Sio_printf("%s: %s\n", token.infile, strerror(errno));
             Sigprocmask(SIG_SETMASK, &prev, NULL);
-
-            // handle I/O redirection if needed
-            if (token.infile != NULL) {
-                inputFileId = Open(token.infile, O_RDONLY, DEF_MODE);
-                if (inputFileId == 0) {
-                    Sio_error("Cannot open file.");
-                } else {
-                    Dup2(inputFileId, STDIN_FILENO);
-                }
-            }
-            if (token.outfile != NULL) {
-                outputFileId = Open(token.outfile, O_CREAT | O_TRUNC | O_WRONLY,
-                                    DEF_MODE);
-                if (outputFileId == 0) {
-                    Sio_error("Cannot open file.");
-                } else {
-                    Dup2(outputFileId, STDOUT_FILENO);
-                }
+            return;
+        }
+    }
+    if (token.outfile != NULL) {
+        outputFileId = open(token.outfile,
+                            O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC,
+                            DEF_MODE);
+        if (outputFileId < 0) {
+            Sio_printf("%s: %s\n", token.outfile, strerror(errno));
+            if (inputFileId >= 0) {
+                Close(inputFileId);
             }
+            Sigprocmask(SIG_SETMASK, &prev, NULL);
+            return;
+        }
+    }
 
-            Execve(token.argv[0], token.argv, environ);
+    // start the commands from the first, each reading the pipe of the
+    // one before; the parent closes its copy of every end it hands over
+    for (i = 0; i < count; i++) {
+        int stdoutId = outputFileId;
 
-            // close I/O files
-            if (outputFileId != 0) {
-                Close(outputFileId);
-            }
-            if (inputFileId != 0) {
-                Close(inputFileId);
+        nextInputFileId = -1;
+        if (i < count - 1) {
+            if (pipe2(pipeFds, O_CLOEXEC) < 0) {
+                unix_error("pipe error");
             }
+            stdoutId = pipeFds[1];
+            nextInputFileId = pipeFds[0];
         }
 
-        // in parent process
-        if (parse_result == PARSELINE_FG) {
-            waitpidNeeded = 0;
-            state = FG;
-        } else {
-            state = BG;
-        }
-        jobId = add_job(processId, state, cmdline);
-        // if foreground job, wait; else continue.
-        if (state == FG) {
-            // wait for a SIGCHLD signal; the flag will change to 1
-            while (!waitpidNeeded) {
-                Sigsuspend(&prev);
+        processId = launch_stage(argvs[i], inputFileId, stdoutId, groupId,
+                                 &prev);
+        if (processId != 0) {
+            if (groupId == 0) {
+                groupId = processId;
             }
-        } else {
-            Sio_printf("[%d] (%d) %s\n", jobId, processId, cmdline);
+            add_stage(processId, groupId);
+        }
+
+        if (inputFileId >= 0) {
+            Close(inputFileId);
         }
+        if (stdoutId >= 0) {
+            Close(stdoutId);
+        }
+        inputFileId = nextInputFileId;
+    }
+
+    // no command could be started
+    if (groupId == 0) {
         Sigprocmask(SIG_SETMASK, &prev, NULL);
+        return;
     }
+
+    // in parent process; the lines of a script all run in background
+    if (parse_result == PARSELINE_FG && !scriptMode) {
+        waitpidNeeded = 0;
+        state = FG;
+    } else {
+        state = BG;
+    }
+    jobId = add_job(groupId, state, cmdline);
+    runningJobs++;
+    // if foreground job, wait; else continue.
+    if (state == FG) {
+        // wait for a SIGCHLD signal; the flag will change to 1
+        while (!waitpidNeeded) {
+            Sigsuspend(&prev);
+        }
+    } else if (!scriptMode) {
+        Sio_printf("[%d] (%d) %s\n", jobId, groupId, cmdline);
+    }
+    Sigprocmask(SIG_SETMASK, &prev, NULL);
     return;
 }
 
+/*
+ * Run the command lines of a script file as background jobs, starting the
+ * next one as soon as fewer than maxJobs are running, and wait for the
+ * last ones. Builtin commands run in the shell as they come. The SIGCHLD
+ * handler reports every job as it terminates; print the total wall and
+ * CPU time of the script at the end.
+ *
+ * @param file the script file name
+ * @param maxJobs maximum number of jobs running at a time
+ */
+void run_script(const char *file, int maxJobs) {
+    FILE *scriptFile;
+    char cmdline[MAXLINE_TSH];
+    sigset_t mask, prev;
+    struct timespec start, end;
+    double wall, user, sys;
+
+    if ((scriptFile = fopen(file, "re")) == NULL) {
+        perror(file);
+        exit(1);
+    }
+    scriptMode = true;
+
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGCHLD);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (fgets(cmdline, MAXLINE_TSH, scriptFile) != NULL) {
+        // Remove any trailing newline
+        char *newline = strchr(cmdline, '\n');
+        if (newline != NULL) {
+            *newline = '\0';
+        }
+
+        // wait for a running job to terminate; the handler reaps all the
+        // children that have terminated by the time it runs
+        Sigprocmask(SIG_BLOCK, &mask, &prev);
+        while (runningJobs >= maxJobs) {
+            Sigsuspend(&prev);
+        }
+        Sigprocmask(SIG_SETMASK, &prev, NULL);
+
+        eval(cmdline);
+    }
+    if (ferror(scriptFile)) {
+        app_error("fgets error");
+    }
+    fclose(scriptFile);
+
+    Sigprocmask(SIG_BLOCK, &mask, &prev);
+    while (runningJobs > 0) {
+        Sigsuspend(&prev);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    user = scriptUser.tv_sec + scriptUser.tv_usec / 1e6;
+    sys = scriptSys.tv_sec + scriptSys.tv_usec / 1e6;
+    printf("%d jobs in %.3fs wall, %.3fs user, %.3fs sys (%.2f CPUs busy)\n",
+           scriptJobs, wall, user, sys, wall > 0 ? (user + sys) / wall : 0);
+    Sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
 /*****************
  * Signal handlers
  *****************/
@@ -377,7 +700,10 @@ void eval(const char *cmdline) {
 /*
  * Handle SIGCHLD signals sent out by the kernel.
  * It reaps zombie child processes, handles stopped processes, 
- * and delete the corresponding job from the job list.
+ * and delete the corresponding job from the job list once every process
+ * of the job has terminated. A job is stopped when none of its processes
+ * is running any more. In a script, it reports the exit status, the wall
+ * time and the CPU time of all processes of every job that terminates.
  *
  * @param SIGCHLD signal sent by kernel
  */
@@ -385,31 +711,120 @@ void sigchld_handler(int sig) {
     int oldErrno = errno;
     sigset_t mask, prev;
     jid_t jobId;
-    pid_t processId;
+    pid_t processId, groupId;
     Sigfillset(&mask);
-    int status;
+    int status, i, running, stopped, killer, leader, last, wallMs;
+    struct rusage usage;
+    struct timeval user, sys;
+    struct timespec now;
+    stage *s;
 
     Sigprocmask(SIG_BLOCK, &mask, &prev);
-    while ((processId = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0) {
-        jobId = job_from_pid(processId);
+    while ((processId = wait4(-1, &status, WNOHANG | WUNTRACED,
+                              &usage)) > 0) {
+        s = NULL;
+        for (i = 0; i < MAXSTAGES; i++) {
+            if (stages[i].state != STAGE_FREE && stages[i].pid == processId) {
+                s = &stages[i];
+                break;
+            }
+        }
+        if (s == NULL) {
+            continue;
+        }
+        if (WIFSTOPPED(status)) {
+            s->state = STAGE_STOPPED;
+        } else if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            s->state = STAGE_DONE;
+            s->status = status;
+            s->user = usage.ru_utime;
+            s->sys = usage.ru_stime;
+        } else {
+            continue;
+        }
+
+        // count what is left of the job
+        groupId = s->pgid;
+        jobId = job_from_pid(groupId);
+        running = stopped = 0;
+        killer = leader = last = -1;
+        for (i = 0; i < MAXSTAGES; i++) {
+            if (stages[i].state == STAGE_FREE || stages[i].pgid != groupId) {
+                continue;
+            }
+            // the stages of a job are added in order to free slots
+            if (stages[i].pid == groupId) {
+                leader = i;
+            }
+            last = i;
+            if (stages[i].state == STAGE_RUNNING) {
+                running++;
+            } else if (stages[i].state == STAGE_STOPPED) {
+                stopped++;
+            } else if (killer < 0 && WIFSIGNALED(stages[i].status)
+                       && WTERMSIG(stages[i].status) != SIGPIPE) {
+                // a command killed by a closed pipe is a normal end
+                killer = i;
+            }
+        }
+        if (running > 0 || (stopped > 0 && !WIFSTOPPED(status))) {
+            continue;
+        }
+
         // change this volatile flag to notify parent
         if (fg_job() == jobId) {
             waitpidNeeded = 1;
         }
 
-        if (WIFEXITED(status)) {
-            // job terminated normally
-            delete_job(jobId);
-        } else if (WIFSTOPPED(status)) {
+        if (stopped > 0) {
             // job stopped
             job_set_state(jobId, ST);
             Sio_printf("Job [%d] (%d) stopped by signal %d\n",
-                       jobId, processId, WSTOPSIG(status));
-        } else if (WIFSIGNALED(status)) {
-            // job terminated by signal
+                       jobId, groupId, WSTOPSIG(status));
+        } else {
+            if (killer >= 0) {
+                // job terminated by signal
+                Sio_printf("Job [%d] (%d) terminated by signal %d\n",
+                           jobId, groupId, WTERMSIG(stages[killer].status));
+            }
+            if (scriptMode) {
+                // the status of a pipeline is the status of its last command
+                timerclear(&user);
+                timerclear(&sys);
+                for (i = 0; i < MAXSTAGES; i++) {
+                    if (stages[i].state != STAGE_FREE
+                        && stages[i].pgid == groupId) {
+                        timeradd(&user, &stages[i].user, &user);
+                        timeradd(&sys, &stages[i].sys, &sys);
+                    }
+                }
+                timeradd(&scriptUser, &user, &scriptUser);
+                timeradd(&scriptSys, &sys, &scriptSys);
+                scriptJobs++;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                wallMs = (now.tv_sec - stages[leader].started.tv_sec) * 1000
+                         + (now.tv_nsec - stages[leader].started.tv_nsec)
+                         / 1000000;
+                status = stages[last].status;
+                Sio_printf("Job [%d] (%d) %s %d, %d ms wall, %d ms user, "
+                           "%d ms sys: %s\n", jobId, groupId,
+                           WIFEXITED(status) ? "exit" : "signal",
+                           WIFEXITED(status) ? WEXITSTATUS(status)
+                                             : WTERMSIG(status),
+                           wallMs,
+                           (int)(user.tv_sec * 1000 + user.tv_usec / 1000),
+                           (int)(sys.tv_sec * 1000 + sys.tv_usec / 1000),
+                           job_get_cmdline(jobId));
+            }
+            // job terminated
             delete_job(jobId);
-            Sio_printf("Job [%d] (%d) terminated by signal %d\n",
-                       jobId, processId, WTERMSIG(status));
+            runningJobs--;
+            for (i = 0; i < MAXSTAGES; i++) {
+                if (stages[i].state != STAGE_FREE
+                    && stages[i].pgid == groupId) {
+                    stages[i].state = STAGE_FREE;
+                }
+            }
         }
     }
     Sigprocmask(SIG_SETMASK, &prev, NULL);